@@ -0,0 +1,129 @@
+/* Bump allocator for matrix temporaries
+ *
+ *   Michael Albert
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+int arena_init (struct arena *a, size_t size)
+{
+  size = ARENA_BYTES(1, size);
+  a->base = size ? (char *) aligned_alloc(ARENA_ALIGN, size) : NULL;
+  a->size = size;
+  a->used = 0;
+  a->owner = 1;
+  return (size && a->base == NULL) ? -1 : 0;
+}
+
+/* Length actually mapped for bytes: whole huge pages for big
+ * regions, whole pages for the rest */
+static size_t page_round (size_t bytes)
+{
+  size_t unit = bytes >= ARENA_HUGE_PAGE ? ARENA_HUGE_PAGE
+    : (size_t) sysconf(_SC_PAGESIZE);
+
+  return (bytes + unit - 1) / unit * unit;
+}
+
+static void *map_anon (size_t len, int flags)
+{
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+void *arena_pages (size_t bytes, int backing)
+{
+  size_t len = page_round(bytes), head;
+  char *p;
+
+  if (len == 0)
+    return NULL;
+  if (len < ARENA_HUGE_PAGE || backing == ARENA_SMALL)
+    return map_anon(len, 0);
+  if (backing == ARENA_HUGETLB && (p = map_anon(len, MAP_HUGETLB)) != NULL)
+    return p;
+
+  /* Map a huge page extra and trim it so the region starts on a huge
+   * page boundary, where the kernel can back it with huge pages */
+  if ((p = (char *) map_anon(len + ARENA_HUGE_PAGE, 0)) == NULL)
+    return NULL;
+  head = (ARENA_HUGE_PAGE - (uintptr_t) p % ARENA_HUGE_PAGE) % ARENA_HUGE_PAGE;
+  if (head != 0)
+    munmap(p, head);
+  munmap(p + head + len, ARENA_HUGE_PAGE - head);
+  p += head;
+  madvise(p, len, MADV_HUGEPAGE);
+  return p;
+}
+
+void arena_unpages (void *p, size_t bytes)
+{
+  if (p != NULL)
+    munmap(p, page_round(bytes));
+}
+
+int arena_map (struct arena *a, size_t size, int backing)
+{
+  size = size ? page_round(ARENA_BYTES(1, size)) : 0;
+  a->base = size ? (char *) arena_pages(size, backing) : NULL;
+  a->size = a->base != NULL ? size : 0;
+  a->used = 0;
+  a->owner = 2;
+  return (size && a->base == NULL) ? -1 : 0;
+}
+
+int arena_reserve (struct arena *a, size_t size, int backing)
+{
+  if (ARENA_BYTES(1, size) <= a->size - a->used)
+    return 0;
+  if (a->used != 0)
+    return -1;
+  arena_free(a);
+  return arena_map(a, size, backing);
+}
+
+int arena_sub (struct arena *parent, struct arena *child, size_t size)
+{
+  child->base = (char *) arena_alloc(parent, size);
+  child->size = ARENA_BYTES(1, size);
+  child->used = 0;
+  child->owner = 0;
+  return (size && child->base == NULL) ? -1 : 0;
+}
+
+void *arena_alloc (struct arena *a, size_t bytes)
+{
+  size_t need = ARENA_BYTES(1, bytes);
+
+  if (need > a->size - a->used)
+    return NULL;
+  void *p = a->base + a->used;
+  a->used += need;
+  return p;
+}
+
+size_t arena_mark (struct arena *a)
+{
+  return a->used;
+}
+
+void arena_release (struct arena *a, size_t mark)
+{
+  a->used = mark;
+}
+
+void arena_free (struct arena *a)
+{
+  if (a->owner == 1)
+    free(a->base);
+  else if (a->owner == 2)
+    arena_unpages(a->base, a->size);
+  a->base = NULL;
+  a->size = a->used = 0;
+}
@@ -0,0 +1,79 @@
+/* Bump allocator for matrix temporaries
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Every block handed out is aligned to this many bytes */
+#define ARENA_ALIGN 64
+
+/* One contiguous region, carved up front to back.  Blocks are never
+ * freed one by one: arena_mark remembers a position and
+ * arena_release drops everything allocated after it.
+ */
+struct arena {
+  char *base;
+  size_t size, used;
+  int owner;  /* base from arena_init 1, arena_map 2, else 0 */
+};
+
+/* Bytes to reserve for count blocks of bytes each */
+#define ARENA_BYTES(count, bytes) \
+  ((size_t)(count) * (((size_t)(bytes) + ARENA_ALIGN - 1) / ARENA_ALIGN \
+		      * ARENA_ALIGN))
+
+/* Allocate a region of size bytes; returns -1 if that fails */
+int arena_init (struct arena *a, size_t size);
+
+/* Page backing for arena_map and arena_pages:
+ *  ARENA_SMALL   -- ordinary pages
+ *  ARENA_THP     -- aligned to a huge page and advised for transparent
+ *                   huge pages, which the kernel may or may not give
+ *  ARENA_HUGETLB -- explicit huge pages from the pool the admin
+ *                   reserved (vm.nr_hugepages), or ARENA_THP when
+ *                   there are not enough of them
+ *  Regions smaller than a huge page always get ordinary pages.
+ */
+#define ARENA_SMALL   0
+#define ARENA_THP     1
+#define ARENA_HUGETLB 2
+#define ARENA_HUGE_PAGE ((size_t) 2 << 20)
+
+/* Map bytes of zeroed memory with the given backing, or NULL.
+ *  Sizes of a huge page or more are rounded up to whole huge pages;
+ *  arena_unpages must be given the same bytes. */
+void *arena_pages (size_t bytes, int backing);
+void arena_unpages (void *p, size_t bytes);
+
+/* arena_init with the region from arena_pages */
+int arena_map (struct arena *a, size_t size, int backing);
+
+/* Make room for size more bytes:
+ *  An empty arena smaller than that is remapped with backing, one
+ *  that is big enough is kept, so an arena reserved before every use
+ *  only goes back to the system when a bigger size than ever before
+ *  comes along.  Returns -1 if the memory can't be had, or if blocks
+ *  are still allocated and the rest is too small.
+ */
+int arena_reserve (struct arena *a, size_t size, int backing);
+
+/* Carve size bytes off parent as a separate arena, so threads can
+ * each allocate from their own piece.  Returns -1 if parent is full.
+ */
+int arena_sub (struct arena *parent, struct arena *child, size_t size);
+
+/* Aligned block of bytes, or NULL when the arena is full */
+void *arena_alloc (struct arena *a, size_t bytes);
+
+size_t arena_mark (struct arena *a);
+void arena_release (struct arena *a, size_t mark);
+
+/* Free the region of an arena made by arena_init or arena_map */
+void arena_free (struct arena *a);
+
+#endif
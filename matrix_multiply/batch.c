@@ -0,0 +1,217 @@
+/* Batched small matrix multiply
+ *
+ *   Michael Albert
+ *
+ *  A single small multiply is over before a thread could be woken
+ *  for part of it, so a batch is split by problem instead: each pool
+ *  task is a run of whole problems.  The blocked kernel's loop
+ *  overhead also dominates at these sizes, so the common square sizes
+ *  get kernels with every bound a compile time constant, built for
+ *  each instruction set, which the compiler unrolls and vectorises
+ *  completely along the rows of B and C.
+ */
+
+#include <string.h>
+#include "batch.h"
+#include "kernel.h"
+
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
+
+typedef void (*fixed_t) (const double *A, int lda, const double *B,
+			 int ldb, double *C, int ldc);
+
+/* N x N times N x N in plain C, every bound a constant */
+#define FIXED_GEMM(name, N)						\
+  static void name (const double *A, int lda, const double *B,	\
+		    int ldb, double *C, int ldc)			\
+  {									\
+    int ix, jx, kx;							\
+									\
+    for (ix = 0; ix < N; ix++) {					\
+      double c[N] = { 0 };						\
+      for (kx = 0; kx < N; kx++)					\
+	for (jx = 0; jx < N; jx++)					\
+	  c[jx] += A[idx(ix,kx,lda)] * B[idx(kx,jx,ldb)];		\
+      for (jx = 0; jx < N; jx++)					\
+	C[idx(ix,jx,ldc)] = c[jx];					\
+    }									\
+  }
+
+/* Past 8 the register-tiled kernel_dgemm is already faster */
+FIXED_GEMM(fixed_scalar_4, 4)
+FIXED_GEMM(fixed_scalar_8, 8)
+static const fixed_t fixed_scalar[] = { fixed_scalar_4, fixed_scalar_8,
+					NULL, NULL, NULL };
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* N x N with SIMD: C is covered by RB x CB register tiles of W wide
+ * vectors, as in the micro-kernels of kernel.c, but with N, and so
+ * every loop, fixed so the whole thing unrolls into straight line
+ * broadcasts and FMAs.  N must be a multiple of RB and of CB*W.
+ */
+#define FIXED_SIMD(name, isa, N, vec, W, RB, CB, setzero, loadu,	\
+		   storeu, bcast, fmadd)				\
+  __attribute__((target(isa)))						\
+  static void name (const double *A, int lda, const double *B,	\
+		    int ldb, double *C, int ldc)			\
+  {									\
+    int i0, j0, ix, jx, kx;						\
+									\
+    for (i0 = 0; i0 < N; i0 += RB) {					\
+      for (j0 = 0; j0 < N; j0 += CB * W) {				\
+	vec c[RB][CB];							\
+	_Pragma("GCC unroll 8")						\
+	for (ix = 0; ix < RB; ix++)					\
+	  _Pragma("GCC unroll 2")					\
+	  for (jx = 0; jx < CB; jx++)					\
+	    c[ix][jx] = setzero();					\
+	_Pragma("GCC unroll 4")						\
+	for (kx = 0; kx < N; kx++) {					\
+	  vec b[CB];							\
+	  _Pragma("GCC unroll 2")					\
+	  for (jx = 0; jx < CB; jx++)					\
+	    b[jx] = loadu(&B[idx(kx,j0 + jx*W,ldb)]);			\
+	  _Pragma("GCC unroll 8")					\
+	  for (ix = 0; ix < RB; ix++) {					\
+	    vec a = bcast(A[idx(i0 + ix,kx,lda)]);			\
+	    _Pragma("GCC unroll 2")					\
+	    for (jx = 0; jx < CB; jx++)					\
+	      c[ix][jx] = fmadd(a, b[jx], c[ix][jx]);			\
+	  }								\
+	}								\
+	_Pragma("GCC unroll 8")						\
+	for (ix = 0; ix < RB; ix++)					\
+	  _Pragma("GCC unroll 2")					\
+	  for (jx = 0; jx < CB; jx++)					\
+	    storeu(&C[idx(i0 + ix,j0 + jx*W,ldc)], c[ix][jx]);	\
+      }									\
+    }									\
+  }
+
+#define AVX2_OPS  __m256d, 4
+#define AVX2_FNS  _mm256_setzero_pd, _mm256_loadu_pd, _mm256_storeu_pd, \
+		  _mm256_set1_pd, _mm256_fmadd_pd
+#define AVX512_OPS  __m512d, 8
+#define AVX512_FNS  _mm512_setzero_pd, _mm512_loadu_pd, _mm512_storeu_pd, \
+		    _mm512_set1_pd, _mm512_fmadd_pd
+
+/* Register tiles of at most 16 accumulators on AVX-512 and 8 on
+ * AVX2; size 4 is a single ymm wide on both */
+#define FIXED_CALL(...) FIXED_SIMD(__VA_ARGS__)
+FIXED_CALL(fixed_avx2_4, "avx2,fma", 4, AVX2_OPS, 4, 1, AVX2_FNS)
+FIXED_CALL(fixed_avx2_8, "avx2,fma", 8, AVX2_OPS, 4, 2, AVX2_FNS)
+FIXED_CALL(fixed_avx2_16, "avx2,fma", 16, AVX2_OPS, 4, 2, AVX2_FNS)
+FIXED_CALL(fixed_avx2_32, "avx2,fma", 32, AVX2_OPS, 4, 2, AVX2_FNS)
+FIXED_CALL(fixed_avx2_64, "avx2,fma", 64, AVX2_OPS, 4, 2, AVX2_FNS)
+static const fixed_t fixed_avx2[] = { fixed_avx2_4, fixed_avx2_8,
+				      fixed_avx2_16, fixed_avx2_32,
+				      fixed_avx2_64 };
+
+FIXED_CALL(fixed_avx512_8, "avx512f", 8, AVX512_OPS, 8, 1, AVX512_FNS)
+FIXED_CALL(fixed_avx512_16, "avx512f", 16, AVX512_OPS, 8, 2, AVX512_FNS)
+FIXED_CALL(fixed_avx512_32, "avx512f", 32, AVX512_OPS, 8, 2, AVX512_FNS)
+FIXED_CALL(fixed_avx512_64, "avx512f", 64, AVX512_OPS, 8, 2, AVX512_FNS)
+static const fixed_t fixed_avx512[] = { fixed_avx2_4, fixed_avx512_8,
+					fixed_avx512_16, fixed_avx512_32,
+					fixed_avx512_64 };
+#endif
+
+/* Specialised kernel for a square size n, matching the micro-kernels
+ * kernel_select chose, or NULL */
+static fixed_t fixed_kernel (int n)
+{
+  const fixed_t *set = fixed_scalar;
+  int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (strcmp(kernel_isa(), "avx512") == 0)
+    set = fixed_avx512;
+  else if (strcmp(kernel_isa(), "avx2") == 0)
+    set = fixed_avx2;
+#endif
+  for (i = 0; i < 5; i++)
+    if (n == 4 << i)
+      return set[i];
+  return NULL;
+}
+
+/* A batch handed to the pool: problem i comes from the pointer
+ * arrays when they are given, otherwise from the strides */
+struct batch {
+  struct pool *pool;
+  int m, n, k, lda, ldb, ldc;
+  const double *const *Av, *const *Bv;
+  double *const *Cv;
+  const double *A, *B;
+  double *C;
+  long sa, sb, sc;
+  int count, chunk;  /* problems, and problems per task */
+  fixed_t fixed;
+};
+
+static void run_range (struct batch *b, int first, int last)
+{
+  for (int i = first; i < last; i++) {
+    const double *A = b->Av ? b->Av[i] : b->A + i * b->sa;
+    const double *B = b->Bv ? b->Bv[i] : b->B + i * b->sb;
+    double *C = b->Cv ? b->Cv[i] : b->C + i * b->sc;
+    if (b->fixed != NULL)
+      b->fixed(A, b->lda, B, b->ldb, C, b->ldc);
+    else
+      kernel_dgemm(b->m, b->n, b->k, A, b->lda, B, b->ldb, C, b->ldc);
+  }
+}
+
+static void batch_body (void *arg, int threadn, int threads)
+{
+  struct batch *b = (struct batch *) arg;
+  int task;
+
+  pool_queue(b->pool, threadn, (b->count + b->chunk - 1) / b->chunk);
+  pool_barrier(b->pool);
+  while ((task = pool_next_task(b->pool, threadn)) >= 0) {
+    int first = task * b->chunk;
+    run_range(b, first, first + b->chunk < b->count ? first + b->chunk
+	                                             : b->count);
+  }
+}
+
+/* Runs of a few problems per task, so idle workers can still steal
+ * some once their own share is done */
+#define BATCH_TASKS_PER_THREAD 8
+
+static void run_batch (struct batch *b)
+{
+  if (b->count <= 0)
+    return;
+  if (b->m == b->n && b->n == b->k)
+    b->fixed = fixed_kernel(b->n);
+  if (b->pool == NULL || pool_threads(b->pool) == 1) {
+    run_range(b, 0, b->count);
+    return;
+  }
+  int tasks = pool_threads(b->pool) * BATCH_TASKS_PER_THREAD;
+  b->chunk = (b->count + tasks - 1) / tasks;
+  pool_run(b->pool, batch_body, b);
+}
+
+void batch_dgemm (struct pool *pool, int m, int n, int k,
+		  const double *const *A, int lda, const double *const *B,
+		  int ldb, double *const *C, int ldc, int count)
+{
+  struct batch b = { pool, m, n, k, lda, ldb, ldc, A, B, C,
+		     NULL, NULL, NULL, 0, 0, 0, count, 1, NULL };
+  run_batch(&b);
+}
+
+void batch_dgemm_strided (struct pool *pool, int m, int n, int k,
+			  const double *A, int lda, long sa,
+			  const double *B, int ldb, long sb,
+			  double *C, int ldc, long sc, int count)
+{
+  struct batch b = { pool, m, n, k, lda, ldb, ldc, NULL, NULL, NULL,
+		     A, B, C, sa, sb, sc, count, 1, NULL };
+  run_batch(&b);
+}
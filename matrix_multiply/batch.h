@@ -0,0 +1,30 @@
+/* Batched small matrix multiply
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "pool.h"
+
+/* Many independent multiplies of the same shape:
+ *  C[i] (m by n)  =  A[i] (m by k) times B[i] (k by n),  i < count
+ *  lda, ldb and ldc are the row lengths of every A, B and C.  Whole
+ *  problems are spread over the workers of pool, which may be NULL
+ *  to run them on the calling thread.  Square problems of size 4, 8,
+ *  16, 32 or 64 use kernels compiled for that size (only 4 and 8
+ *  without SIMD); anything else goes through kernel_dgemm.
+ */
+void batch_dgemm (struct pool *pool, int m, int n, int k,
+		  const double *const *A, int lda, const double *const *B,
+		  int ldb, double *const *C, int ldc, int count);
+
+/* The same with problem i at A + i*sa, B + i*sb and C + i*sc */
+void batch_dgemm_strided (struct pool *pool, int m, int n, int k,
+			  const double *A, int lda, long sa,
+			  const double *B, int ldb, long sb,
+			  double *C, int ldc, long sc, int count);
+
+#endif
@@ -0,0 +1,125 @@
+/* Benchmark timing and statistics
+ *
+ *   Michael Albert
+ *
+ *  Every repetition is timed on its own with the monotonic clock, so
+ *  the report can give the spread and not just a total, and so that
+ *  one slow outlier moves the mean but not the median.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+
+int bench_format (const char *name)
+{
+  const char *names[] = { "csv", "json" };
+
+  for (int i = 0; i < 2; i++)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+uint64_t bench_ns (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Square root by Newton's method, to keep libm out of the build */
+static double root (double v)
+{
+  double r = v > 1 ? v : 1;
+
+  if (v <= 0)
+    return 0;
+  for (int i = 0; i < 64; i++)
+    r = (r + v / r) / 2;
+  return r;
+}
+
+/* Element at 1-based rank r of sorted s, clamped to 1 .. n */
+static double ranked (const double *s, int n, int r)
+{
+  return s[(r < 1 ? 1 : r > n ? n : r) - 1];
+}
+
+static void summarise (double *s, int n, struct bench_stats *st)
+{
+  double sum = 0, sq = 0;
+
+  qsort(s, n, sizeof(double), cmp_double);
+  for (int i = 0; i < n; i++)
+    sum += s[i];
+  st->reps = n;
+  st->min = s[0];
+  st->mean = sum / n;
+  for (int i = 0; i < n; i++)
+    sq += (s[i] - st->mean) * (s[i] - st->mean);
+  st->stddev = n > 1 ? root(sq / (n - 1)) : 0;
+  st->median = n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2;
+  st->p95 = ranked(s, n, (int) (0.95 * n + 0.999999));
+
+  /* The number of samples below the median is binomial(n, 1/2), so
+   * ranks n/2 -+ 1.96 sqrt(n)/2 bracket it 95% of the time */
+  double half = 1.96 * root(n) / 2;
+  st->ci_lo = ranked(s, n, (int) (n / 2.0 - half));
+  st->ci_hi = ranked(s, n, (int) (n / 2.0 + half + 1));
+}
+
+int bench_run (void (*fn) (void *arg), void *arg, int warmup, int reps,
+	       struct bench_stats *st)
+{
+  double *secs;
+
+  if (reps < 1 || (secs = (double *) malloc(sizeof(double) * reps)) == NULL)
+    return -1;
+  for (int i = 0; i < warmup; i++)
+    fn(arg);
+  for (int i = 0; i < reps; i++) {
+    uint64_t start = bench_ns();
+    fn(arg);
+    secs[i] = (bench_ns() - start) / 1e9;
+  }
+  summarise(secs, reps, st);
+  free(secs);
+  return 0;
+}
+
+void bench_print (FILE *out, int format, const struct bench_case *c,
+		  int warmup, const struct bench_stats *st)
+{
+  double gflops = c->flops / st->median / 1e9;
+  double gbs = c->bytes / st->median / 1e9;
+
+  if (format == BENCH_CSV) {
+    fprintf (out, "program,kernel,isa,dtype,threads,m,n,k,power,warmup,"
+	     "reps,min_s,median_s,p95_s,mean_s,stddev_s,ci_lo_s,ci_hi_s,"
+	     "gflops,gbs\n");
+    fprintf (out, "%s,%s,%s,%s,%d,%ld,%ld,%ld,%d,%d,%d,%.9f,%.9f,%.9f,"
+	     "%.9f,%.9f,%.9f,%.9f,%.3f,%.3f\n",
+	     c->program, c->kernel, c->isa, c->dtype, c->threads, c->m, c->n,
+	     c->k, c->power, warmup, st->reps, st->min, st->median, st->p95,
+	     st->mean, st->stddev, st->ci_lo, st->ci_hi, gflops, gbs);
+  } else {
+    fprintf (out, "{\"program\": \"%s\", \"kernel\": \"%s\", \"isa\": \"%s\", "
+	     "\"dtype\": \"%s\", \"threads\": %d, \"m\": %ld, \"n\": %ld, "
+	     "\"k\": %ld, \"power\": %d, \"warmup\": %d, \"reps\": %d, "
+	     "\"min_s\": %.9f, \"median_s\": %.9f, \"p95_s\": %.9f, "
+	     "\"mean_s\": %.9f, \"stddev_s\": %.9f, \"ci_lo_s\": %.9f, "
+	     "\"ci_hi_s\": %.9f, \"gflops\": %.3f, \"gbs\": %.3f}\n",
+	     c->program, c->kernel, c->isa, c->dtype, c->threads, c->m, c->n,
+	     c->k, c->power, warmup, st->reps, st->min, st->median, st->p95,
+	     st->mean, st->stddev, st->ci_lo, st->ci_hi, gflops, gbs);
+  }
+  fflush(out);
+}
@@ -0,0 +1,57 @@
+/* Benchmark timing and statistics
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Output formats for bench_print */
+#define BENCH_CSV  0
+#define BENCH_JSON 1
+
+/* BENCH_CSV or BENCH_JSON for "csv" or "json", -1 otherwise */
+int bench_format (const char *name);
+
+/* Nanoseconds on the monotonic clock */
+uint64_t bench_ns (void);
+
+/* Summary of the timed repetitions, in seconds.  ci_lo .. ci_hi is a
+ * distribution free 95% confidence interval for the median, from the
+ * order statistics, so it is only as tight as reps allows.
+ */
+struct bench_stats {
+  int reps;
+  double min, median, p95, mean, stddev;
+  double ci_lo, ci_hi;
+};
+
+/* What was measured, for the report.  flops and bytes are per
+ * repetition; bytes counts each element of A, B and C moved once, so
+ * the bandwidth is the least the kernel could have needed.
+ */
+struct bench_case {
+  const char *program, *kernel, *isa, *dtype;
+  int threads;
+  long m, n, k;
+  int power;            /* 0 for a plain multiply */
+  double flops, bytes;
+};
+
+/* Run fn(arg) warmup times untimed, then reps times each timed on
+ * its own.  Returns -1 if reps < 1 or out of memory.
+ */
+int bench_run (void (*fn) (void *arg), void *arg, int warmup, int reps,
+	       struct bench_stats *st);
+
+/* One record: CSV is a header line and a row, JSON a single object
+ * on one line, so repeated runs append cleanly to a file.
+ */
+void bench_print (FILE *out, int format, const struct bench_case *c,
+		  int warmup, const struct bench_stats *st);
+
+#endif
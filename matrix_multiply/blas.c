@@ -0,0 +1,205 @@
+/* BLAS style matrix multiply
+ *
+ *   Michael Albert
+ *
+ *  Everything is turned into a row-major multiply first: a
+ *  column-major C is the row-major transpose C' = op(B)' op(A)', and
+ *  a column-major array read by rows is its own transpose, so only
+ *  A and B and their transpose flags swap.  Transposes are then
+ *  absorbed by packing, which reads a transposed operand down its
+ *  columns into the same panels, and alpha and beta are a kernel
+ *  epilogue finished in registers.
+ */
+
+#include <string.h>
+#include "blas.h"
+#include "kernel.h"
+#include "arena.h"
+
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
+
+/* Output tiles:
+ *  MC rows down, a multiple of MR, and BLAS_TILE_N across, a multiple
+ *  of NR, halved until every worker gets a few of them.
+ */
+#define BLAS_TILE_N 512
+#define BLAS_TILES_PER_THREAD 4
+
+/* A row-major multiply handed to the pool */
+struct gemm {
+  struct pool *pool;
+  long m, n, k;
+  const double *A, *B;
+  long lda, ldb;
+  int transa, transb;
+  double *C;
+  long ldc;
+  double *Ap, *Bp;
+  const struct kernel_epilogue *ep;
+  int tm, tn, rows, cols;  /* tile size, and tiles down and across */
+};
+
+/* Bytes of packed panels for n rows or cols in groups of w, k deep */
+static size_t panels (long n, int w, long k)
+{
+  return ARENA_BYTES(1, sizeof(double) * (size_t)((n + w - 1) / w) * w * k);
+}
+
+static void tile_grid (struct gemm *g, int threads)
+{
+  int mr = kernel_mr(), nr = kernel_nr(), mc, kc, nc;
+
+  kernel_blocks(&mc, &kc, &nc);
+  g->tm = mc > mr ? mc / mr * mr : mr;
+  g->tn = BLAS_TILE_N / nr * nr;
+  for (;;) {
+    g->rows = (g->m + g->tm - 1) / g->tm;
+    g->cols = (g->n + g->tn - 1) / g->tn;
+    if ((long)g->rows * g->cols >= BLAS_TILES_PER_THREAD * threads)
+      break;
+    if (g->tn > nr && g->tn >= g->tm)
+      g->tn = g->tn / 2 > nr ? g->tn / 2 / nr * nr : nr;
+    else if (g->tm > mr)
+      g->tm = g->tm / 2 > mr ? g->tm / 2 / mr * mr : mr;
+    else
+      break;
+  }
+}
+
+static void tile (struct gemm *g, int t)
+{
+  long i0 = (long)(t / g->cols) * g->tm, j0 = (long)(t % g->cols) * g->tn;
+  long i1 = i0 + g->tm < g->m ? i0 + g->tm : g->m;
+  long j1 = j0 + g->tn < g->n ? j0 + g->tn : g->n;
+
+  kernel_dgemm_packed(i0, i1, j0, j1, g->k, g->Ap, g->Bp, g->C, g->ldc,
+		      g->ep);
+}
+
+/* Pack this worker's share of the panels, wait for the rest, then
+ * take tiles until there are none left */
+static void gemm_body (void *arg, int threadn, int threads)
+{
+  struct gemm *g = (struct gemm *) arg;
+  long ap = (g->m + kernel_mr() - 1) / kernel_mr();
+  long bp = (g->n + kernel_nr() - 1) / kernel_nr();
+  int t;
+
+  if (g->pool != NULL)
+    pool_queue(g->pool, threadn, g->rows * g->cols);
+  kernel_dpack_a(g->m, g->k, g->A, g->lda, g->transa, g->Ap,
+		 ap * threadn / threads, ap * (threadn + 1) / threads);
+  kernel_dpack_b(g->k, g->n, g->B, g->ldb, g->transb, g->Bp,
+		 bp * threadn / threads, bp * (threadn + 1) / threads);
+  if (g->pool == NULL) {
+    for (t = 0; t < g->rows * g->cols; t++)
+      tile(g, t);
+    return;
+  }
+  pool_barrier(g->pool);
+  while ((t = pool_next_task(g->pool, threadn)) >= 0)
+    tile(g, t);
+}
+
+/* C = beta * C, for a multiply that adds nothing to it */
+static void scale (long m, long n, double beta, double *C, long ldc)
+{
+  for (long ix = 0; ix < m; ix++) {
+    double *c = &C[idx(ix,0,ldc)];
+    if (beta == 0)
+      memset(c, 0, sizeof(double) * n);
+    else
+      for (long jx = 0; jx < n; jx++)
+	c[jx] *= beta;
+  }
+}
+
+size_t blas_bytes (int order, long m, long n, long k)
+{
+  if (order == BLAS_COL_MAJOR) {
+    long t = m;
+    m = n;
+    n = t;
+  }
+  return panels(m, kernel_mr(), k) + panels(n, kernel_nr(), k);
+}
+
+int blas_dgemm_arena (struct arena *ar, struct pool *pool, int order,
+		      int transa, int transb, long m, long n, long k,
+		      double alpha, const double *A, long lda,
+		      const double *B, long ldb, double beta, double *C,
+		      long ldc)
+{
+  struct kernel_epilogue ep = { alpha, beta, NULL, KERNEL_ACT_NONE, 0, 0 };
+  struct gemm g;
+
+  if (order == BLAS_COL_MAJOR) {
+    const double *T = A;
+    long t = m, ld = lda;
+    int tr = transa;
+    A = B;
+    B = T;
+    m = n;
+    n = t;
+    lda = ldb;
+    ldb = ld;
+    transa = transb;
+    transb = tr;
+  }
+  /* Row lengths of A, B and C as row-major arrays */
+  if (m < 0 || n < 0 || k < 0 || ldc < (n > 1 ? n : 1)
+      || lda < (transa ? (m > 1 ? m : 1) : (k > 1 ? k : 1))
+      || ldb < (transb ? (k > 1 ? k : 1) : (n > 1 ? n : 1)))
+    return -1;
+  if (m == 0 || n == 0)
+    return 0;
+  if (k == 0 || alpha == 0) {
+    if (beta != 1)
+      scale(m, n, beta, C, ldc);
+    return 0;
+  }
+
+  size_t mark = arena_mark(ar);
+  g.pool = pool;
+  g.m = m;
+  g.n = n;
+  g.k = k;
+  g.A = A;
+  g.B = B;
+  g.lda = lda;
+  g.ldb = ldb;
+  g.transa = transa;
+  g.transb = transb;
+  g.C = C;
+  g.ldc = ldc;
+  g.ep = alpha == 1 && beta == 0 ? NULL : &ep;
+  g.Ap = (double *) arena_alloc(ar, panels(m, kernel_mr(), k));
+  g.Bp = (double *) arena_alloc(ar, panels(n, kernel_nr(), k));
+  if (g.Ap == NULL || g.Bp == NULL) {
+    arena_release(ar, mark);
+    return -1;
+  }
+  tile_grid(&g, pool != NULL ? pool_threads(pool) : 1);
+  if (pool != NULL)
+    pool_run(pool, gemm_body, &g);
+  else
+    gemm_body(&g, 0, 1);
+  arena_release(ar, mark);
+  return 0;
+}
+
+int blas_dgemm (struct pool *pool, int order, int transa, int transb,
+		long m, long n, long k, double alpha, const double *A,
+		long lda, const double *B, long ldb, double beta, double *C,
+		long ldc)
+{
+  struct arena ar;
+  int err;
+
+  if (arena_init(&ar, blas_bytes(order, m, n, k)) != 0)
+    return -1;
+  err = blas_dgemm_arena(&ar, pool, order, transa, transb, m, n, k, alpha,
+			 A, lda, B, ldb, beta, C, ldc);
+  arena_free(&ar);
+  return err;
+}
@@ -0,0 +1,53 @@
+/* BLAS style matrix multiply
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef BLAS_H
+#define BLAS_H
+
+#include <stddef.h>
+#include "pool.h"
+
+struct arena;
+
+/* Element order of A, B and C */
+#define BLAS_ROW_MAJOR 0
+#define BLAS_COL_MAJOR 1
+
+/* What a multiply does with A or B */
+#define BLAS_NO_TRANS 0
+#define BLAS_TRANS    1
+
+/* General multiply, as dgemm:
+ *  C (m by n)  =  alpha * op(A) times op(B)  +  beta * C
+ *  op(A) is m by k and op(B) k by n; op(X) is X, or its transpose
+ *  with BLAS_TRANS.  lda, ldb and ldc are the row lengths (columns
+ *  for BLAS_COL_MAJOR) of the arrays holding A, B and C, so every
+ *  operand may be a view into a bigger matrix and nothing is copied
+ *  out first.  C is not read when beta is 0.
+ *
+ *  Both operands are packed into kernel-ordered panels, the packing
+ *  spread over the workers of pool, and the tiles of C are then
+ *  shared out between them; pool may be NULL to run on the calling
+ *  thread.  Returns -1 if a leading dimension is too small for its
+ *  operand or the packing buffers could not be allocated.
+ */
+int blas_dgemm (struct pool *pool, int order, int transa, int transb,
+		long m, long n, long k, double alpha, const double *A,
+		long lda, const double *B, long ldb, double beta, double *C,
+		long ldc);
+
+/* blas_dgemm with the packing buffers taken from ar, which must have
+ * blas_bytes free, and released again before it returns; callers
+ * that multiply over and over keep one arena instead of allocating
+ * every time. */
+size_t blas_bytes (int order, long m, long n, long k);
+int blas_dgemm_arena (struct arena *ar, struct pool *pool, int order,
+		      int transa, int transb, long m, long n, long k,
+		      double alpha, const double *A, long lda,
+		      const double *B, long ldb, double beta, double *C,
+		      long ldc);
+
+#endif
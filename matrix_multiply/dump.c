@@ -0,0 +1,316 @@
+/* Fast text dump of a matrix
+ *
+ *   Michael Albert
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "matio.h"
+#include "dump.h"
+
+/* Text each worker formats per round, and the most an element or the
+ * start and end of a row can take in either format */
+#define DUMP_CHUNK (1 << 20)
+#define DUMP_ELEM  32
+#define DUMP_ROW   32
+
+/* Significant digits: -d's %.5G, and enough for a double or a float
+ * to read back exactly in CSV */
+#define TEXT_DIGITS  5
+#define CSV_DIGITS   17
+#define CSV_FDIGITS  9
+
+/* Powers of ten that fit in 64 bits */
+static const uint64_t tens[20] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+  10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+  100000000000ull, 1000000000000ull, 10000000000000ull,
+  100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+  100000000000000000ull, 1000000000000000000ull,
+  10000000000000000000ull
+};
+
+typedef unsigned __int128 u128;
+
+static u128 ten (int s)
+{
+  return s < 20 ? (u128)tens[s] : (u128)tens[19] * tens[s - 19];
+}
+
+/* Right justify the len characters at s in width, writing them to p */
+static char *pad (char *p, const char *s, int len, int width)
+{
+  while (width-- > len)
+    *p++ = ' ';
+  memcpy(p, s, len);
+  return p + len;
+}
+
+/* Integer v as printf "%*d" */
+static char *fmt_int (char *p, long v, int width)
+{
+  char s[24], *q = s + sizeof(s);
+  unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+  do
+    *--q = '0' + u % 10;
+  while ((u /= 10) != 0);
+  if (v < 0)
+    *--q = '-';
+  return pad(p, q, s + sizeof(s) - q, width);
+}
+
+/* Round |v| to prec significant digits, at most 17:
+ *  Returns the digits as an integer and the decimal exponent of the
+ *  first one in *exp, or -1 when v is zero, subnormal, not finite or
+ *  outside what 128 bit integers cover; the caller then falls back to
+ *  printf.  a is mant * 2^q exactly, so the digits are the integer
+ *  part of a * 10^s for s = prec-1-exp, worked out as n / d in
+ *  integers and rounded half to even like printf.
+ */
+static long digits (double a, int prec, int *exp)
+{
+  uint64_t bits, mant, lo = tens[prec - 1], hi = lo * 10, r;
+  u128 n, d, rem;
+  int bexp, q, e, s, tries;
+
+  memcpy(&bits, &a, sizeof(bits));
+  bexp = (bits >> 52) & 0x7ff;
+  if (bexp == 0 || bexp > 1023 + 127)
+    return -1;
+  mant = (bits & ((1ull << 52) - 1)) | 1ull << 52;
+  q = bexp - 1075;
+  /* floor(log10(2) * binary exponent), at most one off */
+  e = ((bexp - 1023) * 78913) >> 18;
+  for (tries = 0; ; tries++) {
+    s = prec - 1 - e;
+    if (tries == 3 || s > 22 || s < -38 || (s >= 0 && -q >= 128))
+      return -1;
+    if (s >= 0) {
+      n = (u128)mant * ten(s);
+      if (q >= 0) {
+	n <<= q;
+	r = n;
+	rem = 0;
+	d = 1;
+      } else {
+	r = n >> -q;
+	rem = n & (((u128)1 << -q) - 1);
+	d = (u128)1 << -q;
+      }
+    } else {
+      n = q >= 0 ? (u128)mant << q : mant;
+      d = q >= 0 ? ten(-s) : ten(-s) << -q;
+      r = n / d;
+      rem = n % d;
+    }
+    if (r < lo)
+      e--;
+    else if (r >= hi)
+      e++;
+    else
+      break;
+  }
+  if ((2 * rem > d || (2 * rem == d && (r & 1))) && ++r == hi) {
+    r = lo;
+    e++;
+  }
+  *exp = e;
+  return r;
+}
+
+/* v as printf "%*.*G" */
+static char *fmt_g (char *p, double v, int prec, int width)
+{
+  char s[40], d[CSV_DIGITS], *q = s;
+  int e, n, i, last;
+  long r = digits(v < 0 ? -v : v, prec, &e);
+
+  if (r < 0) {
+    n = snprintf(s, sizeof(s), "%.*G", prec, v);
+    return pad(p, s, n, width);
+  }
+  for (i = prec - 1; i >= 0; i--, r /= 10)
+    d[i] = '0' + r % 10;
+  for (last = prec - 1; last > 0 && d[last] == '0'; last--)
+    ;  /* %G drops trailing zeros */
+
+  if (v < 0)
+    *q++ = '-';
+  if (e < -4 || e >= prec) {
+    *q++ = d[0];
+    if (last > 0) {
+      *q++ = '.';
+      memcpy(q, d + 1, last);
+      q += last;
+    }
+    *q++ = 'E';
+    *q++ = e < 0 ? '-' : '+';
+    if (e < 0)
+      e = -e;
+    if (e >= 100)
+      *q++ = '0' + e / 100;
+    *q++ = '0' + e / 10 % 10;
+    *q++ = '0' + e % 10;
+  } else if (e >= 0) {
+    memcpy(q, d, e + 1);
+    q += e + 1;
+    if (last > e) {
+      *q++ = '.';
+      memcpy(q, d + e + 1, last - e);
+      q += last - e;
+    }
+  } else {
+    *q++ = '0';
+    *q++ = '.';
+    for (i = -1; i > e; i--)
+      *q++ = '0';
+    memcpy(q, d, last + 1);
+    q += last + 1;
+  }
+  return pad(p, s, q - s, width);
+}
+
+struct dump {
+  const void *A;
+  int dtype, format;
+  long rows, cols;
+  int chunk;            /* rows a worker formats per round */
+  long row0;            /* first row of the round */
+  char **buf;           /* per worker, chunk rows of text */
+  size_t *len;
+};
+
+/* Row i of the matrix as text at p, returning the end */
+static char *dump_row (const struct dump *d, long i, char *p)
+{
+  size_t at = (size_t)i * d->cols;
+  int text = d->format == DUMP_TEXT;
+  const char *sep = text ? " " : ",";
+  long j;
+
+  if (text) {
+    memcpy(p, "Row ", 4);
+    p = fmt_int(p + 4, i, 0);
+    *p++ = ':';
+    *p++ = ' ';
+  }
+  for (j = 0; j < d->cols; j++, at++) {
+    if (text || j > 0)
+      *p++ = *sep;
+    switch (d->dtype) {
+    case MATIO_F64:
+      p = fmt_g(p, ((const double *)d->A)[at],
+		text ? TEXT_DIGITS : CSV_DIGITS, text ? 10 : 0);
+      break;
+    case MATIO_F32:
+      p = fmt_g(p, ((const float *)d->A)[at],
+		text ? TEXT_DIGITS : CSV_FDIGITS, text ? 10 : 0);
+      break;
+    case MATIO_I32:
+      p = fmt_int(p, ((const int32_t *)d->A)[at], text ? 10 : 0);
+      break;
+    case MATIO_I8:
+      p = fmt_int(p, ((const int8_t *)d->A)[at], text ? 10 : 0);
+      break;
+    }
+  }
+  *p++ = '\n';
+  return p;
+}
+
+/* Worker threadn formats its chunk of the round's rows */
+static void dump_body (void *arg, int threadn, int threads)
+{
+  struct dump *d = (struct dump *)arg;
+  long i0 = d->row0 + (long)threadn * d->chunk, i1 = i0 + d->chunk, i;
+  char *p = d->buf[threadn];
+
+  (void)threads;
+  if (i1 > d->rows)
+    i1 = d->rows;
+  for (i = i0; i < i1; i++)
+    p = dump_row(d, i, p);
+  d->len[threadn] = p - d->buf[threadn];
+}
+
+static int write_all (int fd, const char *p, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int dump_matrix (struct pool *pool, int fd, int format, int dtype,
+		 const void *A, long rows, long cols)
+{
+  int threads = pool != NULL ? pool_threads(pool) : 1;
+  size_t rowmax = (size_t)cols * DUMP_ELEM + DUMP_ROW;
+  struct dump d;
+  int t, ret = 0;
+
+  fflush(stdout);
+  d.A = A;
+  d.dtype = dtype;
+  d.format = format;
+  d.rows = rows;
+  d.cols = cols;
+  d.chunk = DUMP_CHUNK / rowmax > 0 ? DUMP_CHUNK / rowmax : 1;
+  if ((long)d.chunk * threads > rows)   /* small matrices: split evenly */
+    d.chunk = (rows + threads - 1) / threads;
+  if (d.chunk < 1)
+    d.chunk = 1;
+  d.buf = (char **)calloc(threads, sizeof(char *));
+  d.len = (size_t *)calloc(threads, sizeof(size_t));
+  for (t = 0; t < threads && d.buf != NULL; t++)
+    if ((d.buf[t] = (char *)malloc(rowmax * d.chunk)) == NULL)
+      break;
+  if (d.buf == NULL || d.len == NULL || t < threads) {
+    errno = ENOMEM;
+    ret = -1;
+  }
+
+  for (d.row0 = 0; ret == 0 && d.row0 < rows;
+       d.row0 += (long)d.chunk * threads) {
+    if (pool != NULL)
+      pool_run(pool, dump_body, &d);
+    else
+      dump_body(&d, 0, 1);
+    for (t = 0; t < threads && ret == 0; t++)
+      ret = write_all(fd, d.buf[t], d.len[t]);
+  }
+
+  for (t = 0; d.buf != NULL && t < threads; t++)
+    free(d.buf[t]);
+  free(d.buf);
+  free(d.len);
+  return ret;
+}
+
+int dump_file (struct pool *pool, const char *path, int format, int dtype,
+	       const void *A, long rows, long cols)
+{
+  int out = strcmp(path, "-") == 0;
+  int fd = out ? 1 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int ret = fd < 0 ? -1 : dump_matrix(pool, fd, format, dtype, A, rows, cols);
+
+  if (fd >= 0 && !out && close(fd) != 0)
+    ret = -1;
+  if (ret != 0)
+    fprintf (stderr, "%s: %s\n", path, strerror(errno));
+  return ret;
+}
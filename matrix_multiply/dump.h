@@ -0,0 +1,37 @@
+/* Fast text dump of a matrix
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#include "pool.h"
+
+/* Output formats:
+ *  DUMP_TEXT -- "Row i: " then each element as printf " %10.5G", or
+ *               " %10d" for integer types, the layout -d has always had
+ *  DUMP_CSV  -- elements separated by commas, one row per line,
+ *               doubles with 17 significant digits so they read back
+ *               exactly
+ */
+#define DUMP_TEXT 0
+#define DUMP_CSV  1
+
+/* Write A (rows by cols, row major, element type MATIO_*) to fd.
+ *  Elements are formatted by hand into large buffers, a range of rows
+ *  per worker of pool, and the buffers written in row order with a few
+ *  write(2) calls.  pool may be NULL to format serially.  stdio is
+ *  flushed first so the dump lands after anything printed before it.
+ *  Returns -1 if writing failed, with errno set.
+ */
+int dump_matrix (struct pool *pool, int fd, int format, int dtype,
+		 const void *A, long rows, long cols);
+
+/* Open path for writing, "-" being stdout, and dump A to it as
+ *  dump_matrix does.  Returns -1 after printing why on failure. */
+int dump_file (struct pool *pool, const char *path, int format, int dtype,
+	       const void *A, long rows, long cols);
+
+#endif
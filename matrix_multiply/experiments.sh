@@ -1,115 +1,55 @@
 #!/bin/bash
 
-#Runs and stores time taken for matrices of sizes 1000, 1500, and 2000, using
-#1-16 threads.
+#Benchmarks multiplies of sizes 1500, 1750 and 2000 and sixth powers of
+#sizes 1000, 1150 and 1300, using 1-16 threads.  Every case gets WARMUP
+#untimed runs and REPS timed ones; the programs report the median, p95,
+#a 95% confidence interval for the median, GFLOP/s and GB/s.
+#
+#  results.csv   -- one row per program, kernel, size and thread count
+#  results.json  -- the same records, one JSON object per line
+#  speedups      -- median of the serial program over the threaded one
 
-gcc -Wall -o orig mm.c
-gcc -Wall -o new pt-mm.c -pthread
-tottime=0
-echo "Averages for dimension of 1500 multiplication" > averages
-for i in {1..16..1}; do
-  for j in {0..4..1}; do
-    if [ $i -eq 1 ]
-    then
-      time=$(./orig -T -x1500 -y1500 -z1500 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    else
-      time=$(./new -T -n$i -x1500 -y1500 -z1500 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    fi
-  done
-  #Take average
-  echo $tottime/5 | bc -l >> averages
-  tottime=0
-done
-echo "Averages for dimension of 1750 multiplication" >> averages
-for i in {1..16..1}; do
-  for j in {0..4..1}; do
-    if [ $i -eq 1 ]
-    then
-      time=$(./orig -T -x1750 -y1750 -z1750 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    else
-      time=$(./new -T -n$i -x1750 -y1750 -z1750 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    fi
-  done
-  #Take average
-  echo $tottime/5 | bc -l >> averages
-  tottime=0
-done
-echo "Averages for dimension of 2000 multiplication" >> averages
-for i in {1..16..1}; do
-  for j in {0..4..1}; do
-    if [ $i -eq 1 ]
-    then
-      time=$(./orig -T -x2000 -y2000 -z2000 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    else
-      time=$(./new -T -n$i -x2000 -y2000 -z2000 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    fi
-  done
-  #Take average
-  echo $tottime/5 | bc -l >> averages
-  tottime=0
-done
-echo "Averages for dimension of 1000 ^6" >> averages
-for i in {1..16..1}; do
-  for j in {0..4..1}; do
-    if [ $i -eq 1 ]
-    then
-      time=$(./orig -T -s6 -x1000  | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    else
-      time=$(./new -T -s6 -n$i -x1000 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    fi
+WARMUP=${WARMUP:-1}
+REPS=${REPS:-5}
+THREADS=${THREADS:-16}
+
+gcc -Wall -O2 -o orig mm.c kernel.c strassen.c arena.c pool.c matio.c ooc.c sparse.c bench.c tune.c rng.c dump.c -pthread
+gcc -Wall -O2 -o new pt-mm.c kernel.c pool.c strassen.c arena.c topology.c matio.c ooc.c batch.c sparse.c bench.c perf.c tune.c rng.c dump.c serve.c blas.c summa.c -pthread
+
+#Runs one case in both formats, keeping the CSV header from the first
+run() {
+  "$@" -w$WARMUP -R$REPS -ocsv | tail -n +$header >> results.csv
+  header=2
+  "$@" -w$WARMUP -R$REPS -ojson >> results.json
+}
+
+header=1
+rm -f results.csv results.json
+for n in 1500 1750 2000; do
+  run ./orig -kblocked -x$n -y$n -z$n
+  for i in $(seq 1 $THREADS); do
+    run ./new -n$i -x$n -y$n -z$n
   done
-  #Take average
-  echo $tottime/5 | bc -l >> averages
-  tottime=0
 done
-echo "Averages for dimension of 1150 ^6" >> averages
-for i in {1..16..1}; do
-  for j in {0..4..1}; do
-    if [ $i -eq 1 ]
-    then
-      time=$(./orig -T -s6 -x1150 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    else
-      time=$(./new -T -s6 -n$i -x1150 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    fi
+for n in 1000 1150 1300; do
+  run ./orig -kblocked -s6 -x$n
+  for i in $(seq 1 $THREADS); do
+    run ./new -s6 -n$i -x$n
   done
-  #Take average
-  echo $tottime/5 | bc -l >> averages
-  tottime=0
 done
-echo "Averages for dimension of 1300 ^6" >> averages
-for i in {1..16..1}; do
-  for j in {0..4..1}; do
-    if [ $i -eq 1 ]
-    then
-      time=$(./orig -T -s6 -x1300 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    else
-      time=$(./new -T -s6 -n$i -x1300 | awk -F ',| ' '{print $4}')
-      tottime=$((tottime+time))
-    fi
-  done
-  #Take average
-  echo $tottime/5 | bc -l >> averages
-  tottime=0
+
+#Single core naive against blocked, multiplies only
+for n in 1500 1750 2000; do
+  run ./orig -knaive -x$n -y$n -z$n
 done
 
-#Calculate speed ups
-for i in {0..5..1}; do
-  #skip over section descriptors
-  read skip
-  read origtime
-  for j in {1..15..1}; do
-    read newtime
-    echo $origtime/$newtime | bc -l >> speedups
-  done
-done < averages
+#Speedup of every threaded run over the serial blocked run of its case
+awk -F, 'NR == 1 { for (i = 1; i <= NF; i++) col[$i] = i; next }
+  { key = $(col["m"]) "," $(col["n"]) "," $(col["k"]) "," $(col["power"]) }
+  $(col["program"]) == "mm" && $(col["kernel"]) == "blocked" {
+    serial[key] = $(col["median_s"]) }
+  $(col["program"]) == "pt-mm" && key in serial {
+    printf "%s,%s,%.4f\n", key, $(col["threads"]),
+      serial[key] / $(col["median_s"]) }' results.csv > speedups.tmp
+(echo "m,n,k,power,threads,speedup"; cat speedups.tmp) > speedups
+rm -f speedups.tmp
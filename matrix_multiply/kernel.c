@@ -0,0 +1,576 @@
+/* Cache-blocked matrix multiply kernel
+ *
+ *   Michael Albert
+ *
+ *  The loops follow the usual GotoBLAS ordering: B is cut into
+ *  KC x NC blocks, A into MC x KC blocks, and each MR x NR tile
+ *  of C is produced by a micro-kernel that holds the tile in
+ *  registers for the whole k slice.
+ *
+ *  There is a micro-kernel per instruction set (AVX-512, AVX2 with
+ *  FMA, and plain C) and per element type: double, float, int32, and
+ *  int8 summed in int32.  kernel_select picks one set
+ *  at startup from what cpuid reports.
+ */
+
+#include <string.h>
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86
+#endif
+
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
+#define min(a,b)      ((a) < (b) ? (a) : (b))
+
+/* Micro-kernels compute one full MR x NR tile over a k slice.
+ *  Element (i,p) of A is at A[i*rsa + p*csa] and row p of B starts
+ *  at B[p*rsb], so the same kernel reads a row-major view (rsa = lda,
+ *  csa = 1, rsb = ldb) or packed panels (rsa = 1, csa = MR, rsb = NR).
+ *  Strides are long so a tile deep in a huge view does not overflow.
+ *  accum is 0 on the first k slice (C is overwritten) and 1 after.
+ *  ep is NULL, or for doubles says how to finish the tile, below.
+ */
+struct tile_ep;
+
+typedef void (*dukr_t) (int k, const double *A, long rsa, long csa,
+			const double *B, long rsb, double *C, long ldc,
+			int accum, const struct tile_ep *ep);
+typedef void (*sukr_t) (int k, const float *A, long rsa, long csa,
+			const float *B, long rsb, float *C, long ldc,
+			int accum, const struct tile_ep *ep);
+typedef void (*iukr_t) (int k, const int32_t *A, long rsa, long csa,
+			const int32_t *B, long rsb, int32_t *C, long ldc,
+			int accum, const struct tile_ep *ep);
+typedef void (*bukr_t) (int k, const int8_t *A, long rsa, long csa,
+			const int8_t *B, long rsb, int32_t *C, long ldc,
+			int accum, const struct tile_ep *ep);
+
+/* Epilogue of one k slice of a tile, made from a kernel_epilogue:
+ *  the sum is scaled by alpha and added to C, or on the first slice
+ *  to beta times C.  Only on the last slice are bias (already offset
+ *  to the tile's first column) and the clamp to lo .. hi applied;
+ *  ReLU is a clamp to 0 .. infinity.
+ */
+struct tile_ep {
+  double alpha, beta;
+  const double *bias;  /* NULL if none or not the last slice */
+  int clamp;
+  double lo, hi;
+};
+
+/* One element through the epilogue; sum is the raw dot product and
+ * c what C held before */
+static inline double ep_apply (const struct tile_ep *ep, double sum,
+			       double c, int accum, int j)
+{
+  double v = ep->alpha * sum;
+
+  if (accum)
+    v += c;
+  else if (ep->beta != 0)
+    v += ep->beta * c;
+  if (ep->bias != NULL)
+    v += ep->bias[j];
+  if (ep->clamp)
+    v = v < ep->lo ? ep->lo : v > ep->hi ? ep->hi : v;
+  return v;
+}
+
+/* Plain C micro-kernel, a 4 x 4 tile fits the 16 scalar registers.
+ *  A and B hold type, C and the sums are ctype. */
+#define SCALAR_UKR(name, type, ctype)					\
+  static void name (int k, const type *A, long rsa, long csa,		\
+		    const type *B, long rsb, ctype *C, long ldc, int accum, \
+		    const struct tile_ep *ep)				\
+  {									\
+    ctype c[4][4] = {{0}};						\
+    int ix, jx, kx;							\
+									\
+    for (kx = 0; kx < k; kx++) {					\
+      const type *b = &B[kx*rsb];					\
+      _Pragma("GCC unroll 4")						\
+      for (ix = 0; ix < 4; ix++) {					\
+	ctype a = A[ix*rsa + kx*csa];					\
+	_Pragma("GCC unroll 4")						\
+	for (jx = 0; jx < 4; jx++)					\
+	  c[ix][jx] += a * b[jx];					\
+      }									\
+    }									\
+    for (ix = 0; ix < 4; ix++)						\
+      for (jx = 0; jx < 4; jx++)					\
+	C[idx(ix,jx,ldc)] =						\
+	  ep != NULL ? ep_apply(ep, c[ix][jx], C[idx(ix,jx,ldc)], accum, jx) \
+	  : accum ? C[idx(ix,jx,ldc)] + c[ix][jx] : c[ix][jx];		\
+  }
+
+SCALAR_UKR(dukr_scalar, double, double)
+SCALAR_UKR(sukr_scalar, float, float)
+SCALAR_UKR(iukr_scalar, int32_t, int32_t)
+SCALAR_UKR(bukr_scalar, int8_t, int32_t)
+
+#ifdef KERNEL_X86
+
+/* SIMD micro-kernels: each row of the tile is NV vectors wide.
+ *  Every k step loads NV vectors of B once and broadcasts MR
+ *  elements of A against them, so the MR*NV accumulators plus the
+ *  NV B vectors and one broadcast fill the register file:
+ *   AVX2     16 ymm -- 6 x 2 accumulators
+ *   AVX-512  32 zmm -- 12 x 2 accumulators
+ *  epi stores a vector through the epilogue and returns 1, or
+ *  returns 0 when there is none to apply.
+ */
+#define SIMD_UKR(name, isa, type, ctype, vec, MR, NV, W, setzero,	\
+		 loadb, loadu, storeu, bcast, fmadd, add, epi)		\
+  __attribute__((target(isa)))						\
+  static void name (int k, const type *A, long rsa, long csa,		\
+		    const type *B, long rsb, ctype *C, long ldc, int accum, \
+		    const struct tile_ep *ep)				\
+  {									\
+    vec c[MR][NV];							\
+    int ix, jx, kx;							\
+									\
+    _Pragma("GCC unroll 12")						\
+    for (ix = 0; ix < MR; ix++)						\
+      _Pragma("GCC unroll 2")						\
+      for (jx = 0; jx < NV; jx++)					\
+	c[ix][jx] = setzero();						\
+    for (kx = 0; kx < k; kx++) {					\
+      vec b[NV];							\
+      _Pragma("GCC unroll 2")						\
+      for (jx = 0; jx < NV; jx++)					\
+	b[jx] = loadb(&B[kx*rsb + jx*W]);				\
+      _Pragma("GCC unroll 12")						\
+      for (ix = 0; ix < MR; ix++) {					\
+	vec a = bcast(A[ix*rsa + kx*csa]);				\
+	_Pragma("GCC unroll 2")						\
+	for (jx = 0; jx < NV; jx++)					\
+	  c[ix][jx] = fmadd(a, b[jx], c[ix][jx]);			\
+      }									\
+    }									\
+    _Pragma("GCC unroll 12")						\
+    for (ix = 0; ix < MR; ix++)						\
+      _Pragma("GCC unroll 2")						\
+      for (jx = 0; jx < NV; jx++) {					\
+	ctype *cp = &C[idx(ix,jx*W,ldc)];				\
+	if (!epi(cp, c[ix][jx], accum, ep, jx*W))			\
+	  storeu(cp, accum ? add(loadu(cp), c[ix][jx]) : c[ix][jx]);	\
+      }									\
+  }
+
+/* Only the double kernels take an epilogue */
+#define NO_EPI(cp, v, accum, ep, j) 0
+
+/* Epilogue of a vector of doubles at cp, column j of the tile */
+#define DOUBLE_EPI(name, isa, vec, sfx)					\
+  __attribute__((target(isa)))						\
+  static inline int name (double *cp, vec v, int accum,			\
+			  const struct tile_ep *ep, int j)		\
+  {									\
+    if (ep == NULL)							\
+      return 0;								\
+    v = _##sfx##_mul_pd(v, _##sfx##_set1_pd(ep->alpha));		\
+    if (accum)								\
+      v = _##sfx##_add_pd(_##sfx##_loadu_pd(cp), v);			\
+    else if (ep->beta != 0)						\
+      v = _##sfx##_fmadd_pd(_##sfx##_set1_pd(ep->beta),		\
+			    _##sfx##_loadu_pd(cp), v);			\
+    if (ep->bias != NULL)						\
+      v = _##sfx##_add_pd(v, _##sfx##_loadu_pd(ep->bias + j));		\
+    if (ep->clamp)							\
+      v = _##sfx##_min_pd(_##sfx##_max_pd(v, _##sfx##_set1_pd(ep->lo)), \
+			  _##sfx##_set1_pd(ep->hi));			\
+    _##sfx##_storeu_pd(cp, v);						\
+    return 1;								\
+  }
+
+/* Integer loads, stores and multiply-adds in the shape SIMD_UKR
+ * expects.  There is no integer FMA, so multiply-add is a low-half
+ * multiply and an add; int8 B rows are sign extended to int32 lanes
+ * as they are loaded, and the sums are int32 throughout.
+ */
+#define INT_OPS(isa, vec, sfx, bits, load8)				\
+  __attribute__((target(isa)))						\
+  static inline vec load_i32_##sfx (const int32_t *p)			\
+  { return _##sfx##_loadu_si##bits((const void *) p); }			\
+  __attribute__((target(isa)))						\
+  static inline vec load_i8_##sfx (const int8_t *p)			\
+  { return _##sfx##_cvtepi8_epi32(load8); }				\
+  __attribute__((target(isa)))						\
+  static inline void store_i32_##sfx (int32_t *p, vec v)		\
+  { _##sfx##_storeu_si##bits((void *) p, v); }				\
+  __attribute__((target(isa)))						\
+  static inline vec madd_i32_##sfx (vec a, vec b, vec c)		\
+  { return _##sfx##_add_epi32(_##sfx##_mullo_epi32(a, b), c); }
+
+INT_OPS("avx2", __m256i, mm256, 256,
+	_mm_loadl_epi64((const __m128i *) p))
+INT_OPS("avx512f", __m512i, mm512, 512,
+	_mm_loadu_si128((const __m128i *) p))
+
+DOUBLE_EPI(epi_avx2, "avx2,fma", __m256d, mm256)
+DOUBLE_EPI(epi_avx512, "avx512f", __m512d, mm512)
+
+SIMD_UKR(dukr_avx2, "avx2,fma", double, double, __m256d, 6, 2, 4,
+	 _mm256_setzero_pd, _mm256_loadu_pd, _mm256_loadu_pd,
+	 _mm256_storeu_pd, _mm256_set1_pd, _mm256_fmadd_pd, _mm256_add_pd,
+	 epi_avx2)
+SIMD_UKR(sukr_avx2, "avx2,fma", float, float, __m256, 6, 2, 8,
+	 _mm256_setzero_ps, _mm256_loadu_ps, _mm256_loadu_ps,
+	 _mm256_storeu_ps, _mm256_set1_ps, _mm256_fmadd_ps, _mm256_add_ps,
+	 NO_EPI)
+SIMD_UKR(iukr_avx2, "avx2", int32_t, int32_t, __m256i, 6, 2, 8,
+	 _mm256_setzero_si256, load_i32_mm256, load_i32_mm256,
+	 store_i32_mm256, _mm256_set1_epi32, madd_i32_mm256,
+	 _mm256_add_epi32, NO_EPI)
+SIMD_UKR(bukr_avx2, "avx2", int8_t, int32_t, __m256i, 6, 2, 8,
+	 _mm256_setzero_si256, load_i8_mm256, load_i32_mm256,
+	 store_i32_mm256, _mm256_set1_epi32, madd_i32_mm256,
+	 _mm256_add_epi32, NO_EPI)
+SIMD_UKR(dukr_avx512, "avx512f", double, double, __m512d, 12, 2, 8,
+	 _mm512_setzero_pd, _mm512_loadu_pd, _mm512_loadu_pd,
+	 _mm512_storeu_pd, _mm512_set1_pd, _mm512_fmadd_pd, _mm512_add_pd,
+	 epi_avx512)
+SIMD_UKR(sukr_avx512, "avx512f", float, float, __m512, 12, 2, 16,
+	 _mm512_setzero_ps, _mm512_loadu_ps, _mm512_loadu_ps,
+	 _mm512_storeu_ps, _mm512_set1_ps, _mm512_fmadd_ps, _mm512_add_ps,
+	 NO_EPI)
+SIMD_UKR(iukr_avx512, "avx512f", int32_t, int32_t, __m512i, 12, 2, 16,
+	 _mm512_setzero_si512, load_i32_mm512, load_i32_mm512,
+	 store_i32_mm512, _mm512_set1_epi32, madd_i32_mm512,
+	 _mm512_add_epi32, NO_EPI)
+SIMD_UKR(bukr_avx512, "avx512f", int8_t, int32_t, __m512i, 12, 2, 16,
+	 _mm512_setzero_si512, load_i8_mm512, load_i32_mm512,
+	 store_i32_mm512, _mm512_set1_epi32, madd_i32_mm512,
+	 _mm512_add_epi32, NO_EPI)
+
+static int has_avx512 (void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f");
+}
+
+static int has_avx2 (void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+#endif
+
+static int has_scalar (void)
+{
+  return 1;
+}
+
+/* One set of micro-kernels and their register tiles */
+struct isa {
+  const char *name;
+  int (*supported) (void);
+  int dmr, dnr;
+  dukr_t dukr;
+  int smr, snr;    /* also the tile of the 32 bit integer kernels */
+  sukr_t sukr;
+  iukr_t iukr;
+  bukr_t bukr;
+};
+
+/* In order of preference */
+static const struct isa isas[] = {
+#ifdef KERNEL_X86
+  { "avx512", has_avx512, 12, 16, dukr_avx512, 12, 32, sukr_avx512,
+    iukr_avx512, bukr_avx512 },
+  { "avx2",   has_avx2,    6,  8, dukr_avx2,    6, 16, sukr_avx2,
+    iukr_avx2, bukr_avx2 },
+#endif
+  { "scalar", has_scalar,  4,  4, dukr_scalar,  4,  4, sukr_scalar,
+    iukr_scalar, bukr_scalar },
+};
+#define NISAS ((int)(sizeof(isas) / sizeof(isas[0])))
+
+static const struct isa *active = NULL;
+
+int kernel_select (const char *isa)
+{
+  int i;
+
+  for (i = 0; i < NISAS; i++) {
+    if (isa != NULL && strcmp(isa, isas[i].name) != 0)
+      continue;
+    if (isas[i].supported()) {
+      active = &isas[i];
+      return 0;
+    }
+    if (isa != NULL)
+      return -1;
+  }
+  return -1;
+}
+
+const char *kernel_isa (void)
+{
+  if (active == NULL)
+    kernel_select(NULL);
+  return active->name;
+}
+
+/* Cache blocks in use, see kernel_blocking */
+static int block_mc = KERNEL_MC, block_kc = KERNEL_KC, block_nc = KERNEL_NC;
+
+void kernel_blocking (int mc, int kc, int nc)
+{
+  if (mc > 0)
+    block_mc = mc;
+  if (kc > 0)
+    block_kc = kc;
+  if (nc > 0)
+    block_nc = nc;
+}
+
+void kernel_blocks (int *mc, int *kc, int *nc)
+{
+  *mc = block_mc;
+  *kc = block_kc;
+  *nc = block_nc;
+}
+
+/* The tile_ep of one k slice of a multiply with epilogue ep */
+static void tile_ep_init (struct tile_ep *te, const struct kernel_epilogue *ep,
+			  int last)
+{
+  te->alpha = ep->alpha;
+  te->beta = ep->beta;
+  te->bias = last ? ep->bias : NULL;
+  te->clamp = last && ep->act != KERNEL_ACT_NONE;
+  te->lo = ep->act == KERNEL_ACT_RELU ? 0 : ep->lo;
+  te->hi = ep->act == KERNEL_ACT_RELU ? __builtin_inf() : ep->hi;
+}
+
+/* Blocked driver, shared by all the element types.
+ *  Tiles that do not fill MR x NR go through a plain loop.  Only
+ *  kernel_dgemm_ep passes an epilogue.
+ */
+#define BLOCKED_GEMM(name, type, ctype, MR, NR, ukr)			\
+  static void name##_blocked (long m, long n, long k, const type *A,	\
+			      long lda, const type *B, long ldb,	\
+			      ctype *C, long ldc,			\
+			      const struct kernel_epilogue *ep)		\
+  {									\
+    long jc, pc, ic;							\
+    int jr, ir, ix, jx, kx;						\
+    struct tile_ep te, tj;						\
+									\
+    if (active == NULL)							\
+      kernel_select(NULL);						\
+    for (jc = 0; jc < n; jc += block_nc) {				\
+      int nc = min(block_nc, n - jc);					\
+      for (pc = 0; pc < k; pc += block_kc) {				\
+	int kc = min(block_kc, k - pc);					\
+	if (ep != NULL)							\
+	  tile_ep_init(&te, ep, pc + kc >= k);				\
+	for (ic = 0; ic < m; ic += block_mc) {				\
+	  int mc = min(block_mc, m - ic);				\
+	  for (jr = 0; jr < nc; jr += active->NR) {			\
+	    int nr = min(active->NR, nc - jr);				\
+	    const struct tile_ep *tp = NULL;				\
+	    if (ep != NULL) {						\
+	      tj = te;							\
+	      if (te.bias != NULL)					\
+		tj.bias = te.bias + jc + jr;				\
+	      tp = &tj;							\
+	    }								\
+	    for (ir = 0; ir < mc; ir += active->MR) {			\
+	      int mr = min(active->MR, mc - ir);			\
+	      const type *a = &A[idx(ic + ir, pc, lda)];		\
+	      const type *b = &B[idx(pc, jc + jr, ldb)];		\
+	      ctype *c = &C[idx(ic + ir, jc + jr, ldc)];		\
+	      if (mr == active->MR && nr == active->NR) {		\
+		active->ukr(kc, a, lda, 1, b, ldb, c, ldc, pc > 0, tp);	\
+		continue;						\
+	      }								\
+	      for (ix = 0; ix < mr; ix++) {				\
+		for (jx = 0; jx < nr; jx++) {				\
+		  ctype tval = 0;					\
+		  for (kx = 0; kx < kc; kx++)				\
+		    tval += (ctype) a[idx(ix,kx,lda)] * b[idx(kx,jx,ldb)]; \
+		  ctype *cp = &c[idx(ix,jx,ldc)];			\
+		  *cp = tp != NULL ? ep_apply(tp, tval, *cp,		\
+					      pc > 0, jx)		\
+		      : pc > 0 ? *cp + tval : tval;			\
+		}							\
+	      }								\
+	    }								\
+	  }								\
+	}								\
+      }									\
+    }									\
+  }									\
+									\
+  void name (long m, long n, long k, const type *A, long lda,		\
+	     const type *B, long ldb, ctype *C, long ldc)		\
+  {									\
+    name##_blocked(m, n, k, A, lda, B, ldb, C, ldc, NULL);		\
+  }
+
+BLOCKED_GEMM(kernel_dgemm, double, double, dmr, dnr, dukr)
+BLOCKED_GEMM(kernel_sgemm, float, float, smr, snr, sukr)
+BLOCKED_GEMM(kernel_igemm, int32_t, int32_t, smr, snr, iukr)
+BLOCKED_GEMM(kernel_i8gemm, int8_t, int32_t, smr, snr, bukr)
+
+void kernel_dgemm_ep (long m, long n, long k, const double *A, long lda,
+		      const double *B, long ldb, double *C, long ldc,
+		      const struct kernel_epilogue *ep)
+{
+  kernel_dgemm_blocked(m, n, k, A, lda, B, ldb, C, ldc, ep);
+}
+
+int kernel_mr (void)
+{
+  if (active == NULL)
+    kernel_select(NULL);
+  return active->dmr;
+}
+
+int kernel_nr (void)
+{
+  if (active == NULL)
+    kernel_select(NULL);
+  return active->dnr;
+}
+
+int kernel_smr (void)
+{
+  if (active == NULL)
+    kernel_select(NULL);
+  return active->smr;
+}
+
+int kernel_snr (void)
+{
+  if (active == NULL)
+    kernel_select(NULL);
+  return active->snr;
+}
+
+/* Packing:
+ *  Panel p of packed A holds rows p*MR .. p*MR+MR-1, stored k-major
+ *  so element (i,p) sits at Ap[p*MR*k + kx*MR + i].  Panel p of
+ *  packed B holds cols p*NR .. p*NR+NR-1, element (kx,j) at
+ *  Bp[p*NR*k + kx*NR + j].  Rows and cols past the edge are zero,
+ *  so every tile can go through the full micro-kernel.  A transposed
+ *  source is read down its columns instead; the panels come out the
+ *  same, so nothing after packing knows about transposes.
+ */
+#define PACK(name_a, name_b, type, MR, NR)				\
+  void name_a (long m, long k, const type *A, long lda, int trans,	\
+	       type *Ap, long p0, long p1)				\
+  {									\
+    long p, kx;								\
+    int ix;								\
+    int mr = active->MR;						\
+									\
+    for (p = p0; p < p1; p++) {						\
+      type *dst = &Ap[idx(p * mr, 0, k)];				\
+      int rows = min(mr, m - p * mr);					\
+      for (kx = 0; kx < k; kx++) {					\
+	if (trans) {							\
+	  const type *src = &A[idx(kx, p * mr, lda)];			\
+	  for (ix = 0; ix < rows; ix++)					\
+	    dst[idx(kx,ix,mr)] = src[ix];				\
+	} else {							\
+	  for (ix = 0; ix < rows; ix++)					\
+	    dst[idx(kx,ix,mr)] = A[idx(p * mr + ix, kx, lda)];		\
+	}								\
+	for (; ix < mr; ix++)						\
+	  dst[idx(kx,ix,mr)] = 0;					\
+      }									\
+    }									\
+  }									\
+									\
+  void name_b (long k, long n, const type *B, long ldb, int trans,	\
+	       type *Bp, long p0, long p1)				\
+  {									\
+    long p, kx;								\
+    int jx;								\
+    int nr = active->NR;						\
+									\
+    for (p = p0; p < p1; p++) {						\
+      type *dst = &Bp[idx(p * nr, 0, k)];				\
+      int cols = min(nr, n - p * nr);					\
+      for (kx = 0; kx < k; kx++) {					\
+	if (trans) {							\
+	  for (jx = 0; jx < cols; jx++)					\
+	    dst[idx(kx,jx,nr)] = B[idx(p * nr + jx, kx, ldb)];		\
+	} else {							\
+	  const type *src = &B[idx(kx, p * nr, ldb)];			\
+	  for (jx = 0; jx < cols; jx++)					\
+	    dst[idx(kx,jx,nr)] = src[jx];				\
+	}								\
+	for (; jx < nr; jx++)						\
+	  dst[idx(kx,jx,nr)] = 0;					\
+      }									\
+    }									\
+  }
+
+PACK(kernel_dpack_a, kernel_dpack_b, double, dmr, dnr)
+
+/* Multiply out of packed panels:
+ *  Computes rows i0..i1-1 and cols j0..j1-1 of C from the whole of
+ *  packed A and B.  Tiles cut by the rectangle are computed into a
+ *  scratch tile and only the covered part is copied to C.
+ */
+void kernel_dgemm_packed (long i0, long i1, long j0, long j1, long k,
+			  const double *Ap, const double *Bp,
+			  double *C, long ldc,
+			  const struct kernel_epilogue *ep)
+{
+  double tile[KERNEL_MAXTILE];
+  struct tile_ep te, tj;
+  long pc, ic, jp, ip;
+  int ix, jx;
+
+  if (active == NULL)
+    kernel_select(NULL);
+  int mr = active->dmr, nr = active->dnr;
+  long ipfirst = i0 / mr, iplast = (i1 + mr - 1) / mr;
+  int mcp = block_mc > mr ? block_mc / mr : 1;
+  for (pc = 0; pc < k; pc += block_kc) {
+    int kc = min(block_kc, k - pc);
+    if (ep != NULL)
+      tile_ep_init(&te, ep, pc + kc >= k);
+    for (ic = ipfirst; ic < iplast; ic += mcp) {
+      for (jp = j0 / nr; jp * nr < j1; jp++) {
+	const double *b = &Bp[idx(jp * nr, 0, k) + idx(pc, 0, nr)];
+	int jlo = jp * nr < j0 ? j0 - jp * nr : 0;
+	int jhi = min(nr, j1 - jp * nr);
+	const struct tile_ep *tp = NULL;
+	if (ep != NULL) {
+	  tj = te;
+	  if (te.bias != NULL)
+	    tj.bias = te.bias + jp * nr;
+	  tp = &tj;
+	}
+	for (ip = ic; ip < min(ic + mcp, iplast); ip++) {
+	  const double *a = &Ap[idx(ip * mr, 0, k) + idx(pc, 0, mr)];
+	  int ilo = ip * mr < i0 ? i0 - ip * mr : 0;
+	  int ihi = min(mr, i1 - ip * mr);
+	  if (ilo == 0 && jlo == 0 && ihi == mr && jhi == nr) {
+	    active->dukr(kc, a, 1, mr, b, nr, &C[idx(ip * mr, jp * nr, ldc)],
+			 ldc, pc > 0, tp);
+	    continue;
+	  }
+	  active->dukr(kc, a, 1, mr, b, nr, tile, nr, 0, NULL);
+	  for (ix = ilo; ix < ihi; ix++) {
+	    double *c = &C[idx(ip * mr + ix, jp * nr, ldc)];
+	    for (jx = jlo; jx < jhi; jx++)
+	      c[jx] = tp != NULL ? ep_apply(tp, tile[idx(ix,jx,nr)], c[jx],
+					    pc > 0, jx)
+		    : pc > 0 ? c[jx] + tile[idx(ix,jx,nr)]
+			     : tile[idx(ix,jx,nr)];
+	  }
+	}
+      }
+    }
+  }
+}
@@ -0,0 +1,121 @@
+/* Cache-blocked matrix multiply kernel
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdint.h>
+
+/* Cache blocks:
+ *  KC -- depth of a k slice, a MR x KC sliver of A stays in L1
+ *  MC -- rows of A per block, a MC x KC block of A stays in L2
+ *  NC -- cols of B per block, a KC x NC block of B stays in L3
+ *
+ * The MR x NR register tile depends on the instruction set the
+ * micro-kernel was built for, see kernel.c.  These are the defaults;
+ * kernel_blocking changes them for the whole program, for instance to
+ * sizes found by the autotuner.
+ */
+#define KERNEL_MC 96
+#define KERNEL_KC 256
+#define KERNEL_NC 2048
+
+/* Set the cache blocks, any of them <= 0 is left as it is.  Must not
+ * be called while a multiply is running. */
+void kernel_blocking (int mc, int kc, int nc);
+
+/* Cache blocks in use */
+void kernel_blocks (int *mc, int *kc, int *nc);
+
+/* Largest MR x NR register tile of any micro-kernel */
+#define KERNEL_MAXTILE (12 * 32)
+
+/* Pick the micro-kernels to use.
+ *  isa is "avx512", "avx2" or "scalar", or NULL for the best one
+ *  this CPU supports.  Returns -1 if isa is unknown or unsupported.
+ */
+int kernel_select (const char *isa);
+
+/* Name of the micro-kernels in use */
+const char *kernel_isa (void);
+
+/* Blocked multiply:
+ *  C (m by n)  =  A (m by k) times B (k by n)
+ *  lda, ldb and ldc are the row lengths of the arrays holding
+ *  A, B and C, so any of them may be a view into a larger matrix.
+ *  Sizes and row lengths are 64 bit and every offset is worked out
+ *  in size_t, so no dimension or product of them is capped at 2^31.
+ */
+void kernel_dgemm (long m, long n, long k, const double *A, long lda,
+		   const double *B, long ldb, double *C, long ldc);
+
+/* Epilogue fused into kernel_dgemm_ep:
+ *  C = act(alpha * A times B + beta * C + bias)
+ *  Each tile of C is finished while it is still in registers, so
+ *  scaling, a bias row and an activation cost no extra pass over C.
+ *  bias holds a value for every column of C, or is NULL.  C is not
+ *  needed when beta is 0 and any values it holds are ignored.
+ */
+#define KERNEL_ACT_NONE  0
+#define KERNEL_ACT_RELU  1  /* max(x, 0) */
+#define KERNEL_ACT_CLAMP 2  /* min(max(x, lo), hi) */
+
+struct kernel_epilogue {
+  double alpha, beta;
+  const double *bias;
+  int act;
+  double lo, hi;      /* bounds for KERNEL_ACT_CLAMP */
+};
+
+/* kernel_dgemm with an epilogue; ep NULL is a plain multiply */
+void kernel_dgemm_ep (long m, long n, long k, const double *A, long lda,
+		      const double *B, long ldb, double *C, long ldc,
+		      const struct kernel_epilogue *ep);
+
+/* Single precision version of kernel_dgemm */
+void kernel_sgemm (long m, long n, long k, const float *A, long lda,
+		   const float *B, long ldb, float *C, long ldc);
+
+/* Integer versions: int32 in and out, and int8 in with int32 sums
+ * and result.  Every sum must fit in 32 bits.
+ */
+void kernel_igemm (long m, long n, long k, const int32_t *A, long lda,
+		   const int32_t *B, long ldb, int32_t *C, long ldc);
+void kernel_i8gemm (long m, long n, long k, const int8_t *A, long lda,
+		    const int8_t *B, long ldb, int32_t *C, long ldc);
+
+/* Register tile of the double precision micro-kernel in use */
+int kernel_mr (void);
+int kernel_nr (void);
+
+/* Register tile of the float and integer micro-kernels in use */
+int kernel_smr (void);
+int kernel_snr (void);
+
+/* Packing A and B into kernel-ordered panels:
+ *  A (m by k) becomes ceil(m/MR) panels of MR*k elements and
+ *  B (k by n) becomes ceil(n/NR) panels of NR*k elements, with the
+ *  edges zero padded.  Only panels p0 .. p1-1 are written, so the
+ *  work can be split between threads.  With trans set the array
+ *  holds the operand transposed (k by m for A, n by k for B, row
+ *  length lda or ldb) and is packed as its transpose.
+ */
+void kernel_dpack_a (long m, long k, const double *A, long lda, int trans,
+		     double *Ap, long p0, long p1);
+void kernel_dpack_b (long k, long n, const double *B, long ldb, int trans,
+		     double *Bp, long p0, long p1);
+
+/* Multiply from packed panels:
+ *  Rows i0 .. i1-1, cols j0 .. j1-1 of C (row length ldc) from the
+ *  packed A and B of a multiply with inner dimension k, finished by
+ *  epilogue ep unless it is NULL.  bias is indexed by column of C.
+ */
+void kernel_dgemm_packed (long i0, long i1, long j0, long j1, long k,
+			  const double *Ap, const double *Bp,
+			  double *C, long ldc,
+			  const struct kernel_epilogue *ep);
+
+#endif
@@ -0,0 +1,191 @@
+/* Binary matrix files
+ *
+ *   Michael Albert
+ *
+ *  A file is a struct matio_header followed by rows*cols elements.
+ *  Reading maps the file so a double row-major matrix can be used in
+ *  place without parsing or copying.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "matio.h"
+
+size_t matio_dtype_size (uint32_t dtype)
+{
+  switch (dtype) {
+  case MATIO_F64: return 8;
+  case MATIO_F32: return 4;
+  case MATIO_I32: return 4;
+  case MATIO_I8:  return 1;
+  }
+  return 0;
+}
+
+static void header_init (struct matio_header *h, uint32_t dtype,
+			 uint32_t layout, uint64_t rows, uint64_t cols)
+{
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, MATIO_MAGIC, sizeof(h->magic));
+  h->version = MATIO_VERSION;
+  h->dtype = dtype;
+  h->layout = layout;
+  h->rows = rows;
+  h->cols = cols;
+  h->offset = sizeof(*h);
+}
+
+int matio_open_fd (const char *path, struct matio_header *h)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf (stderr, "%s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  size_t esize = 0;
+  if (pread(fd, h, sizeof(*h), 0) == sizeof(*h))
+    esize = matio_dtype_size(h->dtype);
+  if (esize == 0 || memcmp(h->magic, MATIO_MAGIC, sizeof(h->magic)) != 0
+      || h->version != MATIO_VERSION || h->layout > MATIO_COL_MAJOR
+      || h->offset < sizeof(*h) || h->offset > (uint64_t) st.st_size
+      || (h->cols && h->rows > (st.st_size - h->offset) / h->cols / esize)) {
+    fprintf (stderr, "%s: not a matrix file or truncated\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int matio_create_fd (const char *path, uint32_t dtype, uint32_t layout,
+		     uint64_t rows, uint64_t cols, struct matio_header *h)
+{
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  header_init(h, dtype, layout, rows, cols);
+  if (fd < 0 || pwrite(fd, h, sizeof(*h), 0) != sizeof(*h)
+      || ftruncate(fd, h->offset + rows * cols * matio_dtype_size(dtype))) {
+    fprintf (stderr, "%s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Map all of an open file and point mf->data at the elements */
+static int map_file (const char *path, struct matfile *mf, int prot,
+		     int flags)
+{
+  mf->maplen = mf->h.offset + mf->h.rows * mf->h.cols
+                              * matio_dtype_size(mf->h.dtype);
+  mf->map = mmap(NULL, mf->maplen, prot, flags, mf->fd, 0);
+  if (mf->map == MAP_FAILED) {
+    fprintf (stderr, "%s: %s\n", path, strerror(errno));
+    close(mf->fd);
+    return -1;
+  }
+  mf->data = (char *) mf->map + mf->h.offset;
+  return 0;
+}
+
+int matio_open (const char *path, struct matfile *mf)
+{
+  memset(mf, 0, sizeof(*mf));
+  mf->fd = matio_open_fd(path, &mf->h);
+  if (mf->fd < 0 || map_file(path, mf, PROT_READ, MAP_PRIVATE) != 0)
+    return -1;
+  madvise(mf->map, mf->maplen, MADV_SEQUENTIAL);
+  return 0;
+}
+
+int matio_create (const char *path, uint32_t dtype, uint32_t layout,
+		  uint64_t rows, uint64_t cols, struct matfile *mf)
+{
+  memset(mf, 0, sizeof(*mf));
+  mf->fd = matio_create_fd(path, dtype, layout, rows, cols, &mf->h);
+  if (mf->fd < 0)
+    return -1;
+  return map_file(path, mf, PROT_READ | PROT_WRITE, MAP_SHARED);
+}
+
+/* write() all of buf, retrying short writes */
+static int write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = (const char *) buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int matio_save (const char *path, const double *A, uint64_t rows,
+		uint64_t cols)
+{
+  struct matio_header h;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  header_init(&h, MATIO_F64, MATIO_ROW_MAJOR, rows, cols);
+  if (fd < 0 || write_all(fd, &h, sizeof(h)) != 0
+      || write_all(fd, A, sizeof(double) * rows * cols) != 0) {
+    fprintf (stderr, "%s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return close(fd);
+}
+
+double *matio_f64 (struct matfile *mf, int *copied)
+{
+  uint64_t rows = mf->h.rows, cols = mf->h.cols, ix, iy;
+
+  *copied = 0;
+  if (mf->h.dtype == MATIO_F64 && mf->h.layout == MATIO_ROW_MAJOR)
+    return (double *) mf->data;
+
+  double *A = (double *) malloc(sizeof(double) * rows * cols);
+  if (A == NULL)
+    return NULL;
+  *copied = 1;
+  for (ix = 0; ix < rows; ix++) {
+    for (iy = 0; iy < cols; iy++) {
+      uint64_t at = mf->h.layout == MATIO_ROW_MAJOR ? ix * cols + iy
+	                                             : iy * rows + ix;
+      switch (mf->h.dtype) {
+      case MATIO_F64: A[ix * cols + iy] = ((double *) mf->data)[at]; break;
+      case MATIO_F32: A[ix * cols + iy] = ((float *) mf->data)[at]; break;
+      case MATIO_I32: A[ix * cols + iy] = ((int32_t *) mf->data)[at]; break;
+      case MATIO_I8:  A[ix * cols + iy] = ((int8_t *) mf->data)[at]; break;
+      }
+    }
+  }
+  return A;
+}
+
+void matio_close (struct matfile *mf)
+{
+  if (mf->map != NULL && mf->map != MAP_FAILED)
+    munmap(mf->map, mf->maplen);
+  if (mf->fd >= 0)
+    close(mf->fd);
+  memset(mf, 0, sizeof(*mf));
+  mf->fd = -1;
+}
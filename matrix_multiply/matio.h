@@ -0,0 +1,84 @@
+/* Binary matrix files
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef MATIO_H
+#define MATIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* On-disk header, 64 bytes so the data after it stays aligned.
+ *  Fields are in the byte order of the machine that wrote the file;
+ *  a file from the other byte order fails the magic check.
+ */
+#define MATIO_MAGIC   "MATRIX\r\n"
+#define MATIO_VERSION 1
+
+/* Element types */
+#define MATIO_F64 1
+#define MATIO_F32 2
+#define MATIO_I32 3
+#define MATIO_I8  4
+
+/* Element order */
+#define MATIO_ROW_MAJOR 0
+#define MATIO_COL_MAJOR 1
+
+struct matio_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  uint32_t layout;
+  uint32_t pad;
+  uint64_t rows, cols;
+  uint64_t offset;     /* byte offset of the first element */
+  uint8_t reserved[16];
+};
+
+/* An open, memory-mapped matrix file */
+struct matfile {
+  int fd;
+  void *map;
+  size_t maplen;
+  struct matio_header h;
+  void *data;          /* first element, inside map */
+};
+
+/* Bytes per element of dtype, 0 if dtype is unknown */
+size_t matio_dtype_size (uint32_t dtype);
+
+/* Map an existing file read-only.  Returns -1 and prints why on a
+ * missing, short or malformed file.
+ */
+int matio_open (const char *path, struct matfile *mf);
+
+/* Create (or truncate) a file for a rows x cols matrix and map it
+ * writable, so a result can be computed straight into mf->data.
+ */
+int matio_create (const char *path, uint32_t dtype, uint32_t layout,
+		  uint64_t rows, uint64_t cols, struct matfile *mf);
+
+/* The same without the mapping, for pread and pwrite:
+ *  each returns the open descriptor with *h filled in, or -1.
+ */
+int matio_open_fd (const char *path, struct matio_header *h);
+int matio_create_fd (const char *path, uint32_t dtype, uint32_t layout,
+		     uint64_t rows, uint64_t cols, struct matio_header *h);
+
+/* Write a row-major matrix of doubles with plain write calls */
+int matio_save (const char *path, const double *A, uint64_t rows,
+		uint64_t cols);
+
+/* Row-major doubles for an open file: the mapping itself when the
+ * file already holds them, otherwise a converted malloc'd copy
+ * (*copied is set, free it when done).  NULL if out of memory.
+ */
+double *matio_f64 (struct matfile *mf, int *copied);
+
+/* Unmap and close, flushing a file made by matio_create */
+void matio_close (struct matfile *mf);
+
+#endif
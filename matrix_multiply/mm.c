@@ -10,17 +10,29 @@
 #include <math.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include "kernel.h"
+#include "strassen.h"
+#include "matio.h"
+#include "ooc.h"
+#include "sparse.h"
+#include "bench.h"
+#include "tune.h"
+#include "rng.h"
+#include "dump.h"
+#include "arena.h"
 
 /* idx macro calculates the correct 2-d based 1-d index
  * of a location (x,y) in an array that has col columns.
- * This is calculated in row major order.
+ * This is calculated in row major order, in size_t so it does
+ * not overflow for matrices past 2^31 elements.
  */
 
-#define idx(x,y,col)  ((x)*(col) + (y))
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
 
 /* Matrix Multiply:
  *  C (x by z)  =  A ( x by y ) times B (y by z)
@@ -28,15 +40,15 @@
  *  A and B are not be modified
  */
 
-void MatMul (double *A, double *B, double *C, int x, int y, int z)
+void MatMul (double *A, double *B, double *C, long x, long y, long z)
 {
-  int ix, jx, kx;
+  long ix, jx, kx;
 
   for (ix = 0; ix < x; ix++) {
     // Rows of solution
     for (jx = 0; jx < z; jx++) {
       // Columns of solution
-      float tval = 0;
+      double tval = 0;
       for (kx = 0; kx < y; kx++) {
 	// Sum the A row time B column
 	tval += A[idx(ix,kx,y)] * B[idx(kx,jx,z)];
@@ -46,65 +58,364 @@ void MatMul (double *A, double *B, double *C, int x, int y, int z)
   }
 }
 
-/* Matrix Square:
- *  B = A ^ 2*times
+/* Blocked Matrix Multiply:
+ *  Same contract as MatMul, but runs the cache-blocked,
+ *  register-tiled kernel from kernel.c.
+ */
+
+void MatMulBlocked (double *A, double *B, double *C, long x, long y, long z)
+{
+  kernel_dgemm(x, z, y, A, y, B, z, C, z);
+}
+
+/* Bytes of a rows by cols matrix of doubles.  The sizes come from
+ * the command line, so a product that does not fit in a size_t ends
+ * the program instead of wrapping. */
+
+size_t MatBytes (long rows, long cols)
+{
+  size_t bytes;
+
+  if (rows < 0 || cols < 0
+      || __builtin_mul_overflow((size_t) rows, (size_t) cols, &bytes)
+      || __builtin_mul_overflow(bytes, sizeof(double), &bytes)) {
+    fprintf (stderr, "A %ld by %ld matrix is too big\n", rows, cols);
+    exit(1);
+  }
+  return bytes;
+}
+
+/* A rows by cols matrix on transparent huge pages */
+
+double *MatAlloc (long rows, long cols)
+{
+  size_t bytes = MatBytes(rows, cols);
+  double *p = (double *) arena_pages(bytes, ARENA_THP);
+
+  if (p == NULL && bytes != 0) {
+    fprintf (stderr, "Out of memory for a %ld by %ld matrix\n", rows, cols);
+    exit(1);
+  }
+  return p;
+}
+
+/* Temporaries:
+ *  Strassen's sums and MatPower's products come out of one arena on
+ *  transparent huge pages that is kept between calls, so repeated
+ *  multiplies and powers only go back to the system for a bigger
+ *  size than before.  The outermost call reserves what it needs.
+ */
+
+struct arena temps;
+
+/* Strassen Matrix Multiply:
+ *  Square multiplies bigger than cutoff go through Strassen-Winograd,
+ *  everything else (or a failed temporary allocation) through the
+ *  blocked kernel.
+ */
+
+int cutoff = STRASSEN_CUTOFF;
+
+void MatMulStrassen (double *A, double *B, double *C, long x, long y,
+		     long z)
+{
+  if (x == y && y == z
+      && arena_reserve(&temps, strassen_bytes(NULL, x, cutoff),
+		       ARENA_THP) == 0
+      && strassen_dgemm_arena(&temps, NULL, x, A, x, B, x, C, x,
+			      cutoff) == 0)
+    return;
+  MatMulBlocked(A, B, C, x, y, z);
+}
+
+/* Sparse Matrix Multiply:
+ *  A is turned into CSR and multiplied into the rows of C a nonzero
+ *  at a time, so the time goes with the nonzeros of A rather than
+ *  its size.  Falls back to blocked if A will not fit as CSR, or C
+ *  is too wide for its int column tasks.
+ */
+
+void MatMulSparse (double *A, double *B, double *C, long x, long y, long z)
+{
+  struct csr S;
+
+  if (z > INT_MAX || csr_from_dense(&S, A, x, y, y) != 0) {
+    MatMulBlocked(A, B, C, x, y, z);
+    return;
+  }
+  sparse_dgemm(NULL, &S, B, z, z, C, z);
+  csr_free(&S);
+}
+
+/* Kernel selected with -k, used by main and MatPower */
+void (*Mul)(double *, double *, double *, long, long, long) = MatMul;
+
+/* Buffers a power computation writes into: P itself and up to
+ * three temporaries, allocated on first use.  A buffer is free when
+ * it holds neither the current square nor the partial product.
+ */
+struct powbufs {
+  double *P, *T[3];
+  long x;
+};
+
+double *PowGrab (struct powbufs *pb, double *sq, double *r, int avoidP)
+{
+  int i;
+
+  if (!avoidP && pb->P != sq && pb->P != r)
+    return pb->P;
+  for (i = 0; i < 3; i++) {
+    if (pb->T[i] == NULL)
+      pb->T[i] = (double *)arena_alloc(&temps, sizeof(double)*pb->x*pb->x);
+    if (pb->T[i] != sq && pb->T[i] != r)
+      return pb->T[i];
+  }
+  return NULL;  /* three are always enough */
+}
+
+/* Number of multiplies MatPower needs for A ^ n */
+int PowerMuls (int n)
+{
+  int muls = 0;
+
+  for (; n > 1; n >>= 1)
+    muls += 1 + (n & 1);
+  return muls;
+}
+
+/* Matrix Power:
+ *  P = A ^ n, for n >= 1
+ *
+ *  Squares A repeatedly and multiplies in the squares for the set
+ *  bits of n, so it takes floor(log2 n) + popcount(n) - 1 multiplies.
+ *  Products are written straight into whichever buffer is free and
+ *  only pointers move; the last product lands in P, so nothing is
+ *  copied unless n is 1 or the result is a square the caller keeps.
+ *
+ *  squares may be NULL, or hold a buffer for each i = 1 .. log2(n)
+ *  (entry 0 is unused).  A non-NULL entry receives A ^ (2^i) and is
+ *  left intact for the caller.
  *
  *    A are not be modified.
  */
 
-void MatSquare (double *A, double *B, int x, int times)
+void MatPower (double *A, double *P, long x, int n, double **squares)
 {
-  int i;
+  struct powbufs pb = { P, { NULL, NULL, NULL }, x };
+  double *sq = A;     /* A ^ (2^i) */
+  double *r = NULL;   /* product of the squares for the bits so far */
+  int k = 0, bits = 0, b = -1, i;
+  size_t bytes, mark;
 
-  MatMul (A, A, B, x, x, x);
-  if (times > 1) {
-    /* Need a Temporary for the computation */
-    double *T = (double *)malloc(sizeof(double)*x*x);
-    for (i = 1; i < times; i+= 2) {
-      MatMul (B, B, T, x, x, x);
-      if (i == times - 1)
-	memcpy(B, T, sizeof(double)*x*x);
+  if (n == 1) {
+    memcpy(P, A, sizeof(double)*x*x);
+    return;
+  }
+  bytes = ARENA_BYTES(3, MatBytes(x, x));
+  if (Mul == MatMulStrassen)
+    bytes += strassen_bytes(NULL, x, cutoff);
+  if (arena_reserve(&temps, bytes, ARENA_THP) != 0) {
+    fprintf (stderr, "Out of memory for %ld by %ld temporaries\n", x, x);
+    exit(1);
+  }
+  mark = arena_mark(&temps);
+
+  /* k is the top bit of n and b the next set bit below it */
+  for (i = 0; (n >> i) != 0; i++) {
+    if (n >> i & 1) {
+      bits++;
+      b = k;
+      k = i;
+    }
+  }
+  if (bits == 1)
+    b = -1;
+
+  /* The sources of the last multiply must not sit in P: S_(k-1)
+   * when n is a power of two, otherwise S_k and the partial product
+   * from bit b (a bare square when n has only two bits set). */
+  for (i = 0; i <= k; i++) {
+    if (n >> i & 1) {
+      if (r == NULL) {
+	r = sq;
+      } else {
+	double *dst = (i == k) ? P : PowGrab(&pb, sq, r, i == b);
+	Mul (r, sq, dst, x, x, x);
+	r = dst;
+      }
+    }
+    if (i < k) {
+      int s = i + 1;
+      double *dst;
+      if (squares != NULL && squares[s] != NULL)
+	dst = squares[s];
+      else if (bits == 1 && s == k)
+	dst = P;
       else
-	MatMul (T, T, B, x, x, x);
+	dst = PowGrab(&pb, sq, r, bits == 1 ? s == k - 1
+		      : (s == k || (bits == 2 && s == b)));
+      Mul (sq, sq, dst, x, x, x);
+      sq = dst;
     }
-    free(T);
   }
+  if (r != P)
+    memcpy(P, r, sizeof(double)*x*x);
+  arena_release(&temps, mark);
 }
 
-/* Print a matrix: */
-void MatPrint (double *A, int x, int y)
+/* Matrix Square:
+ *  B = A ^ (2^times), squaring A times times
+ *
+ *    A are not be modified.
+ */
+
+void MatSquare (double *A, double *B, long x, int times)
 {
-  int ix, iy;
+  MatPower (A, B, x, 1 << times, NULL);
+}
 
-  for (ix = 0; ix < x; ix++) {
-    printf ("Row %d: ", ix);
-    for (iy = 0; iy < y; iy++)
-      printf (" %10.5G", A[idx(ix,iy,y)]);
-    printf ("\n");
+/* Print a matrix: */
+void MatPrint (double *A, long x, long y)
+{
+  if (dump_matrix(NULL, 1, DUMP_TEXT, MATIO_F64, A, x, y) != 0) {
+    perror("stdout");
+    exit(1);
   }
 }
 
 
-/* Generate data for a matrix: */
-void MatGen (double *A, int x, int y, int rand)
+/* Generate data for a matrix:
+ *  Random data is element i * y + j of the matrix's stream under
+ *  seed, the same numbers pt-mm generates.
+ */
+#define GEN_A 0
+#define GEN_B 1
+
+uint64_t seed = 0;  /* set by -S, else from the clock with -r */
+
+void MatGen (double *A, long x, long y, int rand, uint32_t stream)
 {
-  int ix, iy;
+  long ix, iy;
 
   for (ix = 0; ix < x ; ix++) {
-    for (iy = 0; iy < y ; iy++) {
-      A[idx(ix,iy,y)] = ( rand ?
-			  ((double)(random() % 200000000))/2000000000.0 :
-			  (1.0 + (((double)ix)/100.0) + (((double)iy/1000.0))));
+    double *row = &A[idx(ix,0,y)];
+    if (rand) {
+      rng_uniform(seed, stream, (uint64_t)ix * y, y, row);
+      for (iy = 0; iy < y ; iy++)
+	row[iy] *= 0.1;
+    } else {
+      for (iy = 0; iy < y ; iy++)
+	row[iy] = 1.0 + (((double)ix)/100.0) + (((double)iy/1000.0));
     }
   }
 }
 
+/* Matrix from a file given with -A or -B, as row-major doubles.
+ *  The mapping is used in place when it already holds them. */
+double *MatLoad (const char *path, long *rows, long *cols)
+{
+  struct matfile mf;
+  int copied;
+
+  if (matio_open(path, &mf) != 0)
+    exit(1);
+  if (mf.h.rows == 0 || mf.h.cols == 0 || mf.h.rows > LONG_MAX
+      || mf.h.cols > LONG_MAX) {
+    fprintf (stderr, "%s: can't multiply a %lu by %lu matrix\n", path,
+             (unsigned long) mf.h.rows, (unsigned long) mf.h.cols);
+    exit(1);
+  }
+  *rows = mf.h.rows;
+  *cols = mf.h.cols;
+  double *A = matio_f64(&mf, &copied);
+  if (A == NULL) {
+    fprintf (stderr, "%s: out of memory converting to double\n", path);
+    exit(1);
+  }
+  if (copied)
+    matio_close(&mf);
+  return A;
+}
+
+/* Result matrix mapped from the -C file, computed in place */
+double *MatOutput (const char *path, long rows, long cols)
+{
+  struct matfile mf;
+
+  MatBytes(rows, cols);
+  if (matio_create(path, MATIO_F64, MATIO_ROW_MAJOR, rows, cols, &mf) != 0)
+    exit(1);
+  return (double *) mf.data;
+}
+
+/* Size from a file must agree with any given on the command line */
+void SizeCheck (const char *path, long *size, long file)
+{
+  if (*size != 0 && *size != file) {
+    fprintf (stderr, "%s: size %ld does not match %ld\n", path, file, *size);
+    exit(1);
+  }
+  *size = file;
+}
+
+/* Benchmark run:
+ *  One repetition is the power when power is set, else C = A times
+ *  B.  -w runs are thrown away before -R are timed one by one and
+ *  reported with bench_print.
+ */
+struct run {
+  double *A, *B, *C;
+  long x, y, z;
+  int power;
+};
+
+void RunOnce (void *arg)
+{
+  struct run *r = (struct run *) arg;
+
+  if (r->power)
+    MatPower(r->A, r->C, r->x, r->power, NULL);
+  else
+    Mul(r->A, r->B, r->C, r->x, r->y, r->z);
+}
+
+void Bench (struct run *r, const char *kernel, int format, int warmup,
+	    int reps)
+{
+  struct bench_stats st;
+  double muls = r->power ? PowerMuls(r->power) : 1;
+  double x = r->x, y = r->y, z = r->z;
+  struct bench_case c = {
+    "mm", kernel, Mul == MatMul ? "none" : kernel_isa(), "f64", 1,
+    r->x, r->z, r->y, r->power,
+    2 * x * y * z * muls, sizeof(double) * (x * y + y * z + x * z) * muls
+  };
+
+  if (bench_run(RunOnce, r, warmup, reps, &st) != 0) {
+    fprintf (stderr, "Can't run %d repetitions\n", reps);
+    exit(1);
+  }
+  bench_print(stdout, format, &c, warmup, &st);
+}
+
 /* Print a help message on how to run the program */
 
 void usage(char *prog)
 {
-  fprintf (stderr, "%s: [-Tdr] -x val -y val -z val\n", prog);
-  fprintf (stderr, "%s: [-Tdr] -s num -x val\n", prog);
+  fprintf (stderr, "%s: [-Tdr] [-k kernel] -x val -y val -z val\n", prog);
+  fprintf (stderr, "%s: [-Tdr] [-k kernel] -s num -x val\n", prog);
+  fprintf (stderr, "%s: [-Tdr] [-k kernel] -e num -x val\n", prog);
+  fprintf (stderr, "  kernel is naive (default), blocked, strassen or sparse;\n");
+  fprintf (stderr, "    without -k, sparse inputs are picked out by density\n");
+  fprintf (stderr, "  -c n sets the size strassen hands over to blocked\n");
+  fprintf (stderr, "  -v isa forces the blocked micro-kernel: avx512, avx2 or scalar\n");
+  fprintf (stderr, "  -S seed generates random data from seed, -r from the clock\n");
+  fprintf (stderr, "  -A and -B read the inputs from matrix files, -C writes the result,\n");
+  fprintf (stderr, "  -W writes the generated inputs to the -A and -B files instead\n");
+  fprintf (stderr, "  -X f writes the result as CSV text to f, - for stdout\n");
+  fprintf (stderr, "  -M mb streams -A times -B into -C holding at most mb MiB\n");
+  fprintf (stderr, "  -o csv|json times -R runs after -w warmups and prints statistics\n");
   exit(1);
 }
 
@@ -112,9 +423,25 @@ void usage(char *prog)
 /* Main function
  *
  *  args:  -T   -- record the program computation time
+ *         -A f -- read A from matrix file f, which sets its size
+ *         -B f -- read B from matrix file f
+ *         -C f -- write the result to matrix file f
+ *         -c n -- strassen cutoff, sizes <= n use the blocked kernel
  *         -d   -- debug and print results
+ *         -e n -- raise the matrix to the n-th power
+ *         -M m -- out-of-core multiply of the -A and -B files into -C,
+ *                 holding no more than m MiB of them in memory
+ *         -k k -- multiply kernel, naive, blocked, strassen or sparse;
+ *                 without it sparse inputs use sparse and the rest naive
+ *         -o f -- benchmark record in format f, csv or json
+ *         -R n -- timed repetitions for -o
  *         -r   -- use random data between 0 and 1
+ *         -S s -- random data from seed s, as pt-mm -S s makes it
  *         -s t -- square the matrix t times
+ *         -v i -- micro-kernel instruction set, avx512, avx2 or scalar
+ *         -w n -- untimed warmup runs before the -o repetitions
+ *         -W   -- write the generated A and B to the -A and -B files
+ *         -X f -- write the result to f as CSV, or to stdout for -
  *         -x   -- rows of the first matrix, r & c for squaring
  *         -y   -- cols of A, rows of B
  *         -z   -- cols of B
@@ -126,37 +453,115 @@ int main (int argc, char ** argv) {
   int ch;                /* for use with getopt(3) */
 
   /* option data */
-  int x = 0, y = 0, z = 0;
+  long x = 0, y = 0, z = 0;
   int timer = 0;
   int debug = 0;
   int square = 0;
   int useRand = 0;
   int sTimes = 0;
+  int power = 0;
+  char *kernel = "naive";
+  int chosen = 0;        /* set by -k */
+  char *afile = NULL, *bfile = NULL, *cfile = NULL;
+  char *csvfile = NULL;
+  int save = 0;
+  long budget = 0;
+  int format = -1;
+  int warmup = 0;
+  int reps = 1;
+
+  /* Micro-kernel and blocking saved by pt-mm -u, unless -v says
+   * otherwise */
+  struct tune tuned;
+  const char *tunefile = tune_path();
+  if (tunefile != NULL && tune_load(tunefile, &tuned) != -1)
+    tune_apply(&tuned);
 
-  while ((ch = getopt(argc, argv, "Tdrs:x:y:z:")) != -1) {
+  while ((ch = getopt(argc, argv, "A:B:C:M:R:S:Tc:de:k:o:rs:v:w:WX:x:y:z:")) != -1) {
     switch (ch) {
+    case 'A':  /* A input file */
+      afile = optarg;
+      break;
+    case 'B':  /* B input file */
+      bfile = optarg;
+      break;
+    case 'C':  /* C output file */
+      cfile = optarg;
+      break;
+    case 'M':  /* out-of-core budget */
+      budget = atol(optarg);
+      break;
+    case 'R':  /* repetitions */
+      reps = atoi(optarg);
+      break;
     case 'T':  /* timing */
       timer = 1;
       break;
+    case 'c':  /* strassen cutoff */
+      cutoff = atoi(optarg);
+      break;
     case 'd':  /* debug */
       debug = 1;
       break;
+    case 'e':  /* exponent */
+      power = atoi(optarg);
+      square = 1;
+      break;
+    case 'k':  /* kernel */
+      kernel = optarg;
+      chosen = 1;
+      if (strcmp(kernel, "naive") == 0)
+	Mul = MatMul;
+      else if (strcmp(kernel, "blocked") == 0)
+	Mul = MatMulBlocked;
+      else if (strcmp(kernel, "strassen") == 0)
+	Mul = MatMulStrassen;
+      else if (strcmp(kernel, "sparse") == 0)
+	Mul = MatMulSparse;
+      else
+	usage(argv[0]);
+      break;
+    case 'o':  /* benchmark output */
+      format = bench_format(optarg);
+      if (format < 0)
+	usage(argv[0]);
+      break;
     case 'r':  /* debug */
       useRand = 1;
-      srandom(time(NULL));
+      if (seed == 0)
+	seed = time(NULL);
+      break;
+    case 'S':  /* seed */
+      useRand = 1;
+      seed = strtoull(optarg, NULL, 0);
       break;
     case 's':  /* s times */
       sTimes = atoi(optarg);
       square = 1;
       break;
+    case 'v':  /* vector isa */
+      if (kernel_select(optarg) != 0) {
+	fprintf (stderr, "Instruction set %s is not available\n", optarg);
+	usage(argv[0]);
+      }
+      break;
+    case 'w':  /* warmup */
+      warmup = atoi(optarg);
+      break;
+    case 'W':  /* write inputs */
+      save = 1;
+      break;
+    case 'X':  /* CSV result */
+      csvfile = optarg;
+      break;
     case 'x':  /* x size */
-      x = atoi(optarg);
+      x = atol(optarg);
       break;
     case 'y':  /* y size */
-      y = atoi(optarg);
+      y = atol(optarg);
       break;
     case 'z':  /* z size */
-      z = atoi(optarg);
+      z = atol(optarg);
       break;
     case '?': /* help */
     default:
@@ -164,21 +569,75 @@ int main (int argc, char ** argv) {
     }
   }
 
+  /* Out-of-core: straight from the input files to the output file */
+  if (budget != 0) {
+    struct ooc_stats st;
+    if (budget < 0 || square || save || afile == NULL || bfile == NULL
+        || cfile == NULL || csvfile != NULL) {
+      fprintf (stderr, "Inconsistent options\n");
+      usage(argv[0]);
+    }
+    if (ooc_dgemm(NULL, afile, bfile, cfile, (size_t) budget << 20, &st) != 0)
+      exit(1);
+    if (timer)
+      printf("Clock time is %.3f, %ld blocks, read %.3f, waited %.3f, "
+             "wrote %.3f, %.3f GFLOP/s\n", st.time, st.blocks,
+             st.read_time, st.wait_time, st.write_time,
+             st.flops / st.time / 1e9);
+    return 0;
+  }
+
+  /* Matrices read from files fix the sizes */
+  double *fileA = NULL, *fileB = NULL;
+  long rows, cols;
+  if ((square && bfile != NULL) || (save && afile == NULL && bfile == NULL)
+      || reps < 1 || warmup < 0) {
+    fprintf (stderr, "Inconsistent options\n");
+    usage(argv[0]);
+  }
+  if (afile != NULL && !save) {
+    fileA = MatLoad(afile, &rows, &cols);
+    SizeCheck(afile, &x, rows);
+    if (square && rows != cols) {
+      fprintf (stderr, "%s: can't raise a non-square matrix to a power\n",
+               afile);
+      exit(1);
+    }
+    if (!square)
+      SizeCheck(afile, &y, cols);
+  }
+  if (bfile != NULL && !save) {
+    fileB = MatLoad(bfile, &rows, &cols);
+    SizeCheck(bfile, &y, rows);
+    SizeCheck(bfile, &z, cols);
+  }
+
   /* verify options are correct. */
   if (square) {
-    if (y != 0 || z != 0 || x <= 0 || sTimes < 1) {
+    if (y != 0 || z != 0 || x <= 0 || (sTimes != 0) == (power != 0)
+	|| sTimes < 0 || sTimes > 30 || power < 0) {
       fprintf (stderr, "Inconsistent options\n");
       usage(argv[0]);
     }
+    if (sTimes)
+      power = 1 << sTimes;
   } else if (x <= 0 || y <= 0 || z <= 0) {
     fprintf (stderr, "-x, -y, and -z all need to be specified or -s and -x.\n");
     usage(argv[0]);
   }
 
+  /* Kernel name reported with -T */
+  char label[32];
+  if (Mul == MatMul)
+    snprintf(label, sizeof(label), "%s", kernel);
+  else
+    snprintf(label, sizeof(label), "%s/%s", kernel, kernel_isa());
+
   /* timers */
   clock_t start_time, end_time, cpu_time;
   time_t wall_time;
   struct timeval start_tv, end_tv;
+  double elapsed, flops;
 
   /* Matrix storage */
   double *A;
@@ -186,23 +645,39 @@ int main (int argc, char ** argv) {
   double *C;
 
   if (square) {
-    A = (double *) malloc (sizeof(double) * x * x);
-    B = (double *) malloc (sizeof(double) * x * x);
-    MatGen(A,x,x,useRand);
+    if (fileA != NULL) {
+      A = fileA;
+    } else {
+      A = MatAlloc(x, x);
+      MatGen(A,x,x,useRand,GEN_A);
+      if (save && matio_save(afile, A, x, x) != 0)
+	exit(1);
+    }
+    if (cfile != NULL)
+      B = MatOutput(cfile, x, x);
+    else
+      B = MatAlloc(x, x);
     /* Calculate run time */
-    if (timer) {
+    if (format >= 0) {
+      struct run r = { A, NULL, B, x, x, x, power };
+      Bench(&r, kernel, format, warmup, reps);
+    } else if (timer) {
       gettimeofday(&start_tv, NULL);
       start_time = clock();
-      MatSquare(A, B, x, sTimes);
+      MatPower(A, B, x, power, NULL);
       end_time = clock();
       gettimeofday(&end_tv, NULL);
       cpu_time = end_time - start_time;
       wall_time = end_tv.tv_sec - start_tv.tv_sec;
-      printf("Clock time is %ld, CPU time is %ld\n", wall_time, cpu_time);
+      elapsed = (end_tv.tv_sec - start_tv.tv_sec)
+	+ (end_tv.tv_usec - start_tv.tv_usec) / 1e6;
+      flops = 2.0 * x * x * x * PowerMuls(power);
+      printf("Clock time is %ld, CPU time is %ld, %s kernel %.3f GFLOP/s\n",
+	     wall_time, cpu_time, label, flops / elapsed / 1e9);
     }
     /* Run normally */
     else {
-      MatSquare(A, B, x, sTimes);
+      MatPower(A, B, x, power, NULL);
     }
     if (debug) {
       printf ("-------------- orignal matrix ------------------\n");
@@ -210,26 +685,61 @@ int main (int argc, char ** argv) {
       printf ("--------------  result matrix ------------------\n");
       MatPrint(B,x,x);
     }
+    if (csvfile != NULL
+	&& dump_file(NULL, csvfile, DUMP_CSV, MATIO_F64, B, x, x) != 0)
+      exit(1);
   } else {
-    A = (double *) malloc (sizeof(double) * x * y);
-    B = (double *) malloc (sizeof(double) * y * z);
-    C = (double *) malloc (sizeof(double) * x * z);
-    MatGen(A,x,y,useRand);
-    MatGen(B,y,z,useRand);
+    if (fileA != NULL) {
+      A = fileA;
+    } else {
+      A = MatAlloc(x, y);
+      MatGen(A,x,y,useRand,GEN_A);
+      if (save && afile != NULL && matio_save(afile, A, x, y) != 0)
+	exit(1);
+    }
+    if (fileB != NULL) {
+      B = fileB;
+    } else {
+      B = MatAlloc(y, z);
+      MatGen(B,y,z,useRand,GEN_B);
+      if (save && bfile != NULL && matio_save(bfile, B, y, z) != 0)
+	exit(1);
+    }
+    if (cfile != NULL)
+      C = MatOutput(cfile, x, z);
+    else
+      C = MatAlloc(x, z);
+    /* Without -k, inputs sparse enough for it go through the CSR
+     * multiply, judged from a sample as pt-mm does */
+    if (!chosen && x <= INT_MAX && y <= INT_MAX && z <= INT_MAX
+	&& sparse_choice(sparse_density(A, x, y, y, SPARSE_SAMPLES),
+			 sparse_density(B, y, z, z, SPARSE_SAMPLES), y)
+	   != SPARSE_OFF) {
+      kernel = "sparse";
+      Mul = MatMulSparse;
+      snprintf(label, sizeof(label), "%s/%s", kernel, kernel_isa());
+    }
     /* Calculate run time */
-    if (timer) {
+    if (format >= 0) {
+      struct run r = { A, B, C, x, y, z, 0 };
+      Bench(&r, kernel, format, warmup, reps);
+    } else if (timer) {
       gettimeofday(&start_tv, NULL);
       start_time = clock();
-      MatMul(A, B, C, x, y, z);
+      Mul(A, B, C, x, y, z);
       end_time = clock();
       gettimeofday(&end_tv, NULL);
       cpu_time = end_time - start_time;
       wall_time = end_tv.tv_sec - start_tv.tv_sec;
-      printf("Clock time is %ld, CPU time is %ld\n", wall_time, cpu_time);
+      elapsed = (end_tv.tv_sec - start_tv.tv_sec)
+	+ (end_tv.tv_usec - start_tv.tv_usec) / 1e6;
+      flops = 2.0 * x * y * z;
+      printf("Clock time is %ld, CPU time is %ld, %s kernel %.3f GFLOP/s\n",
+	     wall_time, cpu_time, label, flops / elapsed / 1e9);
     }
     /* Run normally */
     else {
-      MatMul(A, B, C, x, y, z);
+      Mul(A, B, C, x, y, z);
     }
     if (debug) {
       printf ("-------------- orignal A matrix ------------------\n");
@@ -239,6 +749,9 @@ int main (int argc, char ** argv) {
       printf ("--------------  result C matrix ------------------\n");
       MatPrint(C,x,z);
     }
+    if (csvfile != NULL
+	&& dump_file(NULL, csvfile, DUMP_CSV, MATIO_F64, C, x, z) != 0)
+      exit(1);
   }
   return 0;
 }
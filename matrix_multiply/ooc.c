@@ -0,0 +1,340 @@
+/* Out-of-core matrix multiply
+ *
+ *   Michael Albert
+ *
+ *  C is cut into MB x NB blocks and the inner dimension into KB deep
+ *  slices.  Each step multiplies an MB x KB block of A by a KB x NB
+ *  block of B into the C block, taking the steps p fastest so a C
+ *  block is finished, and written, before the next one starts.
+ *
+ *  A read-ahead thread loads the blocks of step s+1 into the second
+ *  of two buffer slots while step s is multiplied out of the first,
+ *  so with blocks large enough for the multiply to outlast the reads
+ *  the disk stays out of the way.
+ *
+ *  Dimensions and file offsets are 64 bit; only the block sizes,
+ *  which the budget keeps small, are handed to the kernel as int.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "ooc.h"
+#include "matio.h"
+#include "kernel.h"
+#include "arena.h"
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+/* A multiply in progress, shared with the read-ahead thread */
+struct stream {
+  int afd, bfd, cfd;
+  struct matio_header ah, bh, ch;
+  int64_t m, n, k;
+  int MB, NB, KB;               /* block sizes */
+  int64_t ni, nj, np;           /* blocks along m, n and k */
+  double *abuf[2], *bbuf[2];
+  int64_t loaded[2];            /* step held by a slot, -1 when free */
+  int err, quit;
+  double read_time;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* Where step s sits: C block (ib, jb), slice pb */
+#define STEP_I(st,s)  ((s) / ((st)->nj * (st)->np))
+#define STEP_J(st,s)  ((s) / (st)->np % (st)->nj)
+#define STEP_P(st,s)  ((s) % (st)->np)
+
+static double seconds (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* pread or pwrite all of len bytes at off */
+static int io_all (int fd, char *buf, size_t len, off_t off, int writing)
+{
+  while (len > 0) {
+    ssize_t n = writing ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Move rows x cols elements at (row, col) of the file matrix to or
+ * from buf, packed with row length cols */
+static int io_rect (int fd, const struct matio_header *h, int64_t row,
+		    int64_t col, int rows, int cols, double *buf, int writing)
+{
+  off_t at = h->offset + (row * (int64_t) h->cols + col) * sizeof(double);
+
+  if ((uint64_t) cols == h->cols)
+    return io_all(fd, (char *) buf, sizeof(double) * rows * cols, at,
+		  writing);
+  for (int ix = 0; ix < rows; ix++) {
+    if (io_all(fd, (char *) &buf[(size_t) ix * cols],
+	       sizeof(double) * cols, at, writing) != 0)
+      return -1;
+    at += h->cols * sizeof(double);
+  }
+  return 0;
+}
+
+static void *read_ahead (void *arg)
+{
+  struct stream *st = (struct stream *) arg;
+  int64_t steps = st->ni * st->nj * st->np;
+
+  for (int64_t s = 0; s < steps; s++) {
+    int slot = s & 1;
+    pthread_mutex_lock(&st->lock);
+    while (st->loaded[slot] != -1 && !st->quit)
+      pthread_cond_wait(&st->cond, &st->lock);
+    int quit = st->quit;
+    pthread_mutex_unlock(&st->lock);
+    if (quit)
+      break;
+
+    int64_t i0 = STEP_I(st, s) * st->MB, j0 = STEP_J(st, s) * st->NB;
+    int64_t p0 = STEP_P(st, s) * st->KB;
+    int mb = min(st->MB, st->m - i0), nb = min(st->NB, st->n - j0);
+    int kb = min(st->KB, st->k - p0);
+    double t = seconds();
+    int err = io_rect(st->afd, &st->ah, i0, p0, mb, kb, st->abuf[slot], 0)
+      || io_rect(st->bfd, &st->bh, p0, j0, kb, nb, st->bbuf[slot], 0);
+    st->read_time += seconds() - t;
+
+    pthread_mutex_lock(&st->lock);
+    if (err)
+      st->err = 1;
+    else
+      st->loaded[slot] = s;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    if (err)
+      break;
+  }
+  return NULL;
+}
+
+/* One block product handed to the pool:
+ *  C (m by n) = A (m by k) times B (k by n), or with T given,
+ *  C += A times B going through T.  Tasks are strips of KERNEL_MC rows.
+ */
+struct product {
+  struct pool *pool;
+  const double *A, *B;
+  double *C, *T;
+  int m, n, k;
+};
+
+static void strip (struct product *p, int task)
+{
+  int r0 = task * KERNEL_MC, rows = min(KERNEL_MC, p->m - r0);
+  size_t at = (size_t) r0 * p->n;
+
+  if (p->T == NULL) {
+    kernel_dgemm(rows, p->n, p->k, &p->A[(size_t) r0 * p->k], p->k,
+		 p->B, p->n, &p->C[at], p->n);
+    return;
+  }
+  kernel_dgemm(rows, p->n, p->k, &p->A[(size_t) r0 * p->k], p->k,
+	       p->B, p->n, &p->T[at], p->n);
+  for (size_t ix = at; ix < at + (size_t) rows * p->n; ix++)
+    p->C[ix] += p->T[ix];
+}
+
+static void product_body (void *arg, int threadn, int threads)
+{
+  struct product *p = (struct product *) arg;
+  int task;
+
+  pool_queue(p->pool, threadn, (p->m + KERNEL_MC - 1) / KERNEL_MC);
+  pool_barrier(p->pool);
+  while ((task = pool_next_task(p->pool, threadn)) >= 0)
+    strip(p, task);
+}
+
+/* Bytes held for blocks of MB x NB x KB: two slots of A and B blocks,
+ * the C block, and a second C sized block to sum slices through */
+static size_t block_bytes (int64_t k, int64_t MB, int64_t NB, int64_t KB)
+{
+  return ARENA_BYTES(2, sizeof(double) * MB * KB)
+    + ARENA_BYTES(2, sizeof(double) * KB * NB)
+    + ARENA_BYTES(KB < k ? 2 : 1, sizeof(double) * MB * NB);
+}
+
+/* Shrink the blocks until they fit the budget and each is small
+ * enough for int indexing.  The inner dimension is cut last, since
+ * whole slices save summing C blocks. */
+static int block_sizes (struct stream *st, size_t budget)
+{
+  int64_t MB = st->m, NB = st->n, KB = st->k;
+
+  for (;;) {
+    int fits = block_bytes(st->k, MB, NB, KB) <= budget
+      && MB * KB < INT_MAX && KB * NB < INT_MAX && MB * NB < INT_MAX;
+    if (fits)
+      break;
+    if (MB > OOC_MIN_BLOCK && MB >= NB)
+      MB = (MB + 1) / 2;
+    else if (NB > OOC_MIN_BLOCK)
+      NB = (NB + 1) / 2;
+    else if (KB > OOC_MIN_BLOCK)
+      KB = (KB + 1) / 2;
+    else
+      return -1;
+  }
+  st->MB = MB;
+  st->NB = NB;
+  st->KB = KB;
+  st->ni = (st->m + MB - 1) / MB;
+  st->nj = (st->n + NB - 1) / NB;
+  st->np = (st->k + KB - 1) / KB;
+  return 0;
+}
+
+int ooc_dgemm (struct pool *pool, const char *afile, const char *bfile,
+	       const char *cfile, size_t budget, struct ooc_stats *stats)
+{
+  struct stream st;
+  struct arena ar;
+  pthread_t reader;
+  int ret = -1;
+  double start = seconds();
+
+  memset(&st, 0, sizeof(st));
+  st.afd = matio_open_fd(afile, &st.ah);
+  if (st.afd < 0)
+    return -1;
+  st.bfd = matio_open_fd(bfile, &st.bh);
+  if (st.bfd < 0)
+    goto close_a;
+  if (st.ah.dtype != MATIO_F64 || st.ah.layout != MATIO_ROW_MAJOR
+      || st.bh.dtype != MATIO_F64 || st.bh.layout != MATIO_ROW_MAJOR) {
+    fprintf (stderr, "Out-of-core multiply needs row-major double files\n");
+    goto close_b;
+  }
+  if (st.ah.cols != st.bh.rows) {
+    fprintf (stderr, "%s: %lu columns but %s has %lu rows\n", afile,
+	     (unsigned long) st.ah.cols, bfile, (unsigned long) st.bh.rows);
+    goto close_b;
+  }
+  st.m = st.ah.rows;
+  st.k = st.ah.cols;
+  st.n = st.bh.cols;
+  if (st.m == 0 || st.n == 0 || st.k == 0 || block_sizes(&st, budget)) {
+    fprintf (stderr, "Budget of %zu bytes is too small\n", budget);
+    goto close_b;
+  }
+  st.cfd = matio_create_fd(cfile, MATIO_F64, MATIO_ROW_MAJOR, st.m, st.n,
+			   &st.ch);
+  if (st.cfd < 0)
+    goto close_b;
+  if (arena_init(&ar, block_bytes(st.k, st.MB, st.NB, st.KB))) {
+    fprintf (stderr, "Can't allocate %d x %d x %d blocks\n", st.MB, st.NB,
+	     st.KB);
+    goto close_c;
+  }
+  for (int i = 0; i < 2; i++) {
+    st.abuf[i] = (double *) arena_alloc(&ar, sizeof(double) * st.MB * st.KB);
+    st.bbuf[i] = (double *) arena_alloc(&ar, sizeof(double) * st.KB * st.NB);
+    st.loaded[i] = -1;
+  }
+  double *C = (double *) arena_alloc(&ar, sizeof(double) * st.MB * st.NB);
+  double *T = st.np > 1 ? (double *) arena_alloc(&ar, sizeof(double)
+						   * st.MB * st.NB) : NULL;
+
+  pthread_mutex_init(&st.lock, NULL);
+  pthread_cond_init(&st.cond, NULL);
+  if (pthread_create(&reader, NULL, read_ahead, &st) != 0) {
+    fprintf (stderr, "Can't create the read-ahead thread\n");
+    goto free_arena;
+  }
+
+  int64_t steps = st.ni * st.nj * st.np, s;
+  double wait_time = 0, write_time = 0;
+  int err = 0;
+  for (s = 0; s < steps && !err; s++) {
+    int slot = s & 1;
+    double t = seconds();
+    pthread_mutex_lock(&st.lock);
+    while (st.loaded[slot] != s && !st.err)
+      pthread_cond_wait(&st.cond, &st.lock);
+    err = st.err;
+    pthread_mutex_unlock(&st.lock);
+    wait_time += seconds() - t;
+    if (err) {
+      fprintf (stderr, "Reading %s or %s failed\n", afile, bfile);
+      break;
+    }
+
+    int64_t i0 = STEP_I(&st, s) * st.MB, j0 = STEP_J(&st, s) * st.NB;
+    int64_t pb = STEP_P(&st, s);
+    struct product p = { pool, st.abuf[slot], st.bbuf[slot], C,
+			 pb > 0 ? T : NULL, min(st.MB, st.m - i0),
+			 min(st.NB, st.n - j0), min(st.KB, st.k - pb * st.KB) };
+    if (pool != NULL)
+      pool_run(pool, product_body, &p);
+    else
+      for (int task = 0; task * KERNEL_MC < p.m; task++)
+	strip(&p, task);
+
+    pthread_mutex_lock(&st.lock);
+    st.loaded[slot] = -1;
+    pthread_cond_broadcast(&st.cond);
+    pthread_mutex_unlock(&st.lock);
+
+    /* Last slice: the C block is done */
+    if (pb == st.np - 1) {
+      t = seconds();
+      if (io_rect(st.cfd, &st.ch, i0, j0, p.m, p.n, C, 1) != 0) {
+	fprintf (stderr, "%s: %s\n", cfile, strerror(errno));
+	err = 1;
+      }
+      write_time += seconds() - t;
+    }
+  }
+
+  pthread_mutex_lock(&st.lock);
+  st.quit = 1;
+  pthread_cond_broadcast(&st.cond);
+  pthread_mutex_unlock(&st.lock);
+  pthread_join(reader, NULL);
+  if (!err)
+    ret = 0;
+  if (stats != NULL) {
+    stats->time = seconds() - start;
+    stats->flops = 2.0 * st.m * st.n * st.k;
+    stats->blocks = s;
+    stats->read_time = st.read_time;
+    stats->wait_time = wait_time;
+    stats->write_time = write_time;
+  }
+
+ free_arena:
+  pthread_cond_destroy(&st.cond);
+  pthread_mutex_destroy(&st.lock);
+  arena_free(&ar);
+ close_c:
+  close(st.cfd);
+ close_b:
+  close(st.bfd);
+ close_a:
+  close(st.afd);
+  return ret;
+}
@@ -0,0 +1,39 @@
+/* Out-of-core matrix multiply
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef OOC_H
+#define OOC_H
+
+#include <stddef.h>
+#include "pool.h"
+
+/* Smallest block edge the budget may squeeze a block down to */
+#define OOC_MIN_BLOCK 256
+
+/* What a streaming multiply did, for reporting with -T */
+struct ooc_stats {
+  double time;        /* seconds for the whole multiply */
+  double flops;       /* 2 m n k */
+  long blocks;        /* block products computed */
+  double read_time;   /* seconds the read-ahead thread spent reading */
+  double wait_time;   /* seconds the multiply waited for a block */
+  double write_time;  /* seconds spent writing C */
+};
+
+/* Streaming multiply of matrix files (see matio.h):
+ *  C (m by n)  =  A (m by k) times B (k by n)
+ *  A and B must hold row-major doubles.  They are read a block at a
+ *  time, the next pair of blocks while the current one is multiplied,
+ *  and C is written a block at a time, so no more than about budget
+ *  bytes are held in memory whatever the sizes.  pool may be NULL to
+ *  multiply on the calling thread; st may be NULL.
+ *  Returns -1, with a message, on a bad file, an I/O error or a
+ *  budget too small for OOC_MIN_BLOCK sized blocks.
+ */
+int ooc_dgemm (struct pool *pool, const char *afile, const char *bfile,
+	       const char *cfile, size_t budget, struct ooc_stats *st);
+
+#endif
@@ -0,0 +1,224 @@
+/* Hardware performance counters
+ *
+ *   Michael Albert
+ *
+ *  Counting goes through perf_event_open(2) in user mode only, which
+ *  works at the default perf_event_paranoid setting.  The floating
+ *  point events are raw FP_ARITH_INST_RETIRED masks of Intel cores
+ *  since Broadwell, only opened on those: a raw config means
+ *  something else to other CPUs and would still count.  Packed
+ *  instructions of every width are counted together, so the vector
+ *  share shows how much of the arithmetic the micro-kernel managed
+ *  to vectorize, not how many flops it did.
+ *
+ *  When the group does not fit the PMU next to other users (the NMI
+ *  watchdog, a sibling thread) the kernel multiplexes it, so every
+ *  read carries the time the group was enabled and running.  Counts
+ *  are scaled up by their ratio, and a span the group never ran in
+ *  is left out as not counted rather than reported as zeros.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "perf.h"
+
+static const char *names[PERF_EVENTS] = {
+  "cycles", "instructions", "L1d misses", "LLC misses", "FP scalar",
+  "FP vector"
+};
+
+/* FP_ARITH_INST_RETIRED is event 0xc7: umask 0x03 are scalar double
+ * and single, 0xfc the 128, 256 and 512 bit packed forms */
+static const struct { unsigned type; unsigned long long config; }
+events[PERF_EVENTS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+    | PERF_COUNT_HW_CACHE_OP_READ << 8
+    | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { PERF_TYPE_RAW, 0x03c7 },
+  { PERF_TYPE_RAW, 0xfcc7 }
+};
+
+/* Whether the CPU is an Intel core with FP_ARITH_INST_RETIRED:
+ *  family 6, Broadwell and the big cores after it */
+static int fp_arith (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  static const unsigned char models[] = {
+    0x3d, 0x47, 0x4f, 0x56,             /* Broadwell */
+    0x4e, 0x5e, 0x55,                   /* Skylake, Cascade Lake */
+    0x8e, 0x9e, 0xa5, 0xa6, 0x66,       /* Kaby, Coffee, Comet, Cannon */
+    0x6a, 0x6c, 0x7d, 0x7e, 0xa7,       /* Ice Lake, Rocket Lake */
+    0x8c, 0x8d, 0x8f, 0xcf,             /* Tiger, Sapphire, Emerald */
+    0x97, 0x9a, 0xb7, 0xba, 0xbf        /* Alder Lake, Raptor Lake */
+  };
+  unsigned a, b, c, d, family, model;
+
+  if (!__get_cpuid(0, &a, &b, &c, &d)
+      || b != 0x756e6547 || d != 0x49656e69 || c != 0x6c65746e)
+    return 0;                           /* not "GenuineIntel" */
+  __get_cpuid(1, &a, &b, &c, &d);
+  family = (a >> 8) & 0xf;
+  model = ((a >> 4) & 0xf) | ((a >> 12) & 0xf0);
+  if (family != 6)
+    return 0;
+  for (size_t i = 0; i < sizeof(models); i++)
+    if (models[i] == model)
+      return 1;
+#endif
+  return 0;
+}
+
+const char *perf_event_name (int e)
+{
+  return names[e];
+}
+
+struct perf_thread *perf_create (int threads)
+{
+  struct perf_thread *t;
+
+  t = (struct perf_thread *) calloc(threads, sizeof(struct perf_thread));
+  for (int i = 0; t != NULL && i < threads; i++)
+    for (int e = 0; e < PERF_EVENTS; e++)
+      t[i].fd[e] = -1;
+  return t;
+}
+
+/* Open the group on the calling thread, led by the first event that
+ * opens; returns -1 if none do */
+static int perf_open (struct perf_thread *t)
+{
+  int leader = -1, fp = fp_arith();
+
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    struct perf_event_attr attr;
+    if (events[e].type == PERF_TYPE_RAW && !fp) {
+      t->fd[e] = -1;
+      t->count[e] = -1;
+      continue;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[e].type;
+    attr.config = events[e].config;
+    attr.disabled = leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    t->fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (t->fd[e] >= 0 && leader < 0)
+      leader = t->fd[e];
+    t->count[e] = t->fd[e] >= 0 ? 0 : -1;
+  }
+  if (leader < 0)
+    return -1;
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return 0;
+}
+
+/* Current value of every open event, in the order they joined, and
+ * in time[] how long the group has been enabled and running */
+static int perf_read (struct perf_thread *t, long long *v, long long *time)
+{
+  unsigned long long buf[PERF_EVENTS + 3];
+  int leader = -1, n = 0;
+
+  for (int e = 0; e < PERF_EVENTS && leader < 0; e++)
+    leader = t->fd[e];
+  if (read(leader, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(buf[0])))
+    return -1;
+  time[0] = buf[1];
+  time[1] = buf[2];
+  for (int e = 0; e < PERF_EVENTS; e++)
+    if (t->fd[e] >= 0)
+      v[e] = n < (int) buf[0] ? (long long) buf[3 + n++] : 0;
+  return 0;
+}
+
+void perf_start (struct perf_thread *t)
+{
+  if (t->opened == 0)
+    t->opened = perf_open(t) == 0 ? 1 : -1;
+  if (t->opened > 0 && perf_read(t, t->base, t->base_time) != 0)
+    t->opened = -1;
+}
+
+void perf_stop (struct perf_thread *t)
+{
+  long long now[PERF_EVENTS], time[2];
+
+  if (t->opened <= 0 || perf_read(t, now, time) != 0)
+    return;
+  long long enabled = time[0] - t->base_time[0];
+  long long running = time[1] - t->base_time[1];
+  t->spans++;
+  if (running <= 0 && enabled > 0)
+    t->uncounted++;
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (t->fd[e] < 0)
+      continue;
+    if (running <= 0 && enabled > 0) {
+      t->last[e] = -1;   /* the group never got on the PMU */
+      continue;
+    }
+    t->last[e] = now[e] - t->base[e];
+    if (running < enabled)
+      t->last[e] = (long long) ((double) t->last[e] * enabled / running);
+    t->count[e] += t->last[e];
+  }
+}
+
+void perf_sum (struct perf_thread *t, int threads, int last, long long *sum)
+{
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    sum[e] = -1;
+    for (int i = 0; i < threads; i++) {
+      long long c = last ? t[i].last[e] : t[i].count[e];
+      if (t[i].opened > 0 && t[i].fd[e] >= 0 && c >= 0)
+        sum[e] = (sum[e] < 0 ? 0 : sum[e]) + c;
+    }
+  }
+}
+
+void perf_print (const char *label, const long long *c)
+{
+  const char *sep = "";
+
+  printf ("%s:", label);
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (c[e] >= 0) {
+      printf ("%s %s %lld", sep, names[e], c[e]);
+      sep = ",";
+    }
+  }
+  if (c[PERF_CYCLES] > 0 && c[PERF_INSTRUCTIONS] >= 0)
+    printf (", IPC %.2f", (double) c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+  if (c[PERF_FP_SCALAR] >= 0 && c[PERF_FP_VECTOR] >= 0
+      && c[PERF_FP_SCALAR] + c[PERF_FP_VECTOR] > 0)
+    printf (", vector %.1f%%", 100.0 * c[PERF_FP_VECTOR]
+            / (c[PERF_FP_SCALAR] + c[PERF_FP_VECTOR]));
+  if (*sep == '\0')
+    printf (" no counters");
+  printf ("\n");
+}
+
+void perf_destroy (struct perf_thread *t, int threads)
+{
+  for (int i = 0; i < threads; i++)
+    for (int e = 0; e < PERF_EVENTS; e++)
+      if (t[i].fd[e] >= 0)
+        close(t[i].fd[e]);
+  free(t);
+}
@@ -0,0 +1,55 @@
+/* Hardware performance counters
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+/* Events counted, in the order of the count arrays */
+#define PERF_CYCLES       0
+#define PERF_INSTRUCTIONS 1
+#define PERF_L1D_MISSES   2  /* L1 data cache read misses */
+#define PERF_LLC_MISSES   3  /* last level cache misses */
+#define PERF_FP_SCALAR    4  /* scalar FP arithmetic instructions */
+#define PERF_FP_VECTOR    5  /* packed FP arithmetic instructions */
+#define PERF_EVENTS       6
+
+/* Counters of one thread.  The events are opened as one group on the
+ * thread that first calls perf_start, so they are scheduled together
+ * and read with a single system call.  count[] sums the spans between
+ * perf_start and perf_stop, last[] holds the most recent span.  An
+ * event the kernel or CPU can't count has count -1.  A span the group
+ * only ran part of is scaled up to the whole of it; one it never ran
+ * in has last[] -1, is left out of count[] and counted in uncounted.
+ */
+struct perf_thread {
+  int fd[PERF_EVENTS];
+  int opened;          /* 0 before the first perf_start, -1 if it failed */
+  long long base[PERF_EVENTS], base_time[2];  /* enabled, running */
+  long long count[PERF_EVENTS], last[PERF_EVENTS];
+  long spans, uncounted;
+};
+
+/* Name of event e, for reports */
+const char *perf_event_name (int e);
+
+/* Counters for threads threads, all unopened, or NULL */
+struct perf_thread *perf_create (int threads);
+
+/* Start and end a span on the calling thread, which must be the same
+ * thread for every span of t */
+void perf_start (struct perf_thread *t);
+void perf_stop (struct perf_thread *t);
+
+/* Sum of last[] or count[] over threads threads into sum */
+void perf_sum (struct perf_thread *t, int threads, int last, long long *sum);
+
+/* Print one line of counts, with IPC and the share of vector FP */
+void perf_print (const char *label, const long long *count);
+
+/* Close every thread's counters and free them */
+void perf_destroy (struct perf_thread *t, int threads);
+
+#endif
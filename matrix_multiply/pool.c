@@ -0,0 +1,201 @@
+/* Persistent worker pool
+ *
+ *   Michael Albert
+ *
+ *  Workers are created once and sleep on a condition variable.
+ *  pool_run publishes a job by bumping a generation counter, runs
+ *  its own share as worker 0, then waits for the others to check in.
+ *
+ *  Task deques hold a contiguous range of task numbers, packed as
+ *  head and tail into one 64 bit word.  Nothing is pushed while a job
+ *  runs, so owner pops and thief steals are both a single
+ *  compare-and-swap on that word.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pool.h"
+
+/* One worker's tasks, on its own cache line */
+struct deque {
+  _Atomic uint64_t range;  /* head in the low 32 bits, tail in the high */
+  long tasks, stolen;
+} __attribute__((aligned(64)));
+
+#define RANGE(head,tail)  (((uint64_t)(tail) << 32) | (uint32_t)(head))
+#define HEAD(range)       ((int)(uint32_t)(range))
+#define TAIL(range)       ((int)((range) >> 32))
+
+struct pool {
+  int threads;
+  pthread_t *ids;
+  pthread_mutex_t lock;
+  pthread_cond_t start;      /* signalled when a job is published */
+  pthread_cond_t done;       /* signalled when the last worker ends */
+  pthread_barrier_t barrier;
+  unsigned long generation;  /* bumped for every job */
+  int running;               /* workers still on the current job */
+  int quit;
+  pool_fn fn;
+  void *arg;
+  struct deque *deques;
+};
+
+/* Arguments for a worker thread */
+struct worker {
+  struct pool *pool;
+  int threadn;
+};
+
+static void *worker_body (void *arg)
+{
+  struct worker *w = (struct worker *) arg;
+  struct pool *pool = w->pool;
+  int threadn = w->threadn;
+  unsigned long seen = 0;
+
+  free(w);
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen && !pool->quit)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->quit) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    seen = pool->generation;
+    pool_fn fn = pool->fn;
+    void *arg = pool->arg;
+    pthread_mutex_unlock(&pool->lock);
+
+    fn(arg, threadn, pool->threads);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0)
+      pthread_cond_signal(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return NULL;
+}
+
+struct pool *pool_create (int threads)
+{
+  struct pool *pool = (struct pool *) calloc(1, sizeof(struct pool));
+
+  pool->threads = threads;
+  pool->ids = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pthread_barrier_init(&pool->barrier, NULL, threads);
+  pool->deques = (struct deque *) aligned_alloc(64, sizeof(struct deque)
+						* threads);
+  for (int i = 0; i < threads; i++) {
+    atomic_init(&pool->deques[i].range, RANGE(0, 0));
+    pool->deques[i].tasks = pool->deques[i].stolen = 0;
+  }
+  for (int i = 1; i < threads; i++) {
+    struct worker *w = (struct worker *) malloc(sizeof(struct worker));
+    w->pool = pool;
+    w->threadn = i;
+    int err = pthread_create(&pool->ids[i], NULL, worker_body, (void *) w);
+    if (err) {
+      fprintf (stderr, "Can't create thread %d\n", i);
+      exit (1);
+    }
+  }
+  return pool;
+}
+
+void pool_run (struct pool *pool, pool_fn fn, void *arg)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->running = pool->threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  fn(arg, 0, pool->threads);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_barrier (struct pool *pool)
+{
+  pthread_barrier_wait(&pool->barrier);
+}
+
+void pool_queue (struct pool *pool, int threadn, int ntasks)
+{
+  int head = (int)((long)ntasks * threadn / pool->threads);
+  int tail = (int)((long)ntasks * (threadn + 1) / pool->threads);
+
+  atomic_store(&pool->deques[threadn].range, RANGE(head, tail));
+}
+
+int pool_next_task (struct pool *pool, int threadn)
+{
+  struct deque *own = &pool->deques[threadn];
+  uint64_t range = atomic_load(&own->range);
+
+  /* Front of our own deque */
+  while (HEAD(range) < TAIL(range)) {
+    if (atomic_compare_exchange_weak(&own->range, &range,
+				     RANGE(HEAD(range) + 1, TAIL(range)))) {
+      own->tasks++;
+      return HEAD(range);
+    }
+  }
+
+  /* Back of someone else's */
+  for (int i = 1; i < pool->threads; i++) {
+    struct deque *victim = &pool->deques[(threadn + i) % pool->threads];
+    range = atomic_load(&victim->range);
+    while (HEAD(range) < TAIL(range)) {
+      if (atomic_compare_exchange_weak(&victim->range, &range,
+				       RANGE(HEAD(range), TAIL(range) - 1))) {
+	own->tasks++;
+	own->stolen++;
+	return TAIL(range) - 1;
+      }
+    }
+  }
+  return -1;
+}
+
+void pool_task_counts (struct pool *pool, int threadn, long *tasks,
+		       long *stolen)
+{
+  *tasks = pool->deques[threadn].tasks;
+  *stolen = pool->deques[threadn].stolen;
+}
+
+int pool_threads (struct pool *pool)
+{
+  return pool->threads;
+}
+
+void pool_destroy (struct pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 1; i < pool->threads; i++)
+    pthread_join(pool->ids[i], NULL);
+  pthread_barrier_destroy(&pool->barrier);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->deques);
+  free(pool->ids);
+  free(pool);
+}
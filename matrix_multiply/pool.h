@@ -0,0 +1,52 @@
+/* Persistent worker pool
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+/* Work handed to the pool: called once on every thread with that
+ * thread's number (0 .. threads-1) and the pool size.
+ */
+typedef void (*pool_fn) (void *arg, int threadn, int threads);
+
+struct pool;
+
+/* Start a pool of threads workers.  The calling thread counts as
+ * worker 0, so threads-1 new threads are created.
+ */
+struct pool *pool_create (int threads);
+
+/* Run fn on every worker and return once they have all finished.
+ *  Only one thread may drive a pool at a time.
+ */
+void pool_run (struct pool *pool, pool_fn fn, void *arg);
+
+/* Barrier across all workers, for use inside a pool_fn */
+void pool_barrier (struct pool *pool);
+
+/* Work stealing:
+ *  Every worker owns a deque of task numbers.  pool_queue fills the
+ *  calling worker's deque with its even share of tasks 0 .. ntasks-1;
+ *  pool_next_task takes from the front of the worker's own deque and,
+ *  once that is empty, steals from the back of another's.  It returns
+ *  -1 when no work is left anywhere.  Workers must pass a
+ *  pool_barrier between queueing and taking tasks.
+ */
+void pool_queue (struct pool *pool, int threadn, int ntasks);
+int pool_next_task (struct pool *pool, int threadn);
+
+/* Tasks a worker has run since the pool started, and how many of
+ * them it stole from others */
+void pool_task_counts (struct pool *pool, int threadn, long *tasks,
+		       long *stolen);
+
+/* Number of workers, including the caller */
+int pool_threads (struct pool *pool);
+
+/* Stop and join the workers */
+void pool_destroy (struct pool *pool);
+
+#endif
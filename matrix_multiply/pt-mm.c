@@ -9,234 +9,1390 @@
 #include <math.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "kernel.h"
+#include "pool.h"
+#include "strassen.h"
+#include "topology.h"
+#include "matio.h"
+#include "ooc.h"
+#include "batch.h"
+#include "sparse.h"
+#include "bench.h"
+#include "perf.h"
+#include "tune.h"
+#include "rng.h"
+#include "dump.h"
+#include "arena.h"
+#include "serve.h"
+#include "blas.h"
+#include "summa.h"
 
 /* idx macro calculates the correct 2-d based 1-d index
  * of a location (x,y) in an array that has col columns.
- * This is calculated in row major order.
+ * This is calculated in row major order, in size_t so it does
+ * not overflow for matrices past 2^31 elements.
  */
 
-#define idx(x,y,col)  ((x)*(col) + (y))
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
 
-/* Struct for storing thread info */
+/* Struct for a multiply handed to the pool.  Dimensions are 64 bit
+ * throughout, and lda, ldb and ldc are the row lengths of the arrays
+ * holding A, B and C, so any of them can be a view into a larger
+ * matrix. */
 struct info {
-  double *A, *B, *C;
-  int x, y, z, threads, threadn, times;
+  struct pool *pool;
+  int dtype;        /* element type, MATIO_F64 etc. from matio.h */
+  void *A, *B, *C;
+  double *Ap, *Bp;  /* packed panels, NULL when not packing */
+  long x, y, z;
+  long lda, ldb, ldc;
 };
-pthread_barrier_t barrier;
-
-  /* Calculation of subset of matrix elements */
-  void matrix_calc (double *A, double *B, double *C, int x, int y, int z, int threads,
-    int threadn) {
-    /* Determine what elements to calculate */
-    int elements = x*z;
-    int perthread = elements/threads;
-    int remainder = elements%threads;
-    if (perthread == 0) {
-      perthread = 1;
-      remainder = 0;
-    }
-    int start, finish, ixstart, ixfinish;
-    start = finish = ixstart = ixfinish = 0;
-    int jxstart[z];
-    int jxfinish[z];
-    if (threadn < remainder) {
-      start = (threadn * perthread) + threadn;
-      finish = start + perthread;
-    }
-    else if (threadn < elements) {
-      start = (threadn * perthread) + remainder;
-      finish = start + perthread - 1;
-    }
-    else {
-      return;
+int packing = 0;        /* set by -p */
+int strassen = 0;       /* set by -k strassen */
+int sparse = -1;        /* -k sparse 1, -k blocked 0, else by density */
+int cutoff = STRASSEN_CUTOFF;
+int interleave = 0;     /* set by -I */
+int dtype = MATIO_F64;  /* set by -t */
+double pack_time = 0;   /* seconds spent packing, all multiplies */
+int format = -1;        /* -o benchmark output, BENCH_CSV or BENCH_JSON */
+int warmup = 0;         /* set by -w */
+int reps = 1;           /* set by -R */
+uint64_t seed = 0;      /* set by -S, else from the clock with -r */
+struct kernel_epilogue *epilogue = NULL;  /* set by -F */
+int gemm_order = -1;    /* -G, BLAS_ROW_MAJOR or BLAS_COL_MAJOR */
+int transa = BLAS_NO_TRANS, transb = BLAS_NO_TRANS;  /* set by -G */
+struct perf_thread *perf = NULL;  /* per thread counters, set by -P */
+int perf_muls = 0;      /* multiplies counted so far */
+
+/* Seconds on the monotonic clock */
+double now (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes of a rows by cols matrix of size byte elements.  The sizes
+ * come from the command line, so a product that does not fit in a
+ * size_t ends the program instead of wrapping. */
+size_t MatBytes (long rows, long cols, size_t size)
+{
+  size_t bytes;
+
+  if (rows < 0 || cols < 0
+      || __builtin_mul_overflow((size_t) rows, (size_t) cols, &bytes)
+      || __builtin_mul_overflow(bytes, size, &bytes)) {
+    fprintf (stderr, "A %ld by %ld matrix is too big\n", rows, cols);
+    exit(1);
+  }
+  return bytes;
+}
+
+/* A rows by cols matrix of size byte elements from topo_alloc */
+void *MatAlloc (long rows, long cols, size_t size)
+{
+  size_t bytes = MatBytes(rows, cols, size);
+  void *p = topo_alloc(bytes, interleave);
+
+  if (p == NULL && bytes != 0) {
+    fprintf (stderr, "Out of memory for a %ld by %ld matrix\n", rows, cols);
+    exit(1);
+  }
+  return p;
+}
+
+/* Bytes of a packing buffer for n rows or cols rounded up to panels
+ * of w, each k deep */
+size_t pack_bytes (long n, int w, long k)
+{
+  return sizeof(double) * (size_t)((n + w - 1) / w) * w * k;
+}
+
+/* Temporaries:
+ *  Packing buffers, power temporaries and Strassen's sums all come
+ *  out of one arena that lasts as long as the program, backed by
+ *  huge pages.  The outermost call reserves what it needs and
+ *  releases it when done, so repeated multiplies, powers, batches
+ *  and daemon jobs reuse the same memory and only go back to the
+ *  system for a bigger size than before.
+ */
+int backing = ARENA_THP;  /* set by -H */
+struct arena temps;
+
+/* Temporaries for an x by y times y by z multiply, or with power
+ * set an x by x power */
+size_t TempBytes (struct pool *pool, long x, long y, long z, int power)
+{
+  size_t bytes = 0;
+  if (strassen && x == y && y == z && x > cutoff)
+    bytes += strassen_bytes(pool, x, cutoff);
+  if (packing)
+    bytes += ARENA_BYTES(1, pack_bytes(x, kernel_mr(), y))
+             + ARENA_BYTES(1, pack_bytes(z, kernel_nr(), y));
+  if (power > 1)
+    bytes += ARENA_BYTES(3, MatBytes(x, x, sizeof(double)));
+  return bytes;
+}
+
+/* Make sure bytes of temporaries are free, returning the mark to
+ * release them back to */
+size_t TempMark (size_t bytes)
+{
+  if (arena_reserve(&temps, bytes, backing) != 0) {
+    fprintf (stderr, "Out of memory for %lu bytes of temporaries\n",
+             (unsigned long) bytes);
+    exit(1);
+  }
+  return arena_mark(&temps);
+}
+
+void TempRelease (size_t mark)
+{
+  arena_release(&temps, mark);
+}
+
+/* Packing buffer of pack_bytes, 64 byte aligned, from the reserve */
+double *pack_alloc (long n, int w, long k)
+{
+  return (double *) arena_alloc(&temps, pack_bytes(n, w, k));
+}
+
+/* Output tiles:
+ *  C is cut into tm x tn tiles, tm a multiple of MR and tn of NR of
+ *  the micro-kernel for the element type, so tiles line up with the
+ *  packed panels and never leave ragged edges to the scalar code.  They start at MC x tile_n,
+ *  so the rows of A a tile needs stay in L2 and its columns of B in
+ *  L3, and shrink until every thread gets a few of them.
+ */
+#define TILE_N 512
+#define TILES_PER_THREAD 4
+
+int tile_n = TILE_N;    /* set by the tuning file */
+
+struct tiles {
+  int tm, tn;      /* tile size */
+  int rows, cols;  /* tiles down and across C */
+};
+
+void tile_grid (struct tiles *t, int dtype, long x, long z, int threads) {
+  int f64 = dtype == MATIO_F64, mc, kc, nc;
+  int mr = f64 ? kernel_mr() : kernel_smr();
+  int nr = f64 ? kernel_nr() : kernel_snr();
+  kernel_blocks(&mc, &kc, &nc);
+  t->tm = mc > mr ? mc / mr * mr : mr;
+  t->tn = tile_n > nr ? tile_n / nr * nr : nr;
+  for (;;) {
+    t->rows = (x + t->tm - 1) / t->tm;
+    t->cols = (z + t->tn - 1) / t->tn;
+    if ((long)t->rows * t->cols >= TILES_PER_THREAD * threads)
+      break;
+    if (t->tn > nr && t->tn >= t->tm)
+      t->tn = t->tn / 2 > nr ? t->tn / 2 / nr * nr : nr;
+    else if (t->tm > mr)
+      t->tm = t->tm / 2 > mr ? t->tm / 2 / mr * mr : mr;
+    else
+      break;
+  }
+}
+
+/* Calculate tile n of C, with the kernel for the element type */
+void tile_calc (struct tiles *t, int n, struct info *m) {
+  long i0 = (long)(n / t->cols) * t->tm;
+  long j0 = (long)(n % t->cols) * t->tn;
+  long i1 = i0 + t->tm < m->x ? i0 + t->tm : m->x;
+  long j1 = j0 + t->tn < m->z ? j0 + t->tn : m->z;
+  long y = m->y, lda = m->lda, ldb = m->ldb, ldc = m->ldc;
+  size_t a = idx(i0,0,lda), c = idx(i0,j0,ldc);
+  switch (m->dtype) {
+  case MATIO_F64:
+    if (m->Ap != NULL) {
+      kernel_dgemm_packed(i0, i1, j0, j1, y, m->Ap, m->Bp, (double *)m->C,
+                          ldc, epilogue);
+    } else if (epilogue != NULL) {
+      struct kernel_epilogue ep = *epilogue;
+      if (ep.bias != NULL)
+        ep.bias += j0;
+      kernel_dgemm_ep(i1 - i0, j1 - j0, y, (double *)m->A + a, lda,
+                      (double *)m->B + j0, ldb, (double *)m->C + c, ldc, &ep);
+    } else {
+      kernel_dgemm(i1 - i0, j1 - j0, y, (double *)m->A + a, lda,
+                   (double *)m->B + j0, ldb, (double *)m->C + c, ldc);
     }
-    ixstart = start/z;
-    ixfinish = finish/z + 1;
-    jxstart[ixstart] = start%z;
-    jxfinish[ixstart] = finish%z + 1;
-    if (ixstart +1 < ixfinish) {
-      jxfinish[ixstart] = z;
-      for (int i = ixstart + 1; i < ixfinish; i++) {
-        jxstart[i] = 0;
-        jxfinish[i] = z;
-      }
-      jxfinish[ixfinish-1] = finish%z + 1;
-    }
-
-    /* Calculate the elements */
-    int ix, jx, kx;
-    for (ix = ixstart; ix < ixfinish; ix++) {
-      // Rows of solution
-      for (jx = jxstart[ix]; jx < jxfinish[ix]; jx++) {
-        // Columns of solution
-        float tval = 0;
-        for (kx = 0; kx < y; kx++) {
-          // Sum the A row time B column
-          tval += A[idx(ix,kx,y)] * B[idx(kx,jx,z)];
-        }
-        C[idx(ix,jx,z)] = tval;
-      }
+    break;
+  case MATIO_F32:
+    kernel_sgemm(i1 - i0, j1 - j0, y, (float *)m->A + a, lda,
+                 (float *)m->B + j0, ldb, (float *)m->C + c, ldc);
+    break;
+  case MATIO_I32:
+    kernel_igemm(i1 - i0, j1 - j0, y, (int32_t *)m->A + a, lda,
+                 (int32_t *)m->B + j0, ldb, (int32_t *)m->C + c, ldc);
+    break;
+  case MATIO_I8:
+    kernel_i8gemm(i1 - i0, j1 - j0, y, (int8_t *)m->A + a, lda,
+                  (int8_t *)m->B + j0, ldb, (int32_t *)m->C + c, ldc);
+    break;
+  }
+}
+
+  /* Calculation of subset of matrix elements
+   *  Each thread queues a contiguous run of tiles in row order, so
+   *  neighbouring tiles share their rows of A, then works through
+   *  its queue and steals tiles from slower threads once it is empty.
+   *  When Ap and Bp are given, the threads also pack their share of
+   *  A and B into them before the barrier, and every thread then
+   *  multiplies out of the shared packed copies.
+   */
+  void matrix_calc (struct info *m, int threads, int threadn) {
+    struct tiles t;
+    tile_grid(&t, m->dtype, m->x, m->z, threads);
+    pool_queue(m->pool, threadn, t.rows * t.cols);
+
+    double start = now();
+    if (m->Ap != NULL) {
+      long apanels = (m->x + kernel_mr() - 1) / kernel_mr();
+      long bpanels = (m->z + kernel_nr() - 1) / kernel_nr();
+      kernel_dpack_a(m->x, m->y, (double *)m->A, m->lda, 0, m->Ap,
+                     apanels * threadn / threads,
+                     apanels * (threadn + 1) / threads);
+      kernel_dpack_b(m->y, m->z, (double *)m->B, m->ldb, 0, m->Bp,
+                     bpanels * threadn / threads,
+                     bpanels * (threadn + 1) / threads);
     }
+    pool_barrier(m->pool);
+    if (m->Ap != NULL && threadn == 0)
+      pack_time += now() - start;
+
+    /* Calculate the tiles */
+    int n;
+    while ((n = pool_next_task(m->pool, threadn)) >= 0)
+      tile_calc(&t, n, m);
     return;
   }
 
 /* Matrix Multiply:
  *  C (x by z)  =  A ( x by y ) times B (y by z)
- *  This is the slow n^3 algorithm
+ *  Runs on the workers of pool, which can be reused for any
+ *  number of multiplies back to back.  With -k strassen, square
+ *  multiplies bigger than the cutoff go through Strassen-Winograd
+ *  with its seven top level products spread over the pool.
  *  A and B are not be modified
  */
 
- /* Thread body for mat_mul */
- void* mul_body (void *arg) {
+ /* Pool body for mat_mul */
+ void mul_body (void *arg, int threadn, int threads) {
    /* Extract info */
    struct info* argcp = (struct info*) arg;
-   double *A = argcp->A;
-   double *B = argcp->B;
-   double *C = argcp->C;
-   int x = argcp->x;
-   int y = argcp->y;
-   int z = argcp->z;
-   int threads = argcp->threads;
-   int threadn = argcp->threadn;
-   matrix_calc(A, B, C, x, y, z, threads, threadn);
-   pthread_exit((void *) NULL);
+   if (perf != NULL)
+     perf_start(&perf[threadn]);
+   matrix_calc(argcp, threads, threadn);
+   if (perf != NULL)
+     perf_stop(&perf[threadn]);
  }
 
-void MatMul (double *A, double *B, double *C, int x, int y, int z, int threads) {
-  pthread_t ids[threads];
-  struct info threadinfo[threads];
-  /* Create threads */
-  for (int i = 0; i < threads; i++) {
-    /* Declare and set info */
-    threadinfo[i].A = A;
-    threadinfo[i].B = B;
-    threadinfo[i].C = C;
-    threadinfo[i].x = x;
-    threadinfo[i].y = y;
-    threadinfo[i].z = z;
-    threadinfo[i].threads = threads;
-    threadinfo[i].threadn = i;
-    int err = pthread_create (&ids[i], NULL, mul_body, (void *)&threadinfo[i]);
-    if (err) {
-      fprintf (stderr, "Can't create thread %d\n", i);
-      exit (1);
-    }
-  }
-  // wait for all threads by joining them
-  for (int i = 0; i < threads; i++) {
-    pthread_join(ids[i], NULL);
+/* Multiply of any element type: A and B hold dtype and C holds its
+ * result type (int32 for int8).  Only doubles are packed.  A, B and
+ * C are views with row lengths lda, ldb and ldc, so a block of a
+ * bigger matrix is multiplied in place without being copied out. */
+void MatMulView (struct pool *pool, int dtype, void *A, long lda, void *B,
+                 long ldb, void *C, long ldc, long x, long y, long z) {
+  size_t mark = TempMark(TempBytes(pool, x, y, z, 0));
+  if (strassen && dtype == MATIO_F64 && x == y && y == z && x > cutoff
+      && epilogue == NULL
+      && strassen_dgemm_arena(&temps, pool, x, A, lda, B, ldb, C, ldc,
+                              cutoff) == 0) {
+    TempRelease(mark);
+    return;
+  }
+  struct info job = { pool, dtype, A, B, C, NULL, NULL, x, y, z,
+                      lda, ldb, ldc };
+  if (packing && dtype == MATIO_F64) {
+    job.Ap = pack_alloc(x, kernel_mr(), y);
+    job.Bp = pack_alloc(z, kernel_nr(), y);
+  }
+  pool_run(pool, mul_body, (void *)&job);
+  TempRelease(mark);
+  if (perf != NULL) {
+    long long sum[PERF_EVENTS];
+    char label[32];
+    snprintf(label, sizeof(label), "Multiply %d", ++perf_muls);
+    perf_sum(perf, pool_threads(pool), 1, sum);
+    perf_print(label, sum);
   }
   return;
 }
 
+/* MatMulView of densely stored matrices */
+void MatMulType (struct pool *pool, int dtype, void *A, void *B, void *C,
+                 long x, long y, long z) {
+  MatMulView(pool, dtype, A, y, B, z, C, z, x, y, z);
+}
+
+void MatMul (struct pool *pool, double *A, double *B, double *C, long x,
+             long y, long z) {
+  MatMulType(pool, MATIO_F64, A, B, C, x, y, z);
+}
+
+/* BLAS style multiply:
+ *  With -G the inputs are stored in the order and transposed as it
+ *  says and the multiply goes through blas_dgemm, with alpha and beta
+ *  from -F.  GemmShape gives the rows and cols of the array holding
+ *  an operand that is rows by cols once op() is applied, read as
+ *  row major, and its row length is the cols it gives.
+ */
+void GemmShape (int trans, long rows, long cols, long *r, long *c)
+{
+  int flip = (trans == BLAS_TRANS) != (gemm_order == BLAS_COL_MAJOR);
+  *r = flip ? cols : rows;
+  *c = flip ? rows : cols;
+}
+
+void MatMulBlas (struct pool *pool, double *A, double *B, double *C, long x,
+                 long y, long z) {
+  long r, lda, ldb, ldc;
+  GemmShape(transa, x, y, &r, &lda);
+  GemmShape(transb, y, z, &r, &ldb);
+  GemmShape(BLAS_NO_TRANS, x, z, &r, &ldc);
+  size_t mark = TempMark(blas_bytes(gemm_order, x, z, y));
+  if (blas_dgemm_arena(&temps, pool, gemm_order, transa, transb, x, z, y,
+                       epilogue != NULL ? epilogue->alpha : 1, A, lda, B,
+                       ldb, epilogue != NULL ? epilogue->beta : 0, C,
+                       ldc) != 0) {
+    fprintf (stderr, "blas_dgemm failed\n");
+    exit(1);
+  }
+  TempRelease(mark);
+}
+
+/* -G list: comma separated row or col, ta and tb.  Returns -1 on an
+ * error. */
+int GemmNamed (char *spec)
+{
+  gemm_order = BLAS_ROW_MAJOR;
+  for (char *item = strtok(spec, ","); item != NULL;
+       item = strtok(NULL, ",")) {
+    if (strcmp(item, "row") == 0)
+      gemm_order = BLAS_ROW_MAJOR;
+    else if (strcmp(item, "col") == 0)
+      gemm_order = BLAS_COL_MAJOR;
+    else if (strcmp(item, "ta") == 0)
+      transa = BLAS_TRANS;
+    else if (strcmp(item, "tb") == 0)
+      transb = BLAS_TRANS;
+    else
+      return -1;
+  }
+  return 0;
+}
+
+/* Sparse multiply:
+ *  At load time the density of A and B is estimated from a sample,
+ *  and if A is sparse enough it is turned into CSR once, along with B
+ *  when the product should stay sparse as well.  The multiply then
+ *  goes through sparse.c instead of the tiles.
+ */
+struct sparseplan {
+  int mode;             /* SPARSE_OFF, SPARSE_A or SPARSE_AB */
+  double da, db;        /* estimated densities */
+  struct csr A, B;
+};
+
+void SparsePlan (struct sparseplan *sp, double *A, double *B, long x, long y,
+                 long z) {
+  sp->mode = SPARSE_OFF;
+  /* CSR column indices and the sparse tasks are int */
+  if (sparse == 0 || dtype != MATIO_F64 || epilogue != NULL || gemm_order >= 0
+      || x > INT_MAX || y > INT_MAX || z > INT_MAX)
+    return;
+  sp->da = sparse_density(A, x, y, y, SPARSE_SAMPLES);
+  sp->db = sparse_density(B, y, z, z, SPARSE_SAMPLES);
+  sp->mode = sparse_choice(sp->da, sp->db, y);
+  if (sparse == 1 && sp->mode == SPARSE_OFF)
+    sp->mode = SPARSE_A;
+  if (sp->mode != SPARSE_OFF && csr_from_dense(&sp->A, A, x, y, y) != 0)
+    sp->mode = SPARSE_OFF;
+  if (sp->mode == SPARSE_AB && csr_from_dense(&sp->B, B, y, z, z) != 0)
+    sp->mode = SPARSE_A;
+}
+
+/* C = A times B by whichever way SparsePlan chose */
+void MatMulPlan (struct pool *pool, struct sparseplan *sp, void *A, void *B,
+                 void *C, long x, long y, long z) {
+  if (gemm_order >= 0) {
+    MatMulBlas(pool, (double *)A, (double *)B, (double *)C, x, y, z);
+    return;
+  }
+  if (sp->mode == SPARSE_AB) {
+    struct csr P;
+    if (sparse_spgemm(pool, &sp->A, &sp->B, &P) == 0) {
+      csr_to_dense(&P, (double *)C, z);
+      csr_free(&P);
+      return;
+    }
+  }
+  if (sp->mode != SPARSE_OFF)
+    sparse_dgemm(pool, &sp->A, (double *)B, z, z, (double *)C, z);
+  else
+    MatMulType(pool, dtype, A, B, C, x, y, z);
+}
+
+/* Buffers a power computation writes into: P itself and up to
+ * three temporaries, allocated on first use.  A buffer is free when
+ * it holds neither the current square nor the partial product.
+ */
+struct powbufs {
+  double *P, *T[3];
+  long x;
+};
+
+double *PowGrab (struct powbufs *pb, double *sq, double *r, int avoidP) {
+  if (!avoidP && pb->P != sq && pb->P != r)
+    return pb->P;
+  for (int i = 0; i < 3; i++) {
+    if (pb->T[i] == NULL)
+      pb->T[i] = (double *)arena_alloc(&temps, sizeof(double) * pb->x * pb->x);
+    if (pb->T[i] != sq && pb->T[i] != r)
+      return pb->T[i];
+  }
+  return NULL;  /* three are always enough */
+}
+
+/* Number of multiplies MatPower needs for A ^ n */
+int PowerMuls (int n) {
+  int muls = 0;
+  for (; n > 1; n >>= 1)
+    muls += 1 + (n & 1);
+  return muls;
+}
+
+/* Matrix Power:
+ *  P = A ^ n, for n >= 1
+ *
+ *  Squares A repeatedly and multiplies in the squares for the set
+ *  bits of n, so it takes floor(log2 n) + popcount(n) - 1 multiplies,
+ *  each spread over the whole pool.  Products are written straight
+ *  into whichever buffer is free and only pointers move; the last
+ *  product lands in P, so nothing is copied unless n is 1 or the
+ *  result is a square the caller keeps.
+ *
+ *  squares may be NULL, or hold a buffer for each i = 1 .. log2(n)
+ *  (entry 0 is unused).  A non-NULL entry receives A ^ (2^i) and is
+ *  left intact for the caller.
+ *
+ *    A are not be modified.
+ */
+
+void MatPower (struct pool *pool, double *A, double *P, long x, int n,
+               double **squares) {
+  struct powbufs pb = { P, { NULL, NULL, NULL }, x };
+  double *sq = A;     /* A ^ (2^i) */
+  double *r = NULL;   /* product of the squares for the bits so far */
+  int k = 0, bits = 0, b = -1;
+
+  if (n == 1) {
+    memcpy(P, A, sizeof(double) * x * x);
+    return;
+  }
+  size_t mark = TempMark(TempBytes(pool, x, x, x, n));
+
+  /* k is the top bit of n and b the next set bit below it */
+  for (int i = 0; (n >> i) != 0; i++) {
+    if (n >> i & 1) {
+      bits++;
+      b = k;
+      k = i;
+    }
+  }
+  if (bits == 1)
+    b = -1;
+
+  /* The sources of the last multiply must not sit in P: S_(k-1)
+   * when n is a power of two, otherwise S_k and the partial product
+   * from bit b (a bare square when n has only two bits set). */
+  for (int i = 0; i <= k; i++) {
+    if (n >> i & 1) {
+      if (r == NULL) {
+        r = sq;
+      } else {
+        double *dst = (i == k) ? P : PowGrab(&pb, sq, r, i == b);
+        MatMul(pool, r, sq, dst, x, x, x);
+        r = dst;
+      }
+    }
+    if (i < k) {
+      int s = i + 1;
+      double *dst;
+      if (squares != NULL && squares[s] != NULL)
+        dst = squares[s];
+      else if (bits == 1 && s == k)
+        dst = P;
+      else
+        dst = PowGrab(&pb, sq, r, bits == 1 ? s == k - 1
+                      : (s == k || (bits == 2 && s == b)));
+      MatMul(pool, sq, sq, dst, x, x, x);
+      sq = dst;
+    }
+  }
+  if (r != P)
+    memcpy(P, r, sizeof(double) * x * x);
+  TempRelease(mark);
+}
+
 /* Matrix Square:
- *  B = A ^ 2*times
+ *  B = A ^ (2^times), squaring A times times
  *
  *    A are not be modified.
  */
 
- /* Thread body for mat_mul */
- void* square_body (void *arg) {
-   /* Extract info */
-   struct info* argcp = (struct info*) arg;
-   double *A = argcp->A;
-   double *B = argcp->B;
-   double *C = argcp->C;
-   int x = argcp->x;
-   int threads = argcp->threads;
-   int threadn = argcp->threadn;
-   int times = argcp->times;
-   matrix_calc(A, A, B, x, x, x, threads, threadn);
-
-
-   if (times > 1) {
-     for (int i = 1; i < times; i+= 2) {
-       pthread_barrier_wait(&barrier);
-       matrix_calc(B, B, C, x, x, x, threads, threadn);
-       pthread_barrier_wait(&barrier);
-       if (i == times - 1) {
-         memcpy(B, C, sizeof(double)*x*x);
-       }
-       else {
-         matrix_calc(C, C, B, x, x, x, threads, threadn);
-       }
-     }
-   }
-
-
-   pthread_exit((void *) NULL);
- }
+void MatSquare (struct pool *pool, double *A, double *B, long x, int times) {
+  MatPower(pool, A, B, x, 1 << times, NULL);
+}
 
-void MatSquare (double *A, double *B, int x, int times, int threads) {
-  pthread_t ids[threads];
-  struct info threadinfo[threads];
-  double *C = (double *)malloc(sizeof(double) * x * x);
-  /* Init barrier */
-  pthread_barrier_init(&barrier, NULL, threads);
-  /* Create threads */
-  for (int i = 0; i < threads; i++) {
-    /* Declare and set info */
-    threadinfo[i].A = A;
-    threadinfo[i].B = B;
-    threadinfo[i].C = C;
-    threadinfo[i].x = x;
-    threadinfo[i].threads = threads;
-    threadinfo[i].threadn = i;
-    threadinfo[i].times = times;
-    int err = pthread_create (&ids[i], NULL, square_body, (void *)&threadinfo[i]);
-    if (err) {
-      fprintf (stderr, "Can't create thread %d\n", i);
-      exit (1);
-    }
-  }
-  /* Wait for all threads by joining them */
-  for (int i = 0; i < threads; i++) {
-    pthread_join(ids[i], NULL);
-  }
-  free(C);
-  pthread_barrier_destroy(&barrier); //Destroy barrier
-  return;
+/* Print a matrix of any element type:
+ *  Rows are formatted in parallel on the pool and written to stdout
+ *  in a few large writes.
+ */
+void MatPrintType (struct pool *pool, void *A, int dtype, long x, long y)
+{
+  if (dump_matrix(pool, 1, DUMP_TEXT, dtype, A, x, y) != 0) {
+    perror("stdout");
+    exit(1);
+  }
+}
+
+void MatPrint (struct pool *pool, double *A, long x, long y)
+{
+  MatPrintType(pool, A, MATIO_F64, x, y);
+}
+
+/* Copy of A (x by y) converted to dtype for -t.  Integer types take
+ * the nearest integer to scale times each element, and int8
+ * saturates at its range. */
+void *MatCast (double *A, long x, long y, int dtype, double scale)
+{
+  size_t n = (size_t)x * y, i;
+  void *T = MatAlloc(x, y, matio_dtype_size(dtype));
+
+  for (i = 0; i < n; i++) {
+    double v = A[i] * scale;
+    v = v < 0 ? v - 0.5 : v + 0.5;  /* rounds as the cast truncates */
+    switch (dtype) {
+    case MATIO_F64: ((double *)T)[i] = A[i]; break;
+    case MATIO_F32: ((float *)T)[i] = A[i]; break;
+    case MATIO_I32:
+      ((int32_t *)T)[i] = v < INT32_MIN ? INT32_MIN
+                          : v > INT32_MAX ? INT32_MAX : v;
+      break;
+    case MATIO_I8:
+      ((int8_t *)T)[i] = v < INT8_MIN ? INT8_MIN : v > INT8_MAX ? INT8_MAX : v;
+      break;
+    }
+  }
+  return T;
+}
+
+/* Element type of a product of dtype matrices */
+int ResultType (int dtype)
+{
+  return dtype == MATIO_I8 ? MATIO_I32 : dtype;
+}
+
+/* -H names for the page backings */
+int BackingNamed (const char *name)
+{
+  const char *names[] = { "small", "thp", "hugetlb" };
+  for (int i = ARENA_SMALL; i <= ARENA_HUGETLB; i++)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+/* -t names for the element types */
+int TypeNamed (const char *name)
+{
+  const char *names[] = { NULL, "f64", "f32", "i32", "i8" };
+  for (int i = MATIO_F64; i <= MATIO_I8; i++)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+
+/* Generate data for a matrix:
+ *  The workers each write their own share of rows, so with
+ *  first-touch placement those pages land on the worker's node.
+ *  Random data is element i * y + j of the matrix's stream, so it
+ *  only depends on the seed and not on the number of threads.  The
+ *  streams are the same in mm.c.
+ */
+#define GEN_A 0
+#define GEN_B 1
+#define GEN_KEEP 2      /* added to the stream of a matrix MatSparsify thins */
+#define GEN_C 4         /* starting C for an epilogue with beta */
+#define GEN_BIAS 5      /* bias row of an epilogue */
+#define GEN_CHUNK 256   /* elements MatSparsify draws at a time */
+
+struct gen {
+  double *A;
+  long x, y;
+  int rand;
+  uint32_t stream;
+  double keep;
+  long i0, j0, cols;  /* where A sits in a matrix of cols columns */
+};
+
+void gen_body (void *arg, int threadn, int threads)
+{
+  struct gen *g = (struct gen *) arg;
+  long ix, iy;
+  long first = g->x * threadn / threads;
+  long last = g->x * (threadn + 1) / threads;
+
+  for (ix = first; ix < last; ix++) {
+    double *row = &g->A[idx(ix,0,g->y)];
+    long i = g->i0 + ix;
+    if (g->rand) {
+      rng_uniform(seed, g->stream, (uint64_t)i * g->cols + g->j0, g->y, row);
+      for (iy = 0; iy < g->y; iy++)
+        row[iy] *= 0.1;
+    } else {
+      for (iy = 0; iy < g->y; iy++)
+        row[iy] = 1.0 + (((double)i)/100.0)
+                  + (((double)(g->j0 + iy)/1000.0));
+    }
+  }
+}
+
+/* The x by y block at row i0, column j0 of a matrix with cols
+ * columns, exactly as MatGen makes that part of the whole */
+void MatGenBlock (struct pool *pool, double *A, long x, long y, long i0,
+                  long j0, long cols, int rand, uint32_t stream)
+{
+  struct gen g = { A, x, y, rand, stream, 1, i0, j0, cols };
+
+  pool_run(pool, gen_body, (void *)&g);
+}
+
+void MatGen (struct pool *pool, double *A, long x, long y, int rand,
+             uint32_t stream)
+{
+  MatGenBlock(pool, A, x, y, 0, 0, y, rand, stream);
+}
+
+void sparsify_body (void *arg, int threadn, int threads)
+{
+  struct gen *g = (struct gen *) arg;
+  double u[GEN_CHUNK];
+  long first = g->x * threadn / threads;
+  long last = g->x * (threadn + 1) / threads;
+
+  for (long ix = first; ix < last; ix++) {
+    for (long iy = 0; iy < g->y; iy += GEN_CHUNK) {
+      int n = g->y - iy < GEN_CHUNK ? g->y - iy : GEN_CHUNK;
+      rng_uniform(seed, g->stream, (uint64_t)ix * g->y + iy, n, u);
+      for (int i = 0; i < n; i++)
+        if (u[i] >= g->keep)
+          g->A[idx(ix,iy + i,g->y)] = 0;
+    }
+  }
+}
+
+/* Zero all but about a fraction keep of the elements of A, which was
+ * generated from stream */
+void MatSparsify (struct pool *pool, double *A, long x, long y, double keep,
+                  uint32_t stream)
+{
+  struct gen g = { A, x, y, 1, stream + GEN_KEEP, keep };
+
+  pool_run(pool, sparsify_body, (void *)&g);
+}
+
+/* Memory placement report:
+ *  Each worker streams over the rows of A, B and C it first touched
+ *  and the read bandwidth is summed per node, next to a count of
+ *  where the pages of each matrix actually are.
+ */
+struct memprobe {
+  double *M[3];
+  long rows[3], cols[3];
+  double *rate;   /* bytes per second, per thread */
+};
+
+void probe_body (void *arg, int threadn, int threads)
+{
+  struct memprobe *m = (struct memprobe *) arg;
+  double sum = 0, bytes = 0;
+  int pass, i;
+  long ix, iy;
+
+  double start = now();
+  for (pass = 0; pass < 3; pass++) {
+    for (i = 0; i < 3; i++) {
+      long first = m->rows[i] * threadn / threads;
+      long last = m->rows[i] * (threadn + 1) / threads;
+      for (ix = first; ix < last; ix++)
+        for (iy = 0; iy < m->cols[i]; iy++)
+          sum += m->M[i][idx(ix,iy,m->cols[i])];
+      bytes += sizeof(double) * (double)(last - first) * m->cols[i];
+    }
+  }
+  double secs = now() - start;
+  /* sum == sum keeps the reads from being optimised away */
+  m->rate[threadn] = (secs > 0 && sum == sum) ? bytes / secs : 0;
+}
+
+void MemReport (struct pool *pool, double *A, double *B, double *C,
+                long x, long y, long z)
+{
+  int threads = pool_threads(pool), nodes = topo_nodes();
+  double rate[threads];
+  struct memprobe m = { { A, B, C }, { x, y, x }, { y, z, z }, rate };
+  long pages[3][nodes];
+  size_t bytes[3] = { sizeof(double) * x * y, sizeof(double) * y * z,
+                      sizeof(double) * x * z };
+
+  pool_run(pool, probe_body, (void *)&m);
+  for (int i = 0; i < 3; i++)
+    if (topo_pages(m.M[i], bytes[i], pages[i]) != 0)
+      memset(pages[i], -1, sizeof(long) * nodes);
+  for (int n = 0; n < nodes; n++) {
+    double bw = 0;
+    int count = 0;
+    for (int t = 0; t < threads; t++) {
+      if (topo_thread_node(t) == n) {
+        bw += rate[t];
+        count++;
+      }
+    }
+    printf ("Node %d: %d threads, %.2f GB/s, pages A %ld B %ld C %ld\n",
+            n, count, bw / 1e9, pages[0][n], pages[1][n], pages[2][n]);
+  }
+}
+
+/* Pin each worker to a CPU, filling one node before the next */
+void pin_body (void *arg, int threadn, int threads)
+{
+  topo_pin(threadn);
+}
+
+/* Matrix from a file given with -A or -B, as row-major doubles.
+ *  The mapping is used in place when it already holds them. */
+double *MatLoad (const char *path, long *rows, long *cols)
+{
+  struct matfile mf;
+  int copied;
+
+  if (matio_open(path, &mf) != 0)
+    exit(1);
+  if (mf.h.rows == 0 || mf.h.cols == 0 || mf.h.rows > LONG_MAX
+      || mf.h.cols > LONG_MAX) {
+    fprintf (stderr, "%s: can't multiply a %lu by %lu matrix\n", path,
+             (unsigned long) mf.h.rows, (unsigned long) mf.h.cols);
+    exit(1);
+  }
+  *rows = mf.h.rows;
+  *cols = mf.h.cols;
+  double *A = matio_f64(&mf, &copied);
+  if (A == NULL) {
+    fprintf (stderr, "%s: out of memory converting to double\n", path);
+    exit(1);
+  }
+  if (copied)
+    matio_close(&mf);
+  return A;
+}
+
+/* Result matrix mapped from the -C file, computed in place */
+void *MatOutput (const char *path, int dtype, long rows, long cols)
+{
+  struct matfile mf;
+
+  MatBytes(rows, cols, matio_dtype_size(dtype));
+  if (matio_create(path, dtype, MATIO_ROW_MAJOR, rows, cols, &mf) != 0)
+    exit(1);
+  return mf.data;
+}
+
+/* Size from a file must agree with any given on the command line */
+void SizeCheck (const char *path, long *size, long file)
+{
+  if (*size != 0 && *size != file) {
+    fprintf (stderr, "%s: size %ld does not match %ld\n", path, file, *size);
+    exit(1);
+  }
+  *size = file;
+}
+
+/* -F list: comma separated alpha=a, beta=b, bias, relu and
+ * clamp=lo:hi.  Returns 1 if a bias row is wanted, -1 on an error. */
+int EpilogueNamed (char *spec, struct kernel_epilogue *ep)
+{
+  int bias = 0;
+  char *end;
+
+  ep->alpha = 1;
+  ep->beta = 0;
+  ep->bias = NULL;
+  ep->act = KERNEL_ACT_NONE;
+  for (char *item = strtok(spec, ","); item != NULL;
+       item = strtok(NULL, ",")) {
+    if (strncmp(item, "alpha=", 6) == 0) {
+      ep->alpha = strtod(item + 6, &end);
+    } else if (strncmp(item, "beta=", 5) == 0) {
+      ep->beta = strtod(item + 5, &end);
+    } else if (strncmp(item, "clamp=", 6) == 0) {
+      ep->act = KERNEL_ACT_CLAMP;
+      ep->lo = strtod(item + 6, &end);
+      if (*end != ':')
+        return -1;
+      ep->hi = strtod(end + 1, &end);
+    } else if (strcmp(item, "relu") == 0) {
+      ep->act = KERNEL_ACT_RELU;
+      end = item + 4;
+    } else if (strcmp(item, "bias") == 0) {
+      bias = 1;
+      end = item + 4;
+    } else {
+      return -1;
+    }
+    if (*end != '\0')
+      return -1;
+  }
+  return bias;
+}
+
+/* Print how many tiles each thread ran */
+void TilePrint (struct pool *pool)
+{
+  long tasks, stolen;
+
+  for (int i = 0; i < pool_threads(pool); i++) {
+    pool_task_counts(pool, i, &tasks, &stolen);
+    printf ("Thread %d: %ld tiles, %ld stolen\n", i, tasks, stolen);
+  }
+}
+
+/* Counters of every thread over all the multiplies, then the total */
+void PerfReport (struct pool *pool)
+{
+  long long sum[PERF_EVENTS];
+  char label[64];
+
+  for (int i = 0; i < pool_threads(pool); i++) {
+    perf_sum(&perf[i], 1, 0, sum);
+    if (perf[i].uncounted > 0)
+      snprintf(label, sizeof(label), "Thread %d (%ld of %ld spans not counted)",
+               i, perf[i].uncounted, perf[i].spans);
+    else
+      snprintf(label, sizeof(label), "Thread %d", i);
+    perf_print(label, sum);
+  }
+  perf_sum(perf, pool_threads(pool), 0, sum);
+  perf_print("All threads", sum);
+}
+
+/* Benchmark run:
+ *  One repetition is whatever the -T timer would have covered: iters
+ *  powers, multiplies or batches.  -w runs are thrown away before -R
+ *  are timed one by one and reported with bench_print.
+ */
+struct run {
+  struct pool *pool;
+  struct sparseplan *plan;  /* NULL for a power or a batch */
+  void *A, *B, *C;
+  long x, y, z;
+  int power, batch, iters;
+};
+
+void RunOnce (void *arg)
+{
+  struct run *r = (struct run *) arg;
+  long x = r->x, y = r->y, z = r->z;
+
+  for (int i = 0; i < r->iters; i++) {
+    if (r->batch)
+      batch_dgemm_strided(r->pool, x, z, y, r->A, y, x * y, r->B, z,
+                          y * z, r->C, z, x * z, r->batch);
+    else if (r->power)
+      MatPower(r->pool, r->A, r->C, x, r->power, NULL);
+    else if (r->plan != NULL)
+      MatMulPlan(r->pool, r->plan, r->A, r->B, r->C, x, y, z);
+    else
+      MatMul(r->pool, r->A, r->B, r->C, x, y, z);
+  }
+}
+
+/* Name of the path RunOnce takes through the multiply */
+const char *KernelName (struct run *r)
+{
+  if (r->batch)
+    return "batch";
+  if (r->plan != NULL && gemm_order >= 0)
+    return "gemm";
+  if (r->plan != NULL && r->plan->mode != SPARSE_OFF)
+    return r->plan->mode == SPARSE_AB ? "spgemm" : "sparse";
+  if (strassen && dtype == MATIO_F64 && r->x == r->y && r->y == r->z
+      && r->x > cutoff && epilogue == NULL)
+    return "strassen";
+  return packing && dtype == MATIO_F64 ? "packed" : "blocked";
+}
+
+void Bench (struct run *r)
+{
+  const char *names[] = { NULL, "f64", "f32", "i32", "i8" };
+  struct bench_stats st;
+  double muls = (double) r->iters * (r->power ? PowerMuls(r->power) : 1)
+                * (r->batch ? r->batch : 1);
+  double x = r->x, y = r->y, z = r->z;
+  struct bench_case c = {
+    "pt-mm", KernelName(r), kernel_isa(), names[dtype],
+    pool_threads(r->pool), r->x, r->z, r->y, r->power,
+    2 * x * y * z * muls,
+    (matio_dtype_size(dtype) * (x * y + y * z)
+     + matio_dtype_size(ResultType(dtype)) * x * z) * muls
+  };
+
+  if (bench_run(RunOnce, r, warmup, reps, &st) != 0) {
+    fprintf (stderr, "Can't run %d repetitions\n", reps);
+    exit(1);
+  }
+  bench_print(stdout, format, &c, warmup, &st);
+}
+
+/* Autotuning:
+ *  Coordinate descent: the micro-kernel, then each cache block, the
+ *  tile width and the thread count are swept in turn while the rest
+ *  keep the best values found so far.  A setting scores the sum over
+ *  the tuning shapes of the median of TUNE_REPS multiplies, each
+ *  divided by the first time seen for that shape so they weigh the
+ *  same.  The square shape sets the pace; the other two are the thin
+ *  inner dimension and few rows that the tiling finds hardest.
+ */
+#define TUNE_SIZE 1024
+#define TUNE_REPS 5
+#define TUNE_SHAPES 3
+
+double TuneScore (struct tune *t, double *A, double *B, double *C, int n,
+                  double *base)
+{
+  int shapes[TUNE_SHAPES][3] = { { n, n, n }, { n, n / 8, n },
+                                 { n / 8, n, n } };
+  struct pool *pool = pool_create(t->threads);
+  double score = 0;
+
+  kernel_select(t->isa);
+  kernel_blocking(t->mc, t->kc, t->nc);
+  tile_n = t->tile_n;
+  for (int s = 0; s < TUNE_SHAPES; s++) {
+    struct run r = { pool, NULL, A, B, C, shapes[s][0], shapes[s][1],
+                     shapes[s][2], 0, 0, 1 };
+    struct bench_stats st;
+    if (bench_run(RunOnce, &r, 1, TUNE_REPS, &st) != 0)
+      exit(1);
+    if (base[s] == 0)
+      base[s] = st.median;
+    score += st.median / base[s];
+  }
+  pool_destroy(pool);
+  printf ("isa %s, mc %d, kc %d, nc %d, tile_n %d, threads %d: %.3f\n",
+          t->isa, t->mc, t->kc, t->nc, t->tile_n, t->threads, score);
+  return score;
 }
 
-/* Print a matrix: */
-void MatPrint (double *A, int x, int y)
+/* Try each of the count values for *field, keeping the best */
+void TuneSweep (struct tune *t, int *field, const int *values, int count,
+                double *A, double *B, double *C, int n, double *base,
+                double *best)
 {
-  int ix, iy;
+  int keep = *field;
 
-  for (ix = 0; ix < x; ix++) {
-    printf ("Row %d: ", ix);
-    for (iy = 0; iy < y; iy++)
-      printf (" %10.5G", A[idx(ix,iy,y)]);
-    printf ("\n");
+  for (int i = 0; i < count; i++) {
+    if (values[i] == keep)
+      continue;
+    *field = values[i];
+    double score = TuneScore(t, A, B, C, n, base);
+    if (score < *best) {
+      *best = score;
+      keep = values[i];
+    }
+  }
+  *field = keep;
+}
+
+/* Tune for n by n multiplies on up to maxthreads threads and save
+ * the result to path */
+int Autotune (int n, int maxthreads, const char *path)
+{
+  const char *isas[] = { "avx512", "avx2", "scalar" };
+  int kcs[] = { 128, 192, 256, 384, 512 };
+  int mcs[] = { 4, 6, 8, 12, 16 };  /* times MR */
+  int ncs[] = { 512, 1024, 2048, 4096, 8192 };
+  int tiles[] = { 128, 256, 512, 1024, 2048 };
+  struct tune t = { "", KERNEL_MC, KERNEL_KC, KERNEL_NC, TILE_N, maxthreads };
+  double base[TUNE_SHAPES] = { 0 }, best;
+  size_t bytes = MatBytes(n, n, sizeof(double));
+  double *A = (double *) topo_alloc(bytes, 0);
+  double *B = (double *) topo_alloc(bytes, 0);
+  double *C = (double *) topo_alloc(bytes, 0);
+
+  if (A == NULL || B == NULL || C == NULL) {
+    fprintf (stderr, "Can't allocate %d by %d matrices to tune with\n", n, n);
+    return 1;
+  }
+  struct pool *pool = pool_create(maxthreads);
+  MatGen(pool, A, n, n, 1, GEN_A);
+  MatGen(pool, B, n, n, 1, GEN_B);
+  pool_destroy(pool);
+
+  snprintf(t.isa, sizeof(t.isa), "%s", kernel_isa());
+  best = TuneScore(&t, A, B, C, n, base);
+  for (int i = 0; i < 3; i++) {
+    char was[sizeof(t.isa)];
+    memcpy(was, t.isa, sizeof(was));
+    if (strcmp(isas[i], was) == 0 || kernel_select(isas[i]) != 0)
+      continue;
+    snprintf(t.isa, sizeof(t.isa), "%s", isas[i]);
+    double score = TuneScore(&t, A, B, C, n, base);
+    if (score < best)
+      best = score;
+    else
+      memcpy(t.isa, was, sizeof(was));
+  }
+  kernel_select(t.isa);
+  for (int i = 0; i < 5; i++)
+    mcs[i] *= kernel_mr();
+  TuneSweep(&t, &t.kc, kcs, 5, A, B, C, n, base, &best);
+  TuneSweep(&t, &t.mc, mcs, 5, A, B, C, n, base, &best);
+  TuneSweep(&t, &t.nc, ncs, 5, A, B, C, n, base, &best);
+  TuneSweep(&t, &t.tile_n, tiles, 5, A, B, C, n, base, &best);
+  for (int threads = 1; threads < maxthreads; threads++)
+    TuneSweep(&t, &t.threads, &threads, 1, A, B, C, n, base, &best);
+  topo_free(A, bytes);
+  topo_free(B, bytes);
+  topo_free(C, bytes);
+  if (tune_save(path, &t) != 0)
+    return 1;
+  printf ("Saved isa %s, mc %d, kc %d, nc %d, tile_n %d, threads %d to %s\n",
+          t.isa, t.mc, t.kc, t.nc, t.tile_n, t.threads, path);
+  return 0;
+}
+
+/* Batch of count independent x by y times y by z multiplies, stored
+ * back to back, run iters times through batch_dgemm_strided */
+void BatchRun (struct pool *pool, int count, int x, int y, int z, int iters,
+               int useRand, int timer, int debug)
+{
+  long sa = (long)x * y, sb = (long)y * z, sc = (long)x * z;
+  double *A = (double *) MatAlloc(count, sa, sizeof(double));
+  double *B = (double *) MatAlloc(count, sb, sizeof(double));
+  double *C = (double *) MatAlloc(count, sc, sizeof(double));
+
+  MatGen(pool, A, x * count, y, useRand, GEN_A);
+  MatGen(pool, B, y * count, z, useRand, GEN_B);
+  if (format >= 0) {
+    struct run r = { pool, NULL, A, B, C, x, y, z, 0, count, iters };
+    Bench(&r);
+  } else {
+    clock_t start_time = clock();
+    double start = now();
+    for (int i = 0; i < iters; i++)
+      batch_dgemm_strided(pool, x, z, y, A, y, sa, B, z, sb, C, z, sc, count);
+    double secs = now() - start;
+    if (timer) {
+      printf("Clock time is %ld, CPU time is %ld, batch of %d at %.3f GFLOP/s\n",
+             (long) secs, (long)(clock() - start_time), count,
+             2.0 * x * y * z * count * iters / secs / 1e9);
+      TilePrint(pool);
+    }
+  }
+  if (debug) {
+    printf ("--------------  first result C matrix ------------------\n");
+    MatPrint(pool,C,x,z);
+  }
+}
+
+/* Daemon:
+ *  One pool, started once, computes every job, and the temporaries of
+ *  the largest job so far stay reserved for the next.  -x reserves
+ *  them up front for x by x jobs.
+ */
+struct daemon {
+  struct pool *pool;
+  long jobs;
+  int timer;
+};
+
+int ServeJob (void *arg, const struct serve_job *job, double *A, double *B,
+              double *C)
+{
+  struct daemon *d = (struct daemon *) arg;
+  int power = job->op == SERVE_POWER ? job->power : 0;
+
+  if (arena_reserve(&temps, TempBytes(d->pool, job->x, job->y, job->z,
+                                      power), backing) != 0)
+    return ENOMEM;
+  double start = now();
+  if (power)
+    MatPower(d->pool, A, C, job->x, power, NULL);
+  else
+    MatMul(d->pool, A, B, C, job->x, job->y, job->z);
+  d->jobs++;
+  if (d->timer) {
+    double flops = 2.0 * job->x * job->y * job->z
+                   * (power ? PowerMuls(power) : 1);
+    printf("Job %ld: %ld by %ld by %ld%s, %.3f GFLOP/s\n", d->jobs,
+           (long) job->x, (long) job->y, (long) job->z, power ? " power" : "",
+           flops / (now() - start) / 1e9);
+    fflush(stdout);
+  }
+  return 0;
+}
+
+int Serve (const char *path, int threads, int pin, long x, int timer)
+{
+  struct daemon d = { NULL, 0, timer };
+
+  kernel_isa();
+  d.pool = pool_create(threads);
+  if (pin)
+    pool_run(d.pool, pin_body, NULL);
+  if (x > 0)
+    TempMark(TempBytes(d.pool, x, x, x, 2));
+  int ret = serve_run(path, SERVE_DEPTH, ServeJob, &d);
+  pool_destroy(d.pool);
+  return ret == 0 ? 0 : 1;
+}
+
+/* Client:
+ *  The multiply or power the options describe, computed by the
+ *  daemon at path.  The inputs are read or generated straight into
+ *  the shared region and the result is used from it in place.
+ */
+int Submit (const char *path, double *fileA, double *fileB, long x, long y,
+            long z, int power, int rand, int timer, int debug,
+            const char *cfile, const char *csvfile)
+{
+  struct serve_job job = { SERVE_MAGIC, power ? SERVE_POWER : SERVE_MUL,
+                           power, x, power ? x : y, power ? x : z };
+  struct serve_reply reply;
+  size_t off[3];
+  int fd;
+  char *base = (char *) serve_alloc(&job, &fd);
+
+  if (base == NULL)
+    return 1;
+  size_t size = serve_layout(&job, off);
+  double *A = (double *) (base + off[0]);
+  double *B = (double *) (base + off[1]);
+  double *C = (double *) (base + off[2]);
+  y = job.y;
+  z = job.z;
+
+  /* a pool of one: the calling thread, nothing to start */
+  struct pool *pool = pool_create(1);
+  if (fileA != NULL)
+    memcpy(A, fileA, sizeof(double) * x * y);
+  else
+    MatGen(pool, A, x, y, rand, GEN_A);
+  if (power == 0 && fileB != NULL)
+    memcpy(B, fileB, sizeof(double) * y * z);
+  else if (power == 0)
+    MatGen(pool, B, y, z, rand, GEN_B);
+
+  double start = now();
+  if (serve_submit(path, &job, fd, &reply) != 0)
+    return 1;
+  if (reply.status != 0) {
+    fprintf (stderr, "%s: %s\n", path, strerror(reply.status));
+    return 1;
+  }
+  if (timer) {
+    double flops = 2.0 * x * y * z * (power ? PowerMuls(power) : 1);
+    printf("Round trip %.6f, queued %.6f, loading %.6f, computing %.6f, "
+           "%.3f GFLOP/s\n", now() - start, reply.wait, reply.load,
+           reply.compute, flops / reply.compute / 1e9);
+  }
+  if (debug) {
+    printf ("-------------- orignal A matrix ------------------\n");
+    MatPrint(pool,A,x,y);
+    if (power == 0) {
+      printf ("-------------- orignal B matrix ------------------\n");
+      MatPrint(pool,B,y,z);
+    }
+    printf ("--------------  result C matrix ------------------\n");
+    MatPrint(pool,C,x,z);
   }
+  if ((cfile != NULL && matio_save(cfile, C, x, z) != 0)
+      || (csvfile != NULL
+          && dump_file(pool, csvfile, DUMP_CSV, MATIO_F64, C, x, z) != 0))
+    return 1;
+  pool_destroy(pool);
+  munmap(base, size);
+  close(fd);
+  return 0;
 }
 
+/* Distributed multiply, as rank of procs in a SUMMA grid:
+ *  Each process generates only its own blocks of A and B, from their
+ *  place in the whole matrices, so the grid multiplies exactly what
+ *  a single process would.  Rank 0 reports the time and collects C
+ *  for -d, -C and -X, so every rank must be given the same options;
+ *  with -T every rank reports its own share.
+ */
+int Distributed (int rank, int procs, const char *hosts, long x, long y,
+                 long z, int threads, int pin, int iters, int rand,
+                 int timer, int debug, const char *cfile,
+                 const char *csvfile)
+{
+  struct summa s;
+  struct summa_stats st, total;
+  long i0, i1, j0, j1, ka0, ka1, kb0, kb1;
+
+  if (summa_init(&s, rank, procs, hosts) != 0) {
+    fprintf (stderr, "Rank %d of %d could not join the grid\n", rank, procs);
+    return 1;
+  }
+  kernel_isa();
+  struct pool *pool = pool_create(threads);
+  if (pin)
+    pool_run(pool, pin_body, NULL);
+
+  summa_part(x, s.rows, s.prow, &i0, &i1);
+  summa_part(z, s.cols, s.pcol, &j0, &j1);
+  summa_part(y, s.cols, s.pcol, &ka0, &ka1);
+  summa_part(y, s.rows, s.prow, &kb0, &kb1);
+  double *A = (double *) MatAlloc(i1 - i0, ka1 - ka0, sizeof(double));
+  double *B = (double *) MatAlloc(kb1 - kb0, j1 - j0, sizeof(double));
+  double *C = (double *) MatAlloc(i1 - i0, j1 - j0, sizeof(double));
+  MatGenBlock(pool, A, i1 - i0, ka1 - ka0, i0, ka0, y, rand, GEN_A);
+  MatGenBlock(pool, B, kb1 - kb0, j1 - j0, kb0, j0, z, rand, GEN_B);
+  size_t mark = TempMark(summa_bytes(&s, x, z, y));
+
+  memset(&total, 0, sizeof(total));
+  if (summa_barrier(&s) != 0)
+    return 1;
+  double start = now();
+  for (int i = 0; i < iters; i++) {
+    if (summa_dgemm(&s, pool, &temps, x, z, y, A, ka1 - ka0, B, j1 - j0, C,
+                    j1 - j0, &st) != 0) {
+      fprintf (stderr, "Rank %d: distributed multiply failed\n", rank);
+      return 1;
+    }
+    total.compute += st.compute;
+    total.wait += st.wait;
+    total.comm += st.comm;
+    total.sent += st.sent;
+    total.panels += st.panels;
+  }
+  if (summa_barrier(&s) != 0)
+    return 1;
+  double elapsed = now() - start;
+  TempRelease(mark);
+
+  if (timer) {
+    if (rank == 0)
+      printf("Clock time is %.3f, %d processes in a %d by %d grid, "
+             "%.3f GFLOP/s\n", elapsed, procs, s.rows, s.cols,
+             2.0 * x * y * z * iters / elapsed / 1e9);
+    printf("Rank %d: %ld panels, computing %.3f, waiting %.3f, "
+           "communicating %.3f, sent %.1f MiB\n", rank, total.panels,
+           total.compute, total.wait, total.comm, total.sent / (1 << 20));
+    fflush(stdout);
+  }
+
+  if (debug || cfile != NULL || csvfile != NULL) {
+    double *all = NULL;
+    if (rank == 0 && cfile != NULL)
+      all = (double *) MatOutput(cfile, MATIO_F64, x, z);
+    else if (rank == 0)
+      all = (double *) MatAlloc(x, z, sizeof(double));
+    if (summa_gather(&s, x, z, C, j1 - j0, all, z) != 0) {
+      fprintf (stderr, "Rank %d: collecting the result failed\n", rank);
+      return 1;
+    }
+    if (rank == 0 && debug) {
+      printf ("--------------  result C matrix ------------------\n");
+      MatPrint(pool,all,x,z);
+    }
+    if (rank == 0 && csvfile != NULL
+        && dump_file(pool, csvfile, DUMP_CSV, MATIO_F64, all, x, z) != 0)
+      return 1;
+  }
+  summa_close(&s);
+  pool_destroy(pool);
+  return 0;
+}
 
-/* Generate data for a matrix: */
-void MatGen (double *A, int x, int y, int rand)
+/* Start ranks 1 to procs - 1 as child processes on this machine and
+ * run rank 0 here, waiting for all of them */
+int DistributedLocal (int procs, const char *hosts, long x, long y, long z,
+                      int threads, int pin, int iters, int rand, int timer,
+                      int debug, const char *cfile, const char *csvfile)
 {
-  int ix, iy;
+  int ret = 0, status;
 
-  for (ix = 0; ix < x ; ix++) {
-    for (iy = 0; iy < y ; iy++) {
-      A[idx(ix,iy,y)] = ( rand ?
-			  ((double)(random() % 200000000))/2000000000.0 :
-			  (1.0 + (((double)ix)/100.0) + (((double)iy/1000.0))));
+  fflush(stdout);
+  for (int rank = 1; rank < procs; rank++) {
+    pid_t pid = fork();
+    if (pid == 0)
+      exit(Distributed(rank, procs, hosts, x, y, z, threads, pin, iters,
+                       rand, timer, debug, cfile, csvfile));
+    if (pid < 0) {
+      perror("fork");
+      return 1;
     }
   }
+  ret = Distributed(0, procs, hosts, x, y, z, threads, pin, iters, rand,
+                    timer, debug, cfile, csvfile);
+  while (wait(&status) > 0)
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ret = 1;
+  return ret;
 }
 
 /* Print a help message on how to run the program */
 
 void usage(char *prog)
 {
-  fprintf (stderr, "%s: [-Tdr] -n val -x val -y val -z val\n", prog);
-  fprintf (stderr, "%s: [-Tdr] -s num -n val -x val\n", prog);
+  fprintf (stderr, "%s: [-Tdpr] [-i iters] -n val -x val -y val -z val\n", prog);
+  fprintf (stderr, "%s: [-Tdpr] [-i iters] -s num -n val -x val\n", prog);
+  fprintf (stderr, "%s: [-Tdpr] [-i iters] -e num -n val -x val\n", prog);
+  fprintf (stderr, "  -v isa forces the micro-kernel: avx512, avx2 or scalar\n");
+  fprintf (stderr, "  -k strassen uses Strassen-Winograd above the -c cutoff\n");
+  fprintf (stderr, "  -k sparse forces the CSR multiply, -k blocked the dense one;\n");
+  fprintf (stderr, "    by default it is picked from the density of A and B\n");
+  fprintf (stderr, "  -F alpha=a,beta=b,bias,relu,clamp=lo:hi fuses C = act(a A B + b C + bias)\n");
+  fprintf (stderr, "    into the tiles, with a generated bias row and starting C\n");
+  fprintf (stderr, "  -G row|col,ta,tb stores the inputs in that order, transposed, and\n");
+  fprintf (stderr, "    multiplies them with blas_dgemm, alpha and beta from -F\n");
+  fprintf (stderr, "  -S seed generates random data from seed, -r from the clock\n");
+  fprintf (stderr, "  -D frac keeps only about frac of the generated elements\n");
+  fprintf (stderr, "  -a pins threads, -I interleaves pages, -m reports placement\n");
+  fprintf (stderr, "  -A and -B read the inputs from matrix files, -C writes the result,\n");
+  fprintf (stderr, "  -W writes the generated inputs to the -A and -B files instead\n");
+  fprintf (stderr, "  -X f writes the result as CSV text to f, - for stdout\n");
+  fprintf (stderr, "  -M mb streams -A times -B into -C holding at most mb MiB\n");
+  fprintf (stderr, "  -t type multiplies f64 (default), f32, i32 or i8 elements\n");
+  fprintf (stderr, "  -H small|thp|hugetlb backs matrices and temporaries with 4 KiB pages,\n");
+  fprintf (stderr, "    transparent huge pages (default) or the reserved huge page pool\n");
+  fprintf (stderr, "  -b count runs a batch of count small multiplies of the -x -y -z shape\n");
+  fprintf (stderr, "  -P counts cycles, instructions, cache misses and FP instructions\n");
+  fprintf (stderr, "    per thread and per blocked multiply\n");
+  fprintf (stderr, "  -u tunes blocking, micro-kernel and threads on -x sized multiplies\n");
+  fprintf (stderr, "    and saves them to $MM_TUNE or ~/.mm-tune, which later runs read\n");
+  fprintf (stderr, "  -o csv|json times -R runs after -w warmups and prints statistics\n");
+  fprintf (stderr, "  -L sock runs a daemon with a warm pool taking jobs on socket sock,\n");
+  fprintf (stderr, "    -J sock has it compute the multiply or power, -J sock -Q stops it\n");
+  fprintf (stderr, "  -N procs multiplies on a grid of procs processes over TCP, started\n");
+  fprintf (stderr, "    here on 127.0.0.1, or each rank started with -K rank, -Y host,...\n");
+  fprintf (stderr, "    and otherwise the same options\n");
   exit(1);
 }
 
@@ -244,10 +1400,66 @@ void usage(char *prog)
 /* Main function
  *
  *  args:  -T   -- record the program computation time
+ *         -A f -- read A from matrix file f, which sets its size
+ *         -B f -- read B from matrix file f
+ *         -C f -- write the result to matrix file f
+ *         -a   -- pin the threads to CPUs, node by node
+ *         -b n -- a batch of n independent multiplies, spread whole
+ *                 over the threads
+ *         -c n -- strassen cutoff, sizes <= n use the blocked kernel
  *         -d   -- debug and print results
+ *         -D f -- zero all but about a fraction f of generated elements
+ *         -e n -- raise the matrix to the n-th power
+ *         -F l -- fused epilogue, a list of alpha=a, beta=b, bias,
+ *                 relu and clamp=lo:hi; C and the bias are generated
+ *                 like A and B
+ *         -G l -- BLAS style multiply of inputs stored as the list
+ *                 says: row or col major, and ta and tb to hold A or
+ *                 B transposed; -F gives alpha and beta
+ *         -H h -- page backing of matrices and temporaries: small,
+ *                 thp for transparent huge pages (the default), or
+ *                 hugetlb for the reserved pool, falling back to thp
+ *         -i n -- repeat the multiply n times on the same workers
+ *         -J s -- submit the multiply or power to the daemon on Unix
+ *                 socket s, passing the matrices in shared memory
+ *         -K r -- with -N, run only rank r of the grid, the others
+ *                 started separately with the same options, on other
+ *                 hosts or here
+ *         -L s -- run as a daemon taking jobs on Unix socket s, with
+ *                 one pool and its temporaries kept between jobs; -x
+ *                 sizes the temporaries up front, -T reports each job
+ *         -I   -- interleave matrix pages over all NUMA nodes
  *         -r   -- use random data between 0 and 1
- *         -N   -- number of threads to create
+ *         -S s -- random data from seed s, the same for any -n
+ *         -R n -- timed repetitions for -o, each of -i multiplies
+ *         -M m -- out-of-core multiply of the -A and -B files into -C,
+ *                 holding no more than m MiB of them in memory
+ *         -k k -- multiply kernel, blocked, strassen or sparse; without
+ *                 it sparse inputs use sparse and the rest blocked
+ *         -m   -- report page placement and bandwidth per node
+ *         -N p -- SUMMA multiply on a grid of p processes, each
+ *                 holding its blocks of A, B and C and passing panels
+ *                 over TCP; all of them forked here without -K
+ *         -n   -- number of threads to create, by default the tuned
+ *                 count or else one per online CPU
+ *         -o f -- benchmark record in format f, csv or json, of
+ *                 the -R timed runs
+ *         -p   -- pack A and B into kernel-ordered panels first
+ *         -P   -- hardware counters of every thread, reported for
+ *                 each blocked multiply and in total
+ *         -Q   -- with -J, stop the daemon once its queue is done
  *         -s t -- square the matrix t times
+ *         -u   -- autotune on -x by -x multiplies, up to -n threads,
+ *                 and save the result for later runs
+ *         -t t -- element type of a multiply: f64, f32, i32, or i8
+ *                 with int32 sums and result
+ *         -v i -- micro-kernel instruction set, avx512, avx2 or scalar
+ *         -w n -- untimed warmup runs before the -o repetitions
+ *         -W   -- write the generated A and B to the -A and -B files
+ *         -X f -- write the result to f as CSV, or to stdout for -
+ *         -Y h -- with -N, comma separated host or host:port of
+ *                 each rank, or one for all, ports counting up from
+ *                 it; 127.0.0.1 and port 47000 by default
  *         -x   -- rows of the first matrix, r & c for squaring
  *         -y   -- cols of A, rows of B
  *         -z   -- cols of B
@@ -260,25 +1472,150 @@ int main (int argc, char ** argv)
   int ch;                /* for use with getopt(3) */
 
   /* option data */
-  int x = 0, y = 0, z = 0;
-  int threads = 8;
+  long x = 0, y = 0, z = 0;
+  int threads = 0;
   int timer = 0;
   int debug = 0;
   int square = 0;
   int useRand = 0;
   int sTimes = 0;
+  int iters = 1;
+  int power = 0;
+  int pin = 0;
+  int memreport = 0;
+  int counters = 0;
+  int tuning = 0;
+  struct kernel_epilogue fused;
+  int bias = 0;
+  char *afile = NULL, *bfile = NULL, *cfile = NULL;
+  char *csvfile = NULL;
+  char *listenpath = NULL, *jobpath = NULL;
+  int quit = 0;
+  int save = 0;
+  long budget = 0;
+  int batch = 0;
+  double keep = 1;
+  int procs = 0, rank = -1;
+  char *hosts = NULL;
+
+  /* Settings saved by -u, before the options that override them */
+  struct tune tuned;
+  const char *tunefile = tune_path();
+  if (tunefile == NULL || tune_load(tunefile, &tuned) == -1)
+    memset(&tuned, 0, sizeof(tuned));
+  tune_apply(&tuned);
+  if (tuned.tile_n > 0)
+    tile_n = tuned.tile_n;
 
-  while ((ch = getopt(argc, argv, "Tdrs:n:x:y:z:")) != -1) {
+  while ((ch = getopt(argc, argv, "A:B:C:D:F:G:H:J:K:L:M:N:PQR:S:Tab:c:de:i:Ik:mo:prs:n:t:uv:w:WX:Y:x:y:z:")) != -1) {
     switch (ch) {
+    case 'A':  /* A input file */
+      afile = optarg;
+      break;
+    case 'B':  /* B input file */
+      bfile = optarg;
+      break;
+    case 'C':  /* C output file */
+      cfile = optarg;
+      break;
+    case 'D':  /* generated density */
+      keep = atof(optarg);
+      break;
+    case 'F':  /* fused epilogue */
+      bias = EpilogueNamed(optarg, &fused);
+      if (bias < 0)
+        usage(argv[0]);
+      epilogue = &fused;
+      break;
+    case 'G':  /* BLAS style multiply */
+      if (GemmNamed(optarg) != 0)
+        usage(argv[0]);
+      break;
+    case 'H':  /* page backing */
+      backing = BackingNamed(optarg);
+      if (backing < 0)
+        usage(argv[0]);
+      break;
+    case 'J':  /* daemon to submit to */
+      jobpath = optarg;
+      break;
+    case 'K':  /* rank */
+      rank = atoi(optarg);
+      break;
+    case 'L':  /* run as a daemon */
+      listenpath = optarg;
+      break;
+    case 'M':  /* out-of-core budget */
+      budget = atol(optarg);
+      break;
+    case 'N':  /* processes */
+      procs = atoi(optarg);
+      break;
+    case 'P':  /* performance counters */
+      counters = 1;
+      break;
+    case 'Q':  /* stop the daemon */
+      quit = 1;
+      break;
+    case 'R':  /* repetitions */
+      reps = atoi(optarg);
+      break;
     case 'T':  /* timing */
       timer = 1;
       break;
+    case 'a':  /* affinity */
+      pin = 1;
+      break;
+    case 'b':  /* batch */
+      batch = atoi(optarg);
+      break;
+    case 'c':  /* strassen cutoff */
+      cutoff = atoi(optarg);
+      break;
     case 'd':  /* debug */
       debug = 1;
       break;
+    case 'e':  /* exponent */
+      power = atoi(optarg);
+      square = 1;
+      break;
+    case 'i':  /* iterations */
+      iters = atoi(optarg);
+      break;
+    case 'I':  /* interleave */
+      interleave = 1;
+      break;
+    case 'k':  /* kernel */
+      if (strcmp(optarg, "strassen") == 0) {
+        strassen = 1;
+        sparse = 0;
+      } else if (strcmp(optarg, "blocked") == 0) {
+        strassen = 0;
+        sparse = 0;
+      } else if (strcmp(optarg, "sparse") == 0)
+        sparse = 1;
+      else
+        usage(argv[0]);
+      break;
+    case 'm':  /* memory report */
+      memreport = 1;
+      break;
+    case 'o':  /* benchmark output */
+      format = bench_format(optarg);
+      if (format < 0)
+        usage(argv[0]);
+      break;
+    case 'p':  /* packing */
+      packing = 1;
+      break;
     case 'r':  /* debug */
       useRand = 1;
-      srandom(time(NULL));
+      if (seed == 0)
+        seed = time(NULL);
+      break;
+    case 'S':  /* seed */
+      useRand = 1;
+      seed = strtoull(optarg, NULL, 0);
       break;
     case 's':  /* s times */
       sTimes = atoi(optarg);
@@ -287,14 +1624,40 @@ int main (int argc, char ** argv)
     case 'n':  /* s times */
       threads = atoi(optarg);
       break;
+    case 't':  /* element type */
+      dtype = TypeNamed(optarg);
+      if (dtype < 0)
+        usage(argv[0]);
+      break;
+    case 'u':  /* autotune */
+      tuning = 1;
+      break;
+    case 'v':  /* vector isa */
+      if (kernel_select(optarg) != 0) {
+	fprintf (stderr, "Instruction set %s is not available\n", optarg);
+	usage(argv[0]);
+      }
+      break;
+    case 'w':  /* warmup */
+      warmup = atoi(optarg);
+      break;
+    case 'W':  /* write inputs */
+      save = 1;
+      break;
+    case 'X':  /* CSV result */
+      csvfile = optarg;
+      break;
+    case 'Y':  /* hosts */
+      hosts = optarg;
+      break;
     case 'x':  /* x size */
-      x = atoi(optarg);
+      x = atol(optarg);
       break;
     case 'y':  /* y size */
-      y = atoi(optarg);
+      y = atol(optarg);
       break;
     case 'z':  /* z size */
-      z = atoi(optarg);
+      z = atol(optarg);
       break;
     case '?': /* help */
     default:
@@ -302,81 +1665,323 @@ int main (int argc, char ** argv)
     }
   }
 
+  topo_backing(backing);
+
+  if (tuning) {
+    if (tunefile == NULL || square || batch || afile != NULL || bfile != NULL
+        || cfile != NULL || csvfile != NULL || threads < 0 || dtype != MATIO_F64
+        || epilogue != NULL || gemm_order >= 0 || listenpath != NULL
+        || jobpath != NULL || procs != 0) {
+      fprintf (stderr, "Inconsistent options\n");
+      usage(argv[0]);
+    }
+    return Autotune(x > 0 ? x : TUNE_SIZE,
+                    threads > 0 ? threads : (int) sysconf(_SC_NPROCESSORS_ONLN),
+                    tunefile);
+  }
+  if (threads == 0)
+    threads = tuned.threads > 0 ? tuned.threads
+              : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+  /* Daemon, and stopping one */
+  if (listenpath != NULL) {
+    if (jobpath != NULL || quit || square || batch || afile != NULL
+        || bfile != NULL || cfile != NULL || csvfile != NULL || save
+        || budget != 0 || counters || memreport || debug || format >= 0
+        || dtype != MATIO_F64 || epilogue != NULL || gemm_order >= 0
+        || procs != 0 || threads <= 0) {
+      fprintf (stderr, "Inconsistent options\n");
+      usage(argv[0]);
+    }
+    return Serve(listenpath, threads, pin, x, timer);
+  }
+  if (quit) {
+    struct serve_job job = { SERVE_MAGIC, SERVE_STOP, 0, 0, 0, 0 };
+    struct serve_reply reply;
+    if (jobpath == NULL) {
+      fprintf (stderr, "Inconsistent options\n");
+      usage(argv[0]);
+    }
+    return serve_submit(jobpath, &job, -1, &reply) == 0 ? 0 : 1;
+  }
+
+  /* Out-of-core: straight from the input files to the output file */
+  if (budget != 0) {
+    struct ooc_stats st;
+    if (budget < 0 || square || save || afile == NULL || bfile == NULL
+        || cfile == NULL || csvfile != NULL || jobpath != NULL || threads <= 0
+        || dtype != MATIO_F64 || epilogue != NULL || gemm_order >= 0
+        || procs != 0) {
+      fprintf (stderr, "Inconsistent options\n");
+      usage(argv[0]);
+    }
+    kernel_isa();
+    struct pool *pool = pool_create(threads);
+    if (pin)
+      pool_run(pool, pin_body, NULL);
+    if (ooc_dgemm(pool, afile, bfile, cfile, (size_t) budget << 20, &st) != 0)
+      exit(1);
+    if (timer)
+      printf("Clock time is %.3f, %ld blocks, read %.3f, waited %.3f, "
+             "wrote %.3f, %.3f GFLOP/s\n", st.time, st.blocks,
+             st.read_time, st.wait_time, st.write_time,
+             st.flops / st.time / 1e9);
+    pool_destroy(pool);
+    return 0;
+  }
+
+  /* Matrices read from files fix the sizes */
+  double *fileA = NULL, *fileB = NULL;
+  long rows, cols;
+  if ((square && (bfile != NULL || dtype != MATIO_F64))
+      || (save && afile == NULL && bfile == NULL)
+      || (memreport && dtype != MATIO_F64) || reps < 1 || warmup < 0
+      || (epilogue != NULL && (square || batch || dtype != MATIO_F64
+                               || sparse == 1))
+      || (batch != 0 && (batch < 0 || square || afile != NULL || bfile != NULL
+                         || cfile != NULL || csvfile != NULL || memreport
+                         || dtype != MATIO_F64 || x > INT_MAX || y > INT_MAX
+                         || z > INT_MAX))
+      || (gemm_order >= 0 && (square || batch || save || afile != NULL
+                              || bfile != NULL || cfile != NULL
+                              || csvfile != NULL || dtype != MATIO_F64
+                              || bias || (epilogue != NULL
+                                          && epilogue->act != KERNEL_ACT_NONE)))) {
+    fprintf (stderr, "Inconsistent options\n");
+    usage(argv[0]);
+  }
+  if (afile != NULL && !save) {
+    fileA = MatLoad(afile, &rows, &cols);
+    SizeCheck(afile, &x, rows);
+    if (square && rows != cols) {
+      fprintf (stderr, "%s: can't raise a non-square matrix to a power\n",
+               afile);
+      exit(1);
+    }
+    if (!square)
+      SizeCheck(afile, &y, cols);
+  }
+  if (bfile != NULL && !save) {
+    fileB = MatLoad(bfile, &rows, &cols);
+    SizeCheck(bfile, &y, rows);
+    SizeCheck(bfile, &z, cols);
+  }
+
   /* verify options are correct. */
   if (square) {
-    if (y != 0 || z != 0 || x <= 0 || sTimes < 1) {
+    if (y != 0 || z != 0 || x <= 0 || (sTimes != 0) == (power != 0)
+        || sTimes < 0 || sTimes > 30 || power < 0 || threads <= 0
+        || iters < 1) {
       fprintf (stderr, "Inconsistent options\n");
       usage(argv[0]);
     }
-  } else if (x <= 0 || y <= 0 || z <= 0 || threads <= 0) {
+    if (sTimes)
+      power = 1 << sTimes;
+  } else if (x <= 0 || y <= 0 || z <= 0 || threads <= 0 || iters < 1) {
     fprintf (stderr, "-n, -x, -y, and -z all need to be specified or -s, -n, and -x.\n");
     usage(argv[0]);
   }
 
+  /* Distributed: every process holds and computes its own blocks */
+  if (procs != 0 || rank >= 0 || hosts != NULL) {
+    if (procs <= 0 || rank >= procs || square || batch || save
+        || afile != NULL || bfile != NULL || jobpath != NULL || counters
+        || memreport || format >= 0 || keep < 1 || dtype != MATIO_F64
+        || epilogue != NULL || gemm_order >= 0 || strassen || sparse == 1
+        || packing) {
+      fprintf (stderr, "Inconsistent options\n");
+      usage(argv[0]);
+    }
+    if (rank >= 0)
+      return Distributed(rank, procs, hosts, x, y, z, threads, pin, iters,
+                         useRand, timer, debug, cfile, csvfile);
+    return DistributedLocal(procs, hosts, x, y, z, threads, pin, iters,
+                            useRand, timer, debug, cfile, csvfile);
+  }
+
+  /* Client: the daemon computes it */
+  if (jobpath != NULL) {
+    if (batch || save || counters || memreport || format >= 0 || iters != 1
+        || keep < 1 || dtype != MATIO_F64 || epilogue != NULL
+        || gemm_order >= 0) {
+      fprintf (stderr, "Inconsistent options\n");
+      usage(argv[0]);
+    }
+    return Submit(jobpath, fileA, fileB, x, y, z, square ? power : 0,
+                  useRand, timer, debug, cfile, csvfile);
+  }
+
+  /* Pick the micro-kernels before any thread needs them */
+  kernel_isa();
+  struct pool *pool = pool_create(threads);
+  if (pin)
+    pool_run(pool, pin_body, NULL);
+  if (counters)
+    perf = perf_create(threads);
+
   /* timers */
   clock_t start_time, end_time, cpu_time;
   time_t wall_time;
   struct timeval start_tv, end_tv;
 
+  if (batch > 0) {
+    BatchRun(pool, batch, x, y, z, iters, useRand, timer, debug);
+    pool_destroy(pool);
+    return 0;
+  }
+
   /* Matrix storage */
   double *A;
   double *B;
   double *C;
 
   if (square) {
-    A = (double *) malloc (sizeof(double) * x * x);
-    B = (double *) malloc (sizeof(double) * x * x);
-    MatGen(A,x,x,useRand);
+    if (fileA != NULL) {
+      A = fileA;
+    } else {
+      A = (double *) MatAlloc(x, x, sizeof(double));
+      MatGen(pool,A,x,x,useRand,GEN_A);
+      if (save && matio_save(afile, A, x, x) != 0)
+        exit(1);
+    }
+    if (cfile != NULL)
+      B = (double *) MatOutput(cfile, MATIO_F64, x, x);
+    else
+      B = (double *) MatAlloc(x, x, sizeof(double));
     /* Calculate run time */
-    if (timer) {
+    if (format >= 0) {
+      struct run r = { pool, NULL, A, NULL, B, x, x, x, power, 0, iters };
+      Bench(&r);
+    } else if (timer) {
       gettimeofday(&start_tv, NULL);
       start_time = clock();
-      MatSquare(A, B, x, sTimes, threads);
+      for (int i = 0; i < iters; i++)
+        MatPower(pool, A, B, x, power, NULL);
       end_time = clock();
       gettimeofday(&end_tv, NULL);
       cpu_time = end_time - start_time;
       wall_time = end_tv.tv_sec - start_tv.tv_sec;
-      printf("Clock time is %ld, CPU time is %ld\n", wall_time, cpu_time);
+      if (packing)
+        printf("Clock time is %ld, CPU time is %ld, packing time is %.6f\n",
+               wall_time, cpu_time, pack_time);
+      else
+        printf("Clock time is %ld, CPU time is %ld\n", wall_time, cpu_time);
+      TilePrint(pool);
     }
     /* Run normally */
     else {
-      MatSquare(A, B, x, sTimes, threads);
+      for (int i = 0; i < iters; i++)
+        MatPower(pool, A, B, x, power, NULL);
     }
+    if (memreport)
+      MemReport(pool, A, A, B, x, x, x);
+    if (perf != NULL)
+      PerfReport(pool);
     if (debug) {
       printf ("-------------- orignal matrix ------------------\n");
-      MatPrint(A,x,x);
+      MatPrint(pool,A,x,x);
       printf ("--------------  result matrix ------------------\n");
-      MatPrint(B,x,x);
+      MatPrint(pool,B,x,x);
     }
+    if (csvfile != NULL
+        && dump_file(pool, csvfile, DUMP_CSV, MATIO_F64, B, x, x) != 0)
+      exit(1);
   } else {
-    A = (double *) malloc (sizeof(double) * x * y);
-    B = (double *) malloc (sizeof(double) * y * z);
-    C = (double *) malloc (sizeof(double) * x * z);
-    MatGen(A,x,y,useRand);
-    MatGen(B,y,z,useRand);
+    /* Rows and cols of the arrays, which differ from the multiply's
+     * for a transposed or column-major -G */
+    long ar, ac, br, bc, cr, cc;
+    GemmShape(transa, x, y, &ar, &ac);
+    GemmShape(transb, y, z, &br, &bc);
+    GemmShape(BLAS_NO_TRANS, x, z, &cr, &cc);
+    if (fileA != NULL) {
+      A = fileA;
+    } else {
+      A = (double *) MatAlloc(x, y, sizeof(double));
+      MatGen(pool,A,ar,ac,useRand,GEN_A);
+      if (keep < 1)
+        MatSparsify(pool, A, ar, ac, keep, GEN_A);
+      if (save && afile != NULL && matio_save(afile, A, x, y) != 0)
+        exit(1);
+    }
+    if (fileB != NULL) {
+      B = fileB;
+    } else {
+      B = (double *) MatAlloc(y, z, sizeof(double));
+      MatGen(pool,B,br,bc,useRand,GEN_B);
+      if (keep < 1)
+        MatSparsify(pool, B, br, bc, keep, GEN_B);
+      if (save && bfile != NULL && matio_save(bfile, B, y, z) != 0)
+        exit(1);
+    }
+    /* Copies in the element type of -t; integer random data is
+     * scaled up so it does not all round to zero */
+    void *tA = A, *tB = B;
+    int ctype = ResultType(dtype);
+    if (dtype != MATIO_F64) {
+      double scale = useRand && (dtype == MATIO_I32 || dtype == MATIO_I8)
+                     ? 1000 : 1;
+      tA = MatCast(A, x, y, dtype, fileA != NULL ? 1 : scale);
+      tB = MatCast(B, y, z, dtype, fileB != NULL ? 1 : scale);
+    }
+    struct sparseplan plan;
+    SparsePlan(&plan, A, B, x, y, z);
+    if (cfile != NULL)
+      C = MatOutput(cfile, ctype, x, z);
+    else
+      C = MatAlloc(x, z, matio_dtype_size(ctype));
+    if (epilogue != NULL && epilogue->beta != 0)
+      MatGen(pool, C, cr, cc, useRand, GEN_C);
+    if (bias) {
+      double *row = (double *) MatAlloc(1, z, sizeof(double));
+      MatGen(pool, row, 1, z, useRand, GEN_BIAS);
+      epilogue->bias = row;
+    }
     /* Calculate run time */
-    if (timer) {
+    if (format >= 0) {
+      struct run r = { pool, &plan, tA, tB, C, x, y, z, 0, 0, iters };
+      Bench(&r);
+    } else if (timer) {
       gettimeofday(&start_tv, NULL);
       start_time = clock();
-      MatMul(A, B, C, x, y, z, threads);
+      for (int i = 0; i < iters; i++)
+        MatMulPlan(pool, &plan, tA, tB, C, x, y, z);
       end_time = clock();
       gettimeofday(&end_tv, NULL);
       cpu_time = end_time - start_time;
       wall_time = end_tv.tv_sec - start_tv.tv_sec;
-      printf("Clock time is %ld, CPU time is %ld\n", wall_time, cpu_time);
+      if (packing)
+        printf("Clock time is %ld, CPU time is %ld, packing time is %.6f\n",
+               wall_time, cpu_time, pack_time);
+      else
+        printf("Clock time is %ld, CPU time is %ld\n", wall_time, cpu_time);
+      if (plan.mode != SPARSE_OFF)
+        printf("Sparse: density of A %.4f, B %.4f, CSR A times %s B\n",
+               plan.da, plan.db, plan.mode == SPARSE_AB ? "CSR" : "dense");
+      TilePrint(pool);
     }
     /* Run normally */
     else {
-      MatMul(A, B, C, x, y, z, threads);
+      for (int i = 0; i < iters; i++)
+        MatMulPlan(pool, &plan, tA, tB, C, x, y, z);
     }
+    if (memreport)
+      MemReport(pool, A, B, C, x, y, z);
+    if (perf != NULL)
+      PerfReport(pool);
     if (debug) {
       printf ("-------------- orignal A matrix ------------------\n");
-      MatPrint(A,x,y);
+      MatPrintType(pool,tA,dtype,ar,ac);
       printf ("-------------- orignal B matrix ------------------\n");
-      MatPrint(B,y,z);
+      MatPrintType(pool,tB,dtype,br,bc);
       printf ("--------------  result C matrix ------------------\n");
-      MatPrint(C,x,z);
+      MatPrintType(pool,C,ctype,cr,cc);
     }
+    if (csvfile != NULL
+        && dump_file(pool, csvfile, DUMP_CSV, ctype, C, x, z) != 0)
+      exit(1);
   }
+  if (perf != NULL)
+    perf_destroy(perf, threads);
+  pool_destroy(pool);
   return 0;
 }
@@ -0,0 +1,181 @@
+/* Counter-based random numbers
+ *
+ *   Michael Albert
+ *
+ *  Philox needs no state beyond its counter, so a generator is just a
+ *  seed and a position.  rng_uniform runs RNG_LANES counters through
+ *  the rounds side by side, in AVX2 registers when the CPU has them,
+ *  and the scalar code only handles the ragged ends.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "rng.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RNG_X86
+#endif
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+void rng_philox (uint32_t ctr[4], const uint32_t key[2])
+{
+  uint32_t k0 = key[0], k1 = key[1];
+
+  for (int r = 0; r < PHILOX_ROUNDS; r++) {
+    uint64_t p0 = (uint64_t) PHILOX_M0 * ctr[0];
+    uint64_t p1 = (uint64_t) PHILOX_M1 * ctr[2];
+    uint32_t c1 = ctr[1], c3 = ctr[3];
+    ctr[0] = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    ctr[1] = (uint32_t) p1;
+    ctr[2] = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    ctr[3] = (uint32_t) p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+}
+
+/* Counters done at once by rng_uniform, giving 2 * RNG_LANES
+ * elements */
+#define RNG_LANES 8
+
+/* 52 bits from two words as the mantissa of a double in [1, 2),
+ * less 1.  The vector code makes the same bits the same way. */
+#define RNG_ONE 0x3FF0000000000000ull
+
+static double unit (uint32_t hi, uint32_t lo)
+{
+  uint64_t bits = ((((uint64_t) hi << 32) | lo) >> 12) | RNG_ONE;
+  double d;
+
+  memcpy(&d, &bits, sizeof(d));
+  return d - 1.0;
+}
+
+/* Elements 2 blk .. 2 blk + 2 RNG_LANES - 1 of a stream into o.
+ *  Element 2b comes from words 0 and 1 of block b, element 2b+1
+ *  from words 2 and 3. */
+typedef void (*lanes_t) (uint64_t blk, uint32_t stream, uint64_t seed,
+			 double *o);
+
+static void lanes_scalar (uint64_t blk, uint32_t stream, uint64_t seed,
+			  double *o)
+{
+  uint32_t key[2] = { (uint32_t) seed, (uint32_t)(seed >> 32) };
+
+  for (int l = 0; l < RNG_LANES; l++) {
+    uint32_t c[4] = { (uint32_t)(blk + l), (uint32_t)((blk + l) >> 32),
+		      stream, 0 };
+    rng_philox(c, key);
+    o[2 * l] = unit(c[0], c[1]);
+    o[2 * l + 1] = unit(c[2], c[3]);
+  }
+}
+
+#ifdef RNG_X86
+
+/* hi and lo halves of the 32 x 32 bit products of every lane */
+__attribute__((target("avx2")))
+static inline void mulhilo_avx2 (__m256i m, __m256i c, __m256i *hi,
+				 __m256i *lo)
+{
+  __m256i even = _mm256_mul_epu32(m, c);
+  __m256i odd = _mm256_mul_epu32(m, _mm256_srli_epi64(c, 32));
+
+  *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+  *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+/* Words hi and lo of each 64 bit lane made into unit doubles */
+__attribute__((target("avx2")))
+static inline __m256d unit_avx2 (__m256i hilo)
+{
+  __m256i bits = _mm256_or_si256(_mm256_srli_epi64(hilo, 12),
+				 _mm256_set1_epi64x(RNG_ONE));
+  return _mm256_sub_pd(_mm256_castsi256_pd(bits), _mm256_set1_pd(1.0));
+}
+
+__attribute__((target("avx2")))
+static void lanes_avx2 (uint64_t blk, uint32_t stream, uint64_t seed,
+			double *o)
+{
+  __m256i m0 = _mm256_set1_epi32(PHILOX_M0), m1 = _mm256_set1_epi32(PHILOX_M1);
+  __m256i k0 = _mm256_set1_epi32((uint32_t) seed);
+  __m256i k1 = _mm256_set1_epi32((uint32_t)(seed >> 32));
+  __m256i c0 = _mm256_add_epi32(_mm256_set1_epi32((uint32_t) blk),
+				_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i c1 = _mm256_set1_epi32((uint32_t)(blk >> 32));
+  __m256i c2 = _mm256_set1_epi32(stream), c3 = _mm256_setzero_si256();
+  __m256i hi0, lo0, hi1, lo1;
+
+  /* blk is a multiple of RNG_LANES, so the low word never wraps
+   * inside the eight lanes and c1 is the same for all of them */
+  for (int r = 0; r < PHILOX_ROUNDS; r++) {
+    mulhilo_avx2(m0, c0, &hi0, &lo0);
+    mulhilo_avx2(m1, c2, &hi1, &lo1);
+    c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), k0);
+    c1 = lo1;
+    c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), k1);
+    c3 = lo0;
+    k0 = _mm256_add_epi32(k0, _mm256_set1_epi32(PHILOX_W0));
+    k1 = _mm256_add_epi32(k1, _mm256_set1_epi32(PHILOX_W1));
+  }
+
+  /* Pair the words as hi:lo, lanes 0 1 4 5 then 2 3 6 7 */
+  __m256d e01 = unit_avx2(_mm256_unpacklo_epi32(c1, c0));
+  __m256d e23 = unit_avx2(_mm256_unpackhi_epi32(c1, c0));
+  __m256d o01 = unit_avx2(_mm256_unpacklo_epi32(c3, c2));
+  __m256d o23 = unit_avx2(_mm256_unpackhi_epi32(c3, c2));
+  /* e0 o0 | e4 o4, e1 o1 | e5 o5, e2 o2 | e6 o6, e3 o3 | e7 o7 */
+  __m256d a = _mm256_unpacklo_pd(e01, o01), b = _mm256_unpackhi_pd(e01, o01);
+  __m256d c = _mm256_unpacklo_pd(e23, o23), d = _mm256_unpackhi_pd(e23, o23);
+  _mm256_storeu_pd(o, _mm256_permute2f128_pd(a, b, 0x20));
+  _mm256_storeu_pd(o + 4, _mm256_permute2f128_pd(c, d, 0x20));
+  _mm256_storeu_pd(o + 8, _mm256_permute2f128_pd(a, b, 0x31));
+  _mm256_storeu_pd(o + 12, _mm256_permute2f128_pd(c, d, 0x31));
+}
+
+#endif
+
+/* Lane code for this CPU, picked once by whichever thread gets there
+ * first; the pool's workers all call rng_uniform at the same time */
+static lanes_t lanes;
+static pthread_once_t lanes_once = PTHREAD_ONCE_INIT;
+
+static void pick_lanes (void)
+{
+  lanes = lanes_scalar;
+#ifdef RNG_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    lanes = lanes_avx2;
+#endif
+}
+
+void rng_uniform (uint64_t seed, uint32_t stream, uint64_t first, long n,
+		  double *out)
+{
+  double tmp[2 * RNG_LANES];
+  uint64_t end = first + n;
+
+  pthread_once(&lanes_once, pick_lanes);
+
+  /* Whole groups of lanes go straight to out, the ends through tmp */
+  for (uint64_t blk = first / 2 / RNG_LANES * RNG_LANES; 2 * blk < end;
+       blk += RNG_LANES) {
+    uint64_t e = 2 * blk;
+    if (e >= first && e + 2 * RNG_LANES <= end) {
+      lanes(blk, stream, seed, out + (e - first));
+      continue;
+    }
+    lanes(blk, stream, seed, tmp);
+    for (int i = 0; i < 2 * RNG_LANES; i++)
+      if (e + i >= first && e + i < end)
+	out[e + i - first] = tmp[i];
+  }
+}
@@ -0,0 +1,27 @@
+/* Counter-based random numbers
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* Philox4x32-10 of Salmon, Moraes, Dror and Shaw, "Parallel random
+ * numbers: as easy as 1, 2, 3" (SC11): ctr is replaced by a random
+ * function of ctr and key.
+ */
+void rng_philox (uint32_t ctr[4], const uint32_t key[2]);
+
+/* Uniform doubles in [0, 1):
+ *  out[i] gets element first + i of stream under seed.  An element
+ *  depends on nothing but those three numbers, so threads can fill
+ *  any pieces of a stream in any order and get the same values.
+ *  Every Philox block gives two elements of 52 bits.
+ */
+void rng_uniform (uint64_t seed, uint32_t stream, uint64_t first, long n,
+		  double *out);
+
+#endif
@@ -0,0 +1,374 @@
+/* Matrix multiply daemon
+ *
+ *   Michael Albert
+ *
+ *  Every job is one connection on a SOCK_SEQPACKET Unix socket: the
+ *  client sends a serve_job with the descriptor of a memfd holding
+ *  the matrices, and gets a serve_reply back once C is written in
+ *  place, so no matrix is ever copied through the socket.
+ *
+ *  A loader thread accepts the connections and maps each region with
+ *  MAP_POPULATE into a ring of depth slots.  The thread that called
+ *  serve_run takes the slots in order and computes them, so while a
+ *  job multiplies on the pool the next ones are already faulted in.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "arena.h"
+
+/* A job between the loader and the computing thread */
+struct slot {
+  int conn;                     /* -1 once the loader has given up */
+  struct serve_job job;
+  char *base;                   /* mapped region, or NULL */
+  size_t size;
+  int status;                   /* errno value for the reply */
+  int last;                     /* SERVE_STOP or a dead socket */
+  double ready, load;           /* when loading ended and how long */
+};
+
+struct server {
+  int sock, depth;
+  struct slot *q;
+  long head, tail;              /* next slot to compute, to fill */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static double seconds (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes of a rows by cols matrix in the region, rounded up to the
+ * next one's boundary; -1 if that overflows.  The sizes come from the
+ * client, so nothing here may wrap. */
+static int matrix_bytes (int64_t rows, int64_t cols, size_t *bytes)
+{
+  size_t n;
+
+  if (__builtin_mul_overflow((size_t) rows, (size_t) cols, &n)
+      || __builtin_mul_overflow(n, sizeof(double), &n)
+      || __builtin_add_overflow(n, ARENA_ALIGN - 1, &n))
+    return -1;
+  *bytes = n / ARENA_ALIGN * ARENA_ALIGN;
+  return 0;
+}
+
+size_t serve_layout (const struct serve_job *job, size_t off[3])
+{
+  size_t a, b = 0, c, size;
+
+  if (job->x <= 0 || job->y <= 0 || job->z <= 0)
+    return 0;
+  if (job->op == SERVE_POWER) {
+    if (job->y != job->x || job->z != job->x || job->power < 1)
+      return 0;
+  } else if (job->op != SERVE_MUL) {
+    return 0;
+  }
+  if (matrix_bytes(job->x, job->y, &a) != 0
+      || (job->op != SERVE_POWER && matrix_bytes(job->y, job->z, &b) != 0)
+      || matrix_bytes(job->x, job->z, &c) != 0
+      || __builtin_add_overflow(a, b, &size)
+      || __builtin_add_overflow(size, c, &size))
+    return 0;
+  off[0] = 0;
+  off[1] = a;
+  off[2] = a + b;
+  return size;
+}
+
+/* Socket address for path, or -1 if it is too long */
+static int address (const char *path, struct sockaddr_un *sa)
+{
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sa->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(sa->sun_path, path);
+  return 0;
+}
+
+static int listen_on (const char *path)
+{
+  struct sockaddr_un sa;
+  struct stat sb;
+  int sock, err;
+
+  if (address(path, &sa) != 0)
+    return -1;
+  /* a socket left behind by a daemon that died */
+  if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+    unlink(path);
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  if (bind(sock, (struct sockaddr *) &sa, sizeof(sa)) != 0
+      || listen(sock, SOMAXCONN) != 0) {
+    err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+  }
+  return sock;
+}
+
+/* Read the job of a connection, and the descriptor sent with it */
+static int recv_job (int conn, struct serve_job *job, int *fd)
+{
+  char ctl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { job, sizeof(*job) };
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  *fd = -1;
+  do
+    n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  while (n < 0 && errno == EINTR);
+  for (cm = CMSG_FIRSTHDR(&msg); n >= 0 && cm != NULL;
+       cm = CMSG_NXTHDR(&msg, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(cm), sizeof(int));
+  return n == sizeof(*job) ? 0 : -1;
+}
+
+/* Whether the region behind fd can't shrink under the daemon */
+static int sealed (int fd)
+{
+  int seals = fcntl(fd, F_GET_SEALS);
+  return seals >= 0 && (seals & F_SEAL_SHRINK);
+}
+
+/* Receive the job on s->conn and map its region */
+static void load (struct slot *s)
+{
+  double start = seconds();
+  size_t off[3];
+  struct stat sb;
+  int fd;
+
+  s->base = NULL;
+  s->size = 0;
+  s->status = 0;
+  s->last = 0;
+  if (recv_job(s->conn, &s->job, &fd) != 0 || s->job.magic != SERVE_MAGIC) {
+    s->status = EPROTO;
+  } else if (s->job.op == SERVE_STOP) {
+    s->last = 1;
+  } else {
+    s->size = serve_layout(&s->job, off);
+    if (s->size == 0 || fd < 0 || fstat(fd, &sb) != 0
+	|| (size_t) sb.st_size < s->size
+	|| !sealed(fd)) {
+      s->status = EINVAL;
+    } else {
+      void *p = mmap(NULL, s->size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd, 0);
+      if (p == MAP_FAILED)
+	s->status = errno;
+      else
+	s->base = (char *) p;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  s->ready = seconds();
+  s->load = s->ready - start;
+}
+
+static void *loader (void *arg)
+{
+  struct server *sv = (struct server *) arg;
+  int last = 0;
+
+  while (!last) {
+    pthread_mutex_lock(&sv->lock);
+    while (sv->tail - sv->head == sv->depth)
+      pthread_cond_wait(&sv->cond, &sv->lock);
+    struct slot *s = &sv->q[sv->tail % sv->depth];
+    pthread_mutex_unlock(&sv->lock);
+
+    do
+      s->conn = accept4(sv->sock, NULL, NULL, SOCK_CLOEXEC);
+    while (s->conn < 0 && (errno == EINTR || errno == ECONNABORTED));
+    if (s->conn >= 0) {
+      struct timeval tv = { SERVE_TIMEOUT, 0 };
+      setsockopt(s->conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    if (s->conn < 0) {
+      perror("accept");
+      s->base = NULL;
+      s->status = errno;
+      s->last = 1;
+      s->ready = seconds();
+      s->load = 0;
+    } else {
+      load(s);
+    }
+    last = s->last;
+
+    pthread_mutex_lock(&sv->lock);
+    sv->tail++;
+    pthread_cond_broadcast(&sv->cond);
+    pthread_mutex_unlock(&sv->lock);
+  }
+  return NULL;
+}
+
+int serve_run (const char *path, int depth, serve_fn fn, void *arg)
+{
+  struct server sv;
+  pthread_t thread;
+  int started, last = 0, ret = 0;
+
+  sv.depth = depth > 0 ? depth : 1;
+  sv.head = sv.tail = 0;
+  sv.sock = listen_on(path);
+  sv.q = (struct slot *) calloc(sv.depth, sizeof(struct slot));
+  if (sv.sock < 0 || sv.q == NULL) {
+    fprintf (stderr, "%s: %s\n", path, strerror(errno));
+    if (sv.sock >= 0)
+      close(sv.sock);
+    free(sv.q);
+    return -1;
+  }
+  pthread_mutex_init(&sv.lock, NULL);
+  pthread_cond_init(&sv.cond, NULL);
+  started = pthread_create(&thread, NULL, loader, &sv) == 0;
+  if (!started) {
+    fprintf (stderr, "%s: can't start the loader thread\n", path);
+    ret = -1;
+    last = 1;
+  }
+
+  while (!last) {
+    pthread_mutex_lock(&sv.lock);
+    while (sv.head == sv.tail)
+      pthread_cond_wait(&sv.cond, &sv.lock);
+    struct slot *s = &sv.q[sv.head % sv.depth];
+    pthread_mutex_unlock(&sv.lock);
+
+    double start = seconds();
+    struct serve_reply reply = { s->status, start - s->ready, s->load, 0 };
+    size_t off[3];
+    if (s->base != NULL && serve_layout(&s->job, off) != 0) {
+      reply.status = fn(arg, &s->job, (double *) (s->base + off[0]),
+			(double *) (s->base + off[1]),
+			(double *) (s->base + off[2]));
+      reply.compute = seconds() - start;
+    }
+    if (s->conn >= 0) {
+      send(s->conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+      close(s->conn);
+    } else {
+      ret = -1;
+    }
+    if (s->base != NULL)
+      munmap(s->base, s->size);
+    last = s->last;
+
+    pthread_mutex_lock(&sv.lock);
+    sv.head++;
+    pthread_cond_broadcast(&sv.cond);
+    pthread_mutex_unlock(&sv.lock);
+  }
+
+  if (started)
+    pthread_join(thread, NULL);
+  close(sv.sock);
+  unlink(path);
+  pthread_cond_destroy(&sv.cond);
+  pthread_mutex_destroy(&sv.lock);
+  free(sv.q);
+  return ret;
+}
+
+void *serve_alloc (const struct serve_job *job, int *fd)
+{
+  size_t off[3], size = serve_layout(job, off);
+  void *p = MAP_FAILED;
+
+  *fd = size != 0 ? memfd_create("mm-job", MFD_CLOEXEC | MFD_ALLOW_SEALING)
+    : -1;
+  if (*fd >= 0 && ftruncate(*fd, size) == 0
+      && fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == 0)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf (stderr, "job region of %lu bytes: %s\n", (unsigned long) size,
+	     size != 0 ? strerror(errno) : "bad sizes");
+    if (*fd >= 0)
+      close(*fd);
+    return NULL;
+  }
+  return p;
+}
+
+int serve_submit (const char *path, const struct serve_job *job, int fd,
+		  struct serve_reply *reply)
+{
+  char ctl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { (void *) job, sizeof(*job) };
+  struct sockaddr_un sa;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  ssize_t n = -1;
+  int sock = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(ctl, 0, sizeof(ctl));
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  }
+
+  if (address(path, &sa) == 0
+      && (sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) >= 0
+      && connect(sock, (struct sockaddr *) &sa, sizeof(sa)) == 0
+      && sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*job)) {
+    do
+      n = recv(sock, reply, sizeof(*reply), 0);
+    while (n < 0 && errno == EINTR);
+    if (n == 0)
+      errno = ECONNRESET;  /* the daemon went away without a reply */
+  }
+  if (n != sizeof(*reply)) {
+    fprintf (stderr, "%s: %s\n", path, strerror(errno));
+    if (sock >= 0)
+      close(sock);
+    return -1;
+  }
+  close(sock);
+  return 0;
+}
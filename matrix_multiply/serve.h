@@ -0,0 +1,83 @@
+/* Matrix multiply daemon
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Jobs:
+ *  SERVE_MUL   -- C (x by z)  =  A (x by y) times B (y by z)
+ *  SERVE_POWER -- C (x by x)  =  A (x by x) ^ power
+ *  SERVE_STOP  -- finish the jobs already queued, then exit
+ */
+#define SERVE_MUL   1
+#define SERVE_POWER 2
+#define SERVE_STOP  3
+
+#define SERVE_MAGIC 0x6d6d6a32  /* "mmj2", 64 bit sizes */
+
+/* Jobs the daemon holds mapped and ready behind the one computing */
+#define SERVE_DEPTH 4
+
+/* Seconds the loader waits for the job on a connection before giving
+ * up on it, so a silent client can't hold up the ones behind it */
+#define SERVE_TIMEOUT 10
+
+/* A request:
+ *  Sent with the descriptor of a shared memory region that holds A,
+ *  B and C one after another as row-major doubles, each starting on
+ *  a 64 byte boundary (see serve_layout).  The region must be a memfd
+ *  sealed against shrinking, so the client can't truncate it under a
+ *  running job.  SERVE_STOP has no region.
+ */
+struct serve_job {
+  uint32_t magic;
+  int32_t op;
+  int32_t power;
+  int64_t x, y, z;      /* y and z equal x for SERVE_POWER */
+};
+
+/* The answer, sent once C holds the result */
+struct serve_reply {
+  int32_t status;       /* 0, or an errno value */
+  double wait;          /* seconds queued behind earlier jobs */
+  double load;          /* seconds mapping and faulting in the region */
+  double compute;       /* seconds computing */
+};
+
+/* Offsets of A, B and C in the region of job; returns the size of
+ * the region, or 0 if the job is malformed */
+size_t serve_layout (const struct serve_job *job, size_t off[3]);
+
+/* A job computed by the daemon, with A, B and C pointing into its
+ * region.  Returns 0 or an errno value for the reply. */
+typedef int (*serve_fn) (void *arg, const struct serve_job *job,
+			 double *A, double *B, double *C);
+
+/* Daemon:
+ *  Listens on the Unix socket path and runs fn on each job, one at a
+ *  time in arrival order, on the calling thread.  A loader thread
+ *  accepts the connections and maps and faults in the region of each
+ *  job while the ones before it compute, keeping up to depth of them
+ *  ready.  Returns 0 after a SERVE_STOP job, or -1 with a message if
+ *  the socket can't be set up.
+ */
+int serve_run (const char *path, int depth, serve_fn fn, void *arg);
+
+/* Client:
+ *  serve_alloc makes, seals and maps a shared region for job,
+ *  returning it and its descriptor in *fd, or NULL with a message.  serve_submit
+ *  sends job and the region (fd -1 for none) to the daemon at path
+ *  and waits for its reply; it returns -1 with a message if the
+ *  daemon could not be reached.
+ */
+void *serve_alloc (const struct serve_job *job, int *fd);
+int serve_submit (const char *path, const struct serve_job *job, int fd,
+		  struct serve_reply *reply);
+
+#endif
@@ -0,0 +1,340 @@
+/* Sparse matrix multiply
+ *
+ *   Michael Albert
+ *
+ *  Both products go a row of S at a time: row i of the result is the
+ *  sum of the rows of the right hand side picked out by the nonzeros
+ *  of row i of S, scaled by them.  With a dense right hand side that
+ *  is a run of axpy's over contiguous rows; with a sparse one
+ *  (Gustavson's method) the sum is gathered in a dense scratch row
+ *  that remembers which columns it has touched.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include "sparse.h"
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPARSE_X86
+#endif
+
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
+
+/* A pool task is SPARSE_ROWS rows of S against a SPARSE_COLS wide
+ * panel of the dense B.  Tasks run panel by panel, so the threads
+ * all work out of the same panel of B while it is in cache. */
+#define SPARSE_ROWS 32
+#define SPARSE_COLS 256
+
+/* c[0 .. n-1] += v * b[0 .. n-1] */
+typedef void (*axpy_t) (int n, double v, const double *b, double *c);
+
+static void axpy_scalar (int n, double v, const double *restrict b,
+			 double *restrict c)
+{
+  for (int jx = 0; jx < n; jx++)
+    c[jx] += v * b[jx];
+}
+
+#ifdef SPARSE_X86
+#define SIMD_AXPY(name, isa, vec, W, loadu, storeu, bcast, fmadd)	\
+  __attribute__((target(isa)))						\
+  static void name (int n, double v, const double *b, double *c)	\
+  {									\
+    vec a = bcast(v);							\
+    int jx = 0;								\
+									\
+    for (; jx + 2*W <= n; jx += 2*W) {					\
+      storeu(&c[jx], fmadd(a, loadu(&b[jx]), loadu(&c[jx])));		\
+      storeu(&c[jx + W], fmadd(a, loadu(&b[jx + W]), loadu(&c[jx + W]))); \
+    }									\
+    for (; jx < n; jx++)						\
+      c[jx] += v * b[jx];						\
+  }
+
+SIMD_AXPY(axpy_avx2, "avx2,fma", __m256d, 4, _mm256_loadu_pd,
+	  _mm256_storeu_pd, _mm256_set1_pd, _mm256_fmadd_pd)
+SIMD_AXPY(axpy_avx512, "avx512f", __m512d, 8, _mm512_loadu_pd,
+	  _mm512_storeu_pd, _mm512_set1_pd, _mm512_fmadd_pd)
+#endif
+
+/* axpy for the instruction set kernel_select chose */
+static axpy_t axpy_kernel (void)
+{
+#ifdef SPARSE_X86
+  if (strcmp(kernel_isa(), "avx512") == 0)
+    return axpy_avx512;
+  if (strcmp(kernel_isa(), "avx2") == 0)
+    return axpy_avx2;
+#endif
+  return axpy_scalar;
+}
+
+double sparse_density (const double *A, long rows, long cols, long lda,
+		       long samples)
+{
+  long total = rows * cols, nz = 0, n, i;
+
+  if (total == 0)
+    return 0;
+  n = samples < total ? samples : total;
+  for (i = 0; i < n; i++) {
+    long at = (long)((double) i * total / n);
+    nz += A[idx(at / cols, at % cols, lda)] != 0;
+  }
+  return (double) nz / n;
+}
+
+/* b ^ k by squaring */
+static double power (double b, int k)
+{
+  double r = 1;
+
+  for (; k > 0; k >>= 1, b *= b)
+    if (k & 1)
+      r *= b;
+  return r;
+}
+
+int sparse_choice (double da, double db, int k)
+{
+  if (da >= SPARSE_DENSITY)
+    return SPARSE_OFF;
+  /* An element of C is zero if none of its k terms is */
+  if (1 - power(1 - da * db, k) < SPARSE_FILL)
+    return SPARSE_AB;
+  return SPARSE_A;
+}
+
+int csr_from_dense (struct csr *S, const double *A, long rows, long cols,
+		    long lda)
+{
+  long nnz = 0;
+  int ix, jx;
+
+  if (rows > INT_MAX || cols > INT_MAX)
+    return -1;
+  for (ix = 0; ix < rows; ix++)
+    for (jx = 0; jx < cols; jx++)
+      nnz += A[idx(ix,jx,lda)] != 0;
+  S->rows = rows;
+  S->cols = cols;
+  S->nnz = nnz;
+  S->rowptr = (long *) malloc(sizeof(long) * (rows + 1));
+  S->colind = (int *) malloc(sizeof(int) * (nnz ? nnz : 1));
+  S->val = (double *) malloc(sizeof(double) * (nnz ? nnz : 1));
+  if (S->rowptr == NULL || S->colind == NULL || S->val == NULL) {
+    csr_free(S);
+    return -1;
+  }
+  nnz = 0;
+  for (ix = 0; ix < rows; ix++) {
+    S->rowptr[ix] = nnz;
+    for (jx = 0; jx < cols; jx++) {
+      double v = A[idx(ix,jx,lda)];
+      if (v != 0) {
+	S->colind[nnz] = jx;
+	S->val[nnz++] = v;
+      }
+    }
+  }
+  S->rowptr[rows] = nnz;
+  return 0;
+}
+
+void csr_to_dense (const struct csr *S, double *C, long ldc)
+{
+  for (int ix = 0; ix < S->rows; ix++) {
+    double *c = &C[idx(ix,0,ldc)];
+    memset(c, 0, sizeof(double) * S->cols);
+    for (long p = S->rowptr[ix]; p < S->rowptr[ix + 1]; p++)
+      c[S->colind[p]] = S->val[p];
+  }
+}
+
+void csr_free (struct csr *S)
+{
+  free(S->rowptr);
+  free(S->colind);
+  free(S->val);
+  S->rowptr = NULL;
+  S->colind = NULL;
+  S->val = NULL;
+}
+
+/* A sparse multiply handed to the pool */
+struct spjob {
+  struct pool *pool;
+  const struct csr *S, *T;
+  const double *B;
+  long ldb, ldc;
+  int n;
+  double *C;
+  struct csr *R;   /* sparse result, NULL for a dense one */
+  axpy_t axpy;
+  int pass;        /* 0 counts the rows of R, 1 fills them */
+  int failed;
+};
+
+/* Rows r0 .. r1-1, cols c0 .. c1-1 of C = S times dense B */
+static void dense_rows (struct spjob *j, int r0, int r1, int c0, int c1)
+{
+  const struct csr *S = j->S;
+
+  for (int ix = r0; ix < r1; ix++) {
+    double *c = &j->C[idx(ix,c0,j->ldc)];
+    memset(c, 0, sizeof(double) * (c1 - c0));
+    for (long p = S->rowptr[ix]; p < S->rowptr[ix + 1]; p++)
+      j->axpy(c1 - c0, S->val[p],
+	      &j->B[idx(S->colind[p],c0,j->ldb)], c);
+  }
+}
+
+static int cmp_int (const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+/* Rows r0 .. r1-1 of R = S times T.  mark[c] holds the last row
+ * that touched column c, acc[c] its running sum, and cols the columns
+ * touched so far in this row.
+ */
+static void sparse_rows (struct spjob *j, int r0, int r1, int *mark,
+			 double *acc, int *cols)
+{
+  const struct csr *S = j->S, *T = j->T;
+  struct csr *R = j->R;
+
+  for (int ix = r0; ix < r1; ix++) {
+    int count = 0;
+    for (long p = S->rowptr[ix]; p < S->rowptr[ix + 1]; p++) {
+      int k = S->colind[p];
+      double v = S->val[p];
+      for (long q = T->rowptr[k]; q < T->rowptr[k + 1]; q++) {
+	int c = T->colind[q];
+	if (mark[c] != ix) {
+	  mark[c] = ix;
+	  acc[c] = 0;
+	  cols[count++] = c;
+	}
+	acc[c] += v * T->val[q];
+      }
+    }
+    if (j->pass == 0) {
+      R->rowptr[ix + 1] = count;
+      continue;
+    }
+    qsort(cols, count, sizeof(int), cmp_int);
+    long at = R->rowptr[ix];
+    for (int c = 0; c < count; c++) {
+      R->colind[at + c] = cols[c];
+      R->val[at + c] = acc[cols[c]];
+    }
+  }
+}
+
+/* Run rows of S in tasks of SPARSE_ROWS, with per-thread scratch for
+ * a sparse result */
+static void sparse_tasks (struct spjob *j, int threadn)
+{
+  int rowtasks = (j->S->rows + SPARSE_ROWS - 1) / SPARSE_ROWS;
+  int panels = j->R ? 1 : (j->n + SPARSE_COLS - 1) / SPARSE_COLS;
+  int ntasks = rowtasks * panels, next = 0;
+  int *mark = NULL, *cols = NULL;
+  double *acc = NULL;
+  int task;
+
+  if (j->R != NULL) {
+    int n = j->T->cols;
+    mark = (int *) malloc(sizeof(int) * n);
+    cols = (int *) malloc(sizeof(int) * n);
+    acc = (double *) malloc(sizeof(double) * n);
+    if (mark == NULL || cols == NULL || acc == NULL)
+      j->failed = 1;  /* any thread failing is enough */
+    else
+      for (int c = 0; c < n; c++)
+	mark[c] = -1;
+  }
+  if (j->pool != NULL) {
+    pool_queue(j->pool, threadn, ntasks);
+    pool_barrier(j->pool);
+  }
+  for (;;) {
+    if (j->pool != NULL)
+      task = pool_next_task(j->pool, threadn);
+    else
+      task = next < ntasks ? next++ : -1;
+    if (task < 0)
+      break;
+    int r0 = task % rowtasks * SPARSE_ROWS;
+    int r1 = r0 + SPARSE_ROWS < j->S->rows ? r0 + SPARSE_ROWS : j->S->rows;
+    int c0 = task / rowtasks * SPARSE_COLS;
+    int c1 = c0 + SPARSE_COLS < j->n ? c0 + SPARSE_COLS : j->n;
+    if (j->R == NULL)
+      dense_rows(j, r0, r1, c0, c1);
+    else if (mark != NULL && acc != NULL && cols != NULL)
+      sparse_rows(j, r0, r1, mark, acc, cols);
+  }
+  free(mark);
+  free(cols);
+  free(acc);
+}
+
+static void sparse_body (void *arg, int threadn, int threads)
+{
+  sparse_tasks((struct spjob *) arg, threadn);
+}
+
+static void run_job (struct spjob *j)
+{
+  if (j->pool != NULL)
+    pool_run(j->pool, sparse_body, j);
+  else
+    sparse_tasks(j, 0);
+}
+
+void sparse_dgemm (struct pool *pool, const struct csr *S, const double *B,
+		   long ldb, int n, double *C, long ldc)
+{
+  struct spjob j = { .pool = pool, .S = S, .B = B, .ldb = ldb, .ldc = ldc,
+		     .n = n, .C = C, .axpy = axpy_kernel() };
+  run_job(&j);
+}
+
+int sparse_spgemm (struct pool *pool, const struct csr *S,
+		   const struct csr *T, struct csr *C)
+{
+  struct spjob j = { .pool = pool, .S = S, .T = T, .R = C };
+  int ix;
+
+  C->rows = S->rows;
+  C->cols = T->cols;
+  C->colind = NULL;
+  C->val = NULL;
+  C->rowptr = (long *) malloc(sizeof(long) * (S->rows + 1));
+  if (C->rowptr == NULL)
+    return -1;
+
+  /* Count each row, then turn the counts into offsets */
+  run_job(&j);
+  C->rowptr[0] = 0;
+  for (ix = 0; ix < S->rows; ix++)
+    C->rowptr[ix + 1] += C->rowptr[ix];
+  C->nnz = C->rowptr[S->rows];
+  C->colind = (int *) malloc(sizeof(int) * (C->nnz ? C->nnz : 1));
+  C->val = (double *) malloc(sizeof(double) * (C->nnz ? C->nnz : 1));
+  if (j.failed || C->colind == NULL || C->val == NULL) {
+    csr_free(C);
+    return -1;
+  }
+  j.pass = 1;
+  run_job(&j);
+  if (j.failed) {
+    csr_free(C);
+    return -1;
+  }
+  return 0;
+}
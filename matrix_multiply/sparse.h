@@ -0,0 +1,74 @@
+/* Sparse matrix multiply
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "pool.h"
+
+/* Density of A below which a sparse multiply beats the blocked
+ * kernel, and the density of the product below which it pays to keep
+ * B sparse too */
+#define SPARSE_DENSITY 0.1
+#define SPARSE_FILL 0.2
+
+/* Elements sparse_density looks at */
+#define SPARSE_SAMPLES 100000
+
+/* Ways to multiply, from sparse_choice */
+#define SPARSE_OFF 0   /* dense A and B, the blocked kernel */
+#define SPARSE_A   1   /* CSR A times dense B */
+#define SPARSE_AB  2   /* CSR A times CSR B */
+
+/* Compressed sparse rows: the nonzeros of row i are
+ * val[rowptr[i] .. rowptr[i+1]-1], in columns colind[...], sorted.
+ */
+struct csr {
+  int rows, cols;
+  long nnz;
+  long *rowptr;
+  int *colind;
+  double *val;
+};
+
+/* Fraction of nonzero elements in A (rows by cols, row length lda),
+ * from about samples elements spread evenly over it, or from all of
+ * them if there are fewer.
+ */
+double sparse_density (const double *A, long rows, long cols, long lda,
+		       long samples);
+
+/* Best way to multiply A (density da) by B (density db) when the
+ * inner dimension is k */
+int sparse_choice (double da, double db, int k);
+
+/* Build S from the nonzeros of a dense matrix; -1 if out of memory
+ * or either dimension is too big for the int column indices */
+int csr_from_dense (struct csr *S, const double *A, long rows, long cols,
+		    long lda);
+
+/* Write S out as a dense matrix with row length ldc */
+void csr_to_dense (const struct csr *S, double *C, long ldc);
+
+void csr_free (struct csr *S);
+
+/* Sparse times dense:
+ *  C (m by n)  =  S (m by k) times B (k by n)
+ *  Row runs of S are tasks on the workers of pool, or all on the
+ *  calling thread if pool is NULL.
+ */
+void sparse_dgemm (struct pool *pool, const struct csr *S, const double *B,
+		   long ldb, int n, double *C, long ldc);
+
+/* Sparse times sparse:
+ *  C  =  S (m by k) times T (k by n), all CSR.  C is counted row by
+ *  row first, then filled, both passes spread over pool like
+ *  sparse_dgemm.  Returns -1 if out of memory.
+ */
+int sparse_spgemm (struct pool *pool, const struct csr *S,
+		   const struct csr *T, struct csr *C);
+
+#endif
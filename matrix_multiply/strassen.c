@@ -0,0 +1,243 @@
+/* Strassen-Winograd matrix multiply
+ *
+ *   Michael Albert
+ *
+ *  Winograd's form of Strassen: with A and B cut into quadrants,
+ *
+ *    S1 = A21 + A22   T1 = B12 - B11   M1 = A11 B11   M5 = S1 T1
+ *    S2 = S1  - A11   T2 = B22 - T1    M2 = A12 B21   M6 = S2 T2
+ *    S3 = A11 - A21   T3 = B22 - B12   M3 = S4  B22   M7 = S3 T3
+ *    S4 = A12 - S2    T4 = T2  - B21   M4 = A22 T4
+ *
+ *    C11 = M1 + M2          C21 = M1 + M6 + M7 - M4
+ *    C12 = M1 + M6 + M5 + M3  C22 = M1 + M6 + M7 + M5
+ *
+ *  so each level does seven half-size multiplies and 15 additions.
+ *  All temporaries come out of one arena sized up front.
+ */
+
+#include "strassen.h"
+#include "kernel.h"
+#include "arena.h"
+
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
+
+/* One of the seven products: M = X (h by h) times Y (h by h) */
+struct product {
+  const double *X, *Y;
+  long ldx, ldy;
+  double *M;
+};
+
+/* Z = X + sign * Y, all h by h */
+static void addsub (long h, const double *X, long ldx, const double *Y,
+		    long ldy, double sign, double *Z, long ldz)
+{
+  long ix, jx;
+
+  for (ix = 0; ix < h; ix++)
+    for (jx = 0; jx < h; jx++)
+      Z[idx(ix,jx,ldz)] = X[idx(ix,jx,ldx)] + sign * Y[idx(ix,jx,ldy)];
+}
+
+/* Bytes of temporaries a serial multiply of size n needs */
+static size_t space (long n, int cutoff)
+{
+  long h = n / 2;
+
+  if (n <= cutoff || n < 2)
+    return 0;
+  return ARENA_BYTES(15, sizeof(double) * h * h) + space(h, cutoff);
+}
+
+/* Form the sums and the product list for one level.
+ *  Returns -1 if the arena ran out.
+ */
+static int level (struct arena *ar, long h, const double *A, long lda,
+		  const double *B, long ldb, struct product *p)
+{
+  const double *A11 = A, *A12 = &A[h], *A21 = &A[idx(h,0,lda)],
+    *A22 = &A[idx(h,h,lda)];
+  const double *B11 = B, *B12 = &B[h], *B21 = &B[idx(h,0,ldb)],
+    *B22 = &B[idx(h,h,ldb)];
+  double *t[15];
+  int i;
+
+  for (i = 0; i < 15; i++)
+    if ((t[i] = (double *) arena_alloc(ar, sizeof(double) * h * h)) == NULL)
+      return -1;
+  double *S1 = t[0], *S2 = t[1], *S3 = t[2], *S4 = t[3];
+  double *T1 = t[4], *T2 = t[5], *T3 = t[6], *T4 = t[7];
+
+  addsub(h, A21, lda, A22, lda, 1, S1, h);
+  addsub(h, S1, h, A11, lda, -1, S2, h);
+  addsub(h, A11, lda, A21, lda, -1, S3, h);
+  addsub(h, A12, lda, S2, h, -1, S4, h);
+  addsub(h, B12, ldb, B11, ldb, -1, T1, h);
+  addsub(h, B22, ldb, T1, h, -1, T2, h);
+  addsub(h, B22, ldb, B12, ldb, -1, T3, h);
+  addsub(h, T2, h, B21, ldb, -1, T4, h);
+
+  p[0] = (struct product) { A11, B11, lda, ldb, t[8] };
+  p[1] = (struct product) { A12, B21, lda, ldb, t[9] };
+  p[2] = (struct product) { S4, B22, h, ldb, t[10] };
+  p[3] = (struct product) { A22, T4, lda, h, t[11] };
+  p[4] = (struct product) { S1, T1, h, h, t[12] };
+  p[5] = (struct product) { S2, T2, h, h, t[13] };
+  p[6] = (struct product) { S3, T3, h, h, t[14] };
+  return 0;
+}
+
+/* Put the seven products together into the quadrants of C */
+static void combine (long h, struct product *p, double *C, long ldc)
+{
+  double *M1 = p[0].M, *M2 = p[1].M, *M3 = p[2].M, *M4 = p[3].M,
+    *M5 = p[4].M, *M6 = p[5].M, *M7 = p[6].M;
+  long ix, jx;
+
+  for (ix = 0; ix < h; ix++) {
+    for (jx = 0; jx < h; jx++) {
+      size_t k = idx(ix,jx,h);
+      double u2 = M1[k] + M6[k];
+      double u3 = u2 + M7[k];
+      C[idx(ix,jx,ldc)] = M1[k] + M2[k];
+      C[idx(ix,jx+h,ldc)] = u2 + M5[k] + M3[k];
+      C[idx(ix+h,jx,ldc)] = u3 - M4[k];
+      C[idx(ix+h,jx+h,ldc)] = u3 + M5[k];
+    }
+  }
+}
+
+/* Odd n: the even m x m corner is done, add the last column of A
+ * times the last row of B to it and fill in the last row and column
+ * of C with the blocked kernel.
+ */
+static void peel (long n, const double *A, long lda, const double *B,
+		  long ldb, double *C, long ldc)
+{
+  long m = n - 1, ix, jx;
+
+  for (ix = 0; ix < m; ix++) {
+    double a = A[idx(ix,m,lda)];
+    for (jx = 0; jx < m; jx++)
+      C[idx(ix,jx,ldc)] += a * B[idx(m,jx,ldb)];
+  }
+  kernel_dgemm(m, 1, n, A, lda, &B[m], ldb, &C[m], ldc);
+  kernel_dgemm(1, n, n, &A[idx(m,0,lda)], lda, B, ldb, &C[idx(m,0,ldc)],
+	       ldc);
+}
+
+static int winograd (struct arena *ar, long n, const double *A, long lda,
+		     const double *B, long ldb, double *C, long ldc,
+		     int cutoff)
+{
+  struct product p[7];
+  long h = n / 2;
+  int i;
+
+  if (n <= cutoff || n < 2) {
+    kernel_dgemm(n, n, n, A, lda, B, ldb, C, ldc);
+    return 0;
+  }
+  size_t mark = arena_mark(ar);
+  if (level(ar, h, A, lda, B, ldb, p) != 0)
+    return -1;
+  for (i = 0; i < 7; i++)
+    if (winograd(ar, h, p[i].X, p[i].ldx, p[i].Y, p[i].ldy, p[i].M, h,
+		 cutoff) != 0)
+      return -1;
+  combine(h, p, C, ldc);
+  arena_release(ar, mark);
+  if (n & 1)
+    peel(n, A, lda, B, ldb, C, ldc);
+  return 0;
+}
+
+/* The seven top level products handed to the pool */
+struct job {
+  struct pool *pool;
+  struct product p[7];
+  struct arena ar[7];
+  long h;
+  int cutoff, failed;
+};
+
+static void product_body (void *arg, int threadn, int threads)
+{
+  struct job *job = (struct job *) arg;
+  int t;
+
+  pool_queue(job->pool, threadn, 7);
+  pool_barrier(job->pool);
+  while ((t = pool_next_task(job->pool, threadn)) >= 0) {
+    struct product *p = &job->p[t];
+    if (winograd(&job->ar[t], job->h, p->X, p->ldx, p->Y, p->ldy, p->M,
+		 job->h, job->cutoff) != 0)
+      job->failed = 1;
+  }
+}
+
+size_t strassen_bytes (struct pool *pool, long n, int cutoff)
+{
+  long h = n / 2;
+
+  if (cutoff < 1)
+    cutoff = 1;
+  if (pool == NULL || n <= cutoff || n < 2)
+    return space(n, cutoff);
+  return ARENA_BYTES(15, sizeof(double) * h * h)
+    + ARENA_BYTES(7, space(h, cutoff));
+}
+
+int strassen_dgemm_arena (struct arena *ar, struct pool *pool, long n,
+			  const double *A, long lda, const double *B, long ldb,
+			  double *C, long ldc, int cutoff)
+{
+  struct job job;
+  size_t mark = arena_mark(ar);
+  long h = n / 2;
+  int i, err = 0;
+
+  if (cutoff < 1)
+    cutoff = 1;
+  if (pool == NULL || n <= cutoff || n < 2) {
+    err = winograd(ar, n, A, lda, B, ldb, C, ldc, cutoff);
+    arena_release(ar, mark);
+    return err;
+  }
+
+  /* Top level in parallel, each product with its own arena */
+  size_t sub = space(h, cutoff);
+  job.pool = pool;
+  job.h = h;
+  job.cutoff = cutoff;
+  job.failed = 0;
+  err = level(ar, h, A, lda, B, ldb, job.p);
+  for (i = 0; i < 7 && err == 0; i++)
+    err = arena_sub(ar, &job.ar[i], sub);
+  if (err == 0) {
+    pool_run(pool, product_body, (void *) &job);
+    err = job.failed ? -1 : 0;
+  }
+  if (err == 0) {
+    combine(h, job.p, C, ldc);
+    if (n & 1)
+      peel(n, A, lda, B, ldb, C, ldc);
+  }
+  arena_release(ar, mark);
+  return err;
+}
+
+int strassen_dgemm (struct pool *pool, long n, const double *A, long lda,
+		    const double *B, long ldb, double *C, long ldc,
+		    int cutoff)
+{
+  struct arena ar;
+  int err;
+
+  if (arena_init(&ar, strassen_bytes(pool, n, cutoff)) != 0)
+    return -1;
+  err = strassen_dgemm_arena(&ar, pool, n, A, lda, B, ldb, C, ldc, cutoff);
+  arena_free(&ar);
+  return err;
+}
@@ -0,0 +1,41 @@
+/* Strassen-Winograd matrix multiply
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef STRASSEN_H
+#define STRASSEN_H
+
+#include <stddef.h>
+#include "pool.h"
+
+struct arena;
+
+/* Default size at or below which the recursion stops and the
+ * blocked kernel takes over */
+#define STRASSEN_CUTOFF 2048
+
+/* Square multiply:
+ *  C (n by n)  =  A (n by n) times B (n by n)
+ *  lda, ldb and ldc are the row lengths of the arrays holding A, B
+ *  and C.  Halves are split off until they are no bigger than cutoff;
+ *  an odd row and column are peeled off and done with the blocked
+ *  kernel.  With a pool, the seven products of the top level run on
+ *  its workers; pool may be NULL to run serially.
+ *  Returns -1 if the temporaries could not be allocated.
+ */
+int strassen_dgemm (struct pool *pool, long n, const double *A, long lda,
+		    const double *B, long ldb, double *C, long ldc,
+		    int cutoff);
+
+/* strassen_dgemm with its temporaries taken from ar, which must have
+ * strassen_bytes free, and released again before it returns; callers
+ * that multiply over and over keep one arena instead of allocating
+ * every time. */
+size_t strassen_bytes (struct pool *pool, long n, int cutoff);
+int strassen_dgemm_arena (struct arena *ar, struct pool *pool, long n,
+			  const double *A, long lda, const double *B, long ldb,
+			  double *C, long ldc, int cutoff);
+
+#endif
@@ -0,0 +1,626 @@
+/* Distributed matrix multiply
+ *
+ *   Michael Albert
+ *
+ *  SUMMA over TCP.  The processes form a grid and each one keeps its
+ *  own blocks of A, B and C; nothing but k panels of A and B ever
+ *  crosses the network.  At every step the process holding the
+ *  panel of A for its grid row sends it straight to the others in
+ *  the row, the holder of the panel of B does the same down its
+ *  column, and every process then adds the product of the two to
+ *  its block of C.
+ *
+ *  Every step involves only the processes of one row and one column
+ *  and all of them go through the steps in the same order, so plain
+ *  blocking sends and receives can't deadlock.  They run on a thread
+ *  of their own filling a ring of SUMMA_DEPTH panels, the way the
+ *  daemon's loader fills its slots, while the calling thread
+ *  multiplies the panels already there on the pool.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "summa.h"
+#include "blas.h"
+#include "arena.h"
+
+#define idx(x,y,col)  ((size_t)(x)*(col) + (y))
+
+#define SUMMA_MAGIC 0x6d6d7331   /* "mms1" */
+
+/* First thing on every connection, from the rank that connected */
+struct hello {
+  uint32_t magic;
+  int32_t rank, procs;
+};
+
+/* A k panel: columns k0 to k0 + w of A and rows of B.  The holder of
+ * a panel multiplies it from its own block, so A and B are views
+ * with row lengths lda and ldb; the rest receive it into bufA and
+ * bufB. */
+struct panel {
+  long k0, w;
+  const double *A, *B;
+  long lda, ldb;
+  double *bufA, *bufB;
+};
+
+struct run {
+  struct summa *s;
+  long k, mb, nb;               /* k, and this process's block of C */
+  const double *A, *B;
+  long lda, ldb;
+  long ak0, bk0;                /* first column of A here, row of B */
+  struct panel q[SUMMA_DEPTH];
+  long head, tail;              /* next panel to multiply, to fill */
+  int failed;
+  double comm, sent;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static double seconds (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void summa_part (long n, int parts, int i, long *first, long *last)
+{
+  *first = n / parts * i + (i < n % parts ? i : n % parts);
+  *last = *first + n / parts + (i < n % parts);
+}
+
+/* Whether a and b talk: same grid row or column, or one is rank 0 */
+static int linked (struct summa *s, int a, int b)
+{
+  return a != b && (a / s->cols == b / s->cols || a % s->cols == b % s->cols
+		    || a == 0 || b == 0);
+}
+
+static int send_all (int fd, const void *buf, size_t bytes)
+{
+  const char *p = (const char *) buf;
+
+  while (bytes > 0) {
+    ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    p += n;
+    bytes -= n;
+  }
+  return 0;
+}
+
+static int recv_all (int fd, void *buf, size_t bytes)
+{
+  char *p = (char *) buf;
+
+  while (bytes > 0) {
+    ssize_t n = recv(fd, p, bytes, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0)
+	errno = ECONNRESET;
+      return -1;
+    }
+    p += n;
+    bytes -= n;
+  }
+  return 0;
+}
+
+/* Host and port of rank in the list hosts, into host (size bytes).
+ * Returns -1 if the list has neither one nor procs entries. */
+static int entry (const char *hosts, int rank, int procs, char *host,
+		  size_t size, int *port)
+{
+  const char *e = hosts != NULL ? hosts : "127.0.0.1";
+  int count = 1, i;
+
+  for (const char *c = e; *c; c++)
+    count += *c == ',';
+  if (count != 1 && count != procs)
+    return -1;
+  for (i = count == 1 ? 0 : rank; i > 0; i--)
+    e = strchr(e, ',') + 1;
+  size_t len = strcspn(e, ",");
+  const char *colon = memchr(e, ':', len);
+  const char *end = e + len;
+
+  *port = SUMMA_PORT + (count == 1 ? rank : 0);
+  if (*e == '[' && memchr(e, ']', len) != NULL) {
+    /* [address]:port, for IPv6 */
+    end = (const char *) memchr(e, ']', len);
+    colon = end + 1 < e + len && end[1] == ':' ? end + 1 : NULL;
+    e++;
+  } else if (colon != NULL && memchr(colon + 1, ':', e + len - colon - 1)) {
+    colon = NULL;   /* a bare IPv6 address */
+  } else if (colon != NULL) {
+    end = colon;
+  }
+  if (colon != NULL)
+    *port = atoi(colon + 1) + (count == 1 ? rank : 0);
+  if ((size_t)(end - e) >= size || *port <= 0 || *port > 65535)
+    return -1;
+  memcpy(host, e, end - e);
+  host[end - e] = 0;
+  return 0;
+}
+
+static struct addrinfo *resolve (const char *host, int port, int passive)
+{
+  struct addrinfo hints, *res;
+  char service[16];
+  int err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  snprintf(service, sizeof(service), "%d", port);
+  if ((err = getaddrinfo(host, service, &hints, &res)) != 0) {
+    fprintf (stderr, "%s: %s\n", host, gai_strerror(err));
+    return NULL;
+  }
+  return res;
+}
+
+static int listen_on (const char *host, int port)
+{
+  struct addrinfo *res = resolve(host, port, 1), *ai;
+  int sock = -1, on = 1;
+
+  for (ai = res; ai != NULL && sock < 0; ai = ai->ai_next) {
+    sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+		  ai->ai_protocol);
+    if (sock < 0)
+      continue;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sock, ai->ai_addr, ai->ai_addrlen) != 0
+	|| listen(sock, SOMAXCONN) != 0) {
+      int err = errno;
+      close(sock);
+      sock = -1;
+      errno = err;
+    }
+  }
+  if (res != NULL)
+    freeaddrinfo(res);
+  if (sock < 0 && res != NULL)
+    fprintf (stderr, "%s port %d: %s\n", host, port, strerror(errno));
+  return sock;
+}
+
+/* Connect to host, retrying until SUMMA_CONNECT_SECONDS have gone by
+ * in case it hasn't started listening yet */
+static int connect_to (const char *host, int port)
+{
+  struct addrinfo *res = resolve(host, port, 0), *ai;
+  struct timespec pause = { 0, 50000000 };
+  double deadline = seconds() + SUMMA_CONNECT_SECONDS;
+  int sock = -1;
+
+  while (res != NULL && sock < 0) {
+    for (ai = res; ai != NULL && sock < 0; ai = ai->ai_next) {
+      sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+		    ai->ai_protocol);
+      if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+	int err = errno;
+	close(sock);
+	sock = -1;
+	errno = err;
+      }
+    }
+    if (sock < 0 && seconds() > deadline) {
+      fprintf (stderr, "%s port %d: %s\n", host, port, strerror(errno));
+      break;
+    }
+    if (sock < 0)
+      nanosleep(&pause, NULL);
+  }
+  if (res != NULL)
+    freeaddrinfo(res);
+  return sock;
+}
+
+static void nodelay (int sock)
+{
+  int on = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int summa_init (struct summa *s, int rank, int procs, const char *hosts)
+{
+  char host[256];
+  int port, sock, q, waiting = 0;
+
+  s->fd = NULL;
+  if (procs < 1 || rank < 0 || rank >= procs)
+    return -1;
+  s->rank = rank;
+  s->procs = procs;
+  for (s->rows = 1, q = 1; (long) q * q <= procs; q++)
+    if (procs % q == 0)
+      s->rows = q;
+  s->cols = procs / s->rows;
+  s->prow = rank / s->cols;
+  s->pcol = rank % s->cols;
+  s->fd = (int *) malloc(sizeof(int) * procs);
+  if (s->fd == NULL)
+    return -1;
+  for (q = 0; q < procs; q++)
+    s->fd[q] = -1;
+  if (entry(hosts, rank, procs, host, sizeof(host), &port) != 0) {
+    fprintf (stderr, "%s: need one host, or one for each of %d ranks\n",
+	     hosts, procs);
+    return -1;
+  }
+
+  /* listen before connecting, so no two ranks wait on each other */
+  sock = listen_on(host, port);
+  if (sock < 0)
+    return -1;
+  for (q = 0; q < procs; q++) {
+    if (!linked(s, rank, q))
+      continue;
+    if (q > rank) {
+      waiting++;
+      continue;
+    }
+    struct hello h = { SUMMA_MAGIC, rank, procs };
+    if (entry(hosts, q, procs, host, sizeof(host), &port) != 0
+	|| (s->fd[q] = connect_to(host, port)) < 0
+	|| send_all(s->fd[q], &h, sizeof(h)) != 0) {
+      fprintf (stderr, "Rank %d can't reach rank %d\n", rank, q);
+      close(sock);
+      return -1;
+    }
+    nodelay(s->fd[q]);
+  }
+  while (waiting > 0) {
+    struct hello h;
+    int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0 && (errno == EINTR || errno == ECONNABORTED))
+      continue;
+    if (conn < 0 || recv_all(conn, &h, sizeof(h)) != 0
+	|| h.magic != SUMMA_MAGIC || h.procs != procs
+	|| h.rank <= rank || h.rank >= procs || !linked(s, rank, h.rank)
+	|| s->fd[h.rank] >= 0) {
+      fprintf (stderr, "Rank %d: bad connection from another process\n",
+	       rank);
+      if (conn >= 0)
+	close(conn);
+      close(sock);
+      return -1;
+    }
+    nodelay(conn);
+    s->fd[h.rank] = conn;
+    waiting--;
+  }
+  close(sock);
+  return 0;
+}
+
+void summa_close (struct summa *s)
+{
+  if (s->fd == NULL)
+    return;
+  for (int q = 0; q < s->procs; q++)
+    if (s->fd[q] >= 0)
+      close(s->fd[q]);
+  free(s->fd);
+  s->fd = NULL;
+}
+
+int summa_barrier (struct summa *s)
+{
+  char c = 0;
+  int q;
+
+  if (s->rank != 0)
+    return send_all(s->fd[0], &c, 1) != 0 || recv_all(s->fd[0], &c, 1) != 0
+	   ? -1 : 0;
+  for (q = 1; q < s->procs; q++)
+    if (recv_all(s->fd[q], &c, 1) != 0)
+      return -1;
+  for (q = 1; q < s->procs; q++)
+    if (send_all(s->fd[q], &c, 1) != 0)
+      return -1;
+  return 0;
+}
+
+/* Width of the panel starting at k0, which stops at the end of the
+ * blocks of A and B holding it; the grid column holding it in A and
+ * row in B go in *qa and *rb. */
+static long panel (struct summa *s, long k, long k0, int *qa, int *rb)
+{
+  long first, alast, blast, w = SUMMA_PANEL;
+
+  for (*qa = 0; summa_part(k, s->cols, *qa, &first, &alast), alast <= k0;
+       ++*qa)
+    ;
+  for (*rb = 0; summa_part(k, s->rows, *rb, &first, &blast), blast <= k0;
+       ++*rb)
+    ;
+  if (w > alast - k0)
+    w = alast - k0;
+  if (w > blast - k0)
+    w = blast - k0;
+  return w;
+}
+
+/* Panels needed for k */
+static long steps (struct summa *s, long k)
+{
+  long count = 0;
+  int qa, rb;
+
+  for (long k0 = 0; k0 < k; k0 += panel(s, k, k0, &qa, &rb))
+    count++;
+  return count;
+}
+
+/* Hand the panel to every other process of its row or column, or
+ * receive it from its holder */
+static int share (struct run *r, int holder, int step, const double *buf,
+		  double *into, size_t bytes)
+{
+  struct summa *s = r->s;
+
+  if (bytes == 0)
+    return 0;
+  if (holder != s->rank)
+    return recv_all(s->fd[holder], into, bytes);
+  for (int q = 0; q < s->procs; q++) {
+    if (q == s->rank
+	|| (step == 0 ? q / s->cols != s->prow : q % s->cols != s->pcol))
+      continue;
+    if (send_all(s->fd[q], buf, bytes) != 0)
+      return -1;
+    r->sent += bytes;
+  }
+  return 0;
+}
+
+/* Fill panel p from k0 on */
+static int fetch (struct run *r, struct panel *p, long k0)
+{
+  struct summa *s = r->s;
+  long w = p->w;
+  int qa, rb;
+
+  panel(s, r->k, k0, &qa, &rb);
+  if (s->pcol == qa) {
+    p->A = r->A + (k0 - r->ak0);
+    p->lda = r->lda;
+    if (s->cols > 1)
+      for (long ix = 0; ix < r->mb; ix++)
+	memcpy(&p->bufA[idx(ix,0,w)], &p->A[idx(ix,0,r->lda)],
+	       sizeof(double) * w);
+  } else {
+    p->A = p->bufA;
+    p->lda = w;
+  }
+  if (share(r, s->prow * s->cols + qa, 0, p->bufA, p->bufA,
+	    sizeof(double) * r->mb * w) != 0)
+    return -1;
+
+  const double *send = p->bufB;
+  if (s->prow == rb) {
+    p->B = r->B + idx(k0 - r->bk0,0,r->ldb);
+    p->ldb = r->ldb;
+    if (r->ldb == r->nb)
+      send = p->B;
+    else if (s->rows > 1)
+      for (long ix = 0; ix < w; ix++)
+	memcpy(&p->bufB[idx(ix,0,r->nb)], &p->B[idx(ix,0,r->ldb)],
+	       sizeof(double) * r->nb);
+  } else {
+    p->B = p->bufB;
+    p->ldb = r->nb > 1 ? r->nb : 1;
+  }
+  return share(r, rb * s->cols + s->pcol, 1, send, p->bufB,
+	       sizeof(double) * w * r->nb);
+}
+
+static void *comm (void *arg)
+{
+  struct run *r = (struct run *) arg;
+  long k0 = 0;
+  int qa, rb;
+
+  while (k0 < r->k) {
+    pthread_mutex_lock(&r->lock);
+    while (r->tail - r->head == SUMMA_DEPTH && !r->failed)
+      pthread_cond_wait(&r->cond, &r->lock);
+    struct panel *p = &r->q[r->tail % SUMMA_DEPTH];
+    int failed = r->failed;
+    pthread_mutex_unlock(&r->lock);
+    if (failed)
+      break;
+
+    double start = seconds();
+    p->k0 = k0;
+    p->w = panel(r->s, r->k, k0, &qa, &rb);
+    failed = fetch(r, p, k0) != 0;
+    r->comm += seconds() - start;
+    k0 += p->w;
+
+    pthread_mutex_lock(&r->lock);
+    if (failed) {
+      perror("summa");
+      r->failed = 1;
+    } else {
+      r->tail++;
+    }
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (failed)
+      break;
+  }
+  return NULL;
+}
+
+static size_t panel_bytes (struct summa *s, long m, long n, long k,
+			   long *mb, long *nb, long *w)
+{
+  long first, last;
+
+  summa_part(m, s->rows, s->prow, &first, &last);
+  *mb = last - first;
+  summa_part(n, s->cols, s->pcol, &first, &last);
+  *nb = last - first;
+  *w = k < SUMMA_PANEL ? k : SUMMA_PANEL;
+  return ARENA_BYTES(1, sizeof(double) * *mb * *w)
+	 + ARENA_BYTES(1, sizeof(double) * *w * *nb);
+}
+
+size_t summa_bytes (struct summa *s, long m, long n, long k)
+{
+  long mb, nb, w;
+  size_t bytes = SUMMA_DEPTH * panel_bytes(s, m, n, k, &mb, &nb, &w);
+
+  return bytes + blas_bytes(BLAS_ROW_MAJOR, mb, nb, w);
+}
+
+int summa_dgemm (struct summa *s, struct pool *pool, struct arena *ar,
+		 long m, long n, long k, const double *A, long lda,
+		 const double *B, long ldb, double *C, long ldc,
+		 struct summa_stats *st)
+{
+  double start = seconds(), compute = 0, wait = 0;
+  long count = steps(s, k), last, w, t;
+  size_t mark = arena_mark(ar);
+  struct run r;
+  pthread_t thread;
+  int i, started = 0, err = 0;
+
+  memset(&r, 0, sizeof(r));
+  r.s = s;
+  r.k = k;
+  r.A = A;
+  r.B = B;
+  r.lda = lda;
+  r.ldb = ldb;
+  summa_part(k, s->cols, s->pcol, &r.ak0, &last);
+  summa_part(k, s->rows, s->prow, &r.bk0, &last);
+  panel_bytes(s, m, n, k, &r.mb, &r.nb, &w);
+  for (i = 0; i < SUMMA_DEPTH; i++) {
+    r.q[i].bufA = (double *) arena_alloc(ar, sizeof(double) * r.mb * w);
+    r.q[i].bufB = (double *) arena_alloc(ar, sizeof(double) * w * r.nb);
+    if ((r.mb * w != 0 && r.q[i].bufA == NULL)
+	|| (w * r.nb != 0 && r.q[i].bufB == NULL)) {
+      arena_release(ar, mark);
+      return -1;
+    }
+  }
+  if (k == 0) {
+    for (long ix = 0; ix < r.mb; ix++)
+      memset(&C[idx(ix,0,ldc)], 0, sizeof(double) * r.nb);
+    count = 0;
+  }
+
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.cond, NULL);
+  if (count > 0) {
+    started = pthread_create(&thread, NULL, comm, &r) == 0;
+    if (!started) {
+      fprintf (stderr, "summa: can't start the communication thread\n");
+      count = 0;
+      err = -1;
+    }
+  }
+
+  for (t = 0; t < count; t++) {
+    double idle = seconds();
+    pthread_mutex_lock(&r.lock);
+    while (r.tail == t && !r.failed)
+      pthread_cond_wait(&r.cond, &r.lock);
+    int failed = r.tail == t;
+    pthread_mutex_unlock(&r.lock);
+    if (failed) {
+      err = -1;
+      break;
+    }
+
+    struct panel *p = &r.q[t % SUMMA_DEPTH];
+    double busy = seconds();
+    wait += busy - idle;
+    if (r.mb > 0 && r.nb > 0
+	&& blas_dgemm_arena(ar, pool, BLAS_ROW_MAJOR, BLAS_NO_TRANS,
+			    BLAS_NO_TRANS, r.mb, r.nb, p->w, 1, p->A, p->lda,
+			    p->B, p->ldb, t == 0 ? 0 : 1, C, ldc) != 0)
+      err = -1;
+    compute += seconds() - busy;
+
+    pthread_mutex_lock(&r.lock);
+    if (err != 0)
+      r.failed = 1;
+    r.head++;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+    if (err != 0)
+      break;
+  }
+
+  if (started)
+    pthread_join(thread, NULL);
+  pthread_cond_destroy(&r.cond);
+  pthread_mutex_destroy(&r.lock);
+  arena_release(ar, mark);
+  if (st != NULL) {
+    st->time = seconds() - start;
+    st->compute = compute;
+    st->wait = wait;
+    st->comm = r.comm;
+    st->sent = r.sent;
+    st->panels = t;
+  }
+  return err;
+}
+
+int summa_gather (struct summa *s, long m, long n, const double *Cb,
+		  long ldb, double *C, long ldc)
+{
+  long i0, i1, j0, j1, ix;
+
+  if (s->rank != 0) {
+    summa_part(m, s->rows, s->prow, &i0, &i1);
+    summa_part(n, s->cols, s->pcol, &j0, &j1);
+    if (ldb == j1 - j0)
+      return send_all(s->fd[0], Cb, sizeof(double) * (i1 - i0) * (j1 - j0));
+    for (ix = 0; ix < i1 - i0; ix++)
+      if (send_all(s->fd[0], &Cb[idx(ix,0,ldb)],
+		   sizeof(double) * (j1 - j0)) != 0)
+	return -1;
+    return 0;
+  }
+  for (int q = 0; q < s->procs; q++) {
+    summa_part(m, s->rows, q / s->cols, &i0, &i1);
+    summa_part(n, s->cols, q % s->cols, &j0, &j1);
+    for (ix = i0; ix < i1; ix++) {
+      double *row = &C[idx(ix,j0,ldc)];
+      if (q == 0)
+	memcpy(row, &Cb[idx(ix - i0,0,ldb)], sizeof(double) * (j1 - j0));
+      else if (recv_all(s->fd[q], row, sizeof(double) * (j1 - j0)) != 0)
+	return -1;
+    }
+  }
+  return 0;
+}
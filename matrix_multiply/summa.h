@@ -0,0 +1,96 @@
+/* Distributed matrix multiply
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef SUMMA_H
+#define SUMMA_H
+
+#include <stddef.h>
+#include "pool.h"
+
+struct arena;
+
+/* Port of rank 0 when the host list gives none; rank r listens on
+ * the port of its own entry, by default SUMMA_PORT + r */
+#define SUMMA_PORT 47000
+
+/* Widest k panel broadcast at a time, and panels a process keeps
+ * in flight: one being multiplied while the next arrives */
+#define SUMMA_PANEL 256
+#define SUMMA_DEPTH 2
+
+/* Seconds to keep retrying a connection to a rank that is not
+ * listening yet */
+#define SUMMA_CONNECT_SECONDS 30
+
+/* A process in a grid of procs processes:
+ *  rows by cols of them, rows the largest divisor of procs no bigger
+ *  than its square root, rank r at row r / cols and column r % cols.
+ *  fd holds a TCP connection to every rank in the same grid row or
+ *  column, and between rank 0 and everyone, -1 for the rest.
+ */
+struct summa {
+  int rank, procs;
+  int rows, cols;       /* grid shape */
+  int prow, pcol;       /* this process in it */
+  int *fd;
+};
+
+/* Time spent by one summa_dgemm */
+struct summa_stats {
+  double time;          /* seconds, start to finish */
+  double compute;       /* multiplying panels */
+  double wait;          /* multiplier idle, waiting for a panel */
+  double comm;          /* sending and receiving panels */
+  double sent;          /* bytes sent */
+  long panels;
+};
+
+/* Join the grid as rank of procs.
+ *  hosts is a comma separated list of host or host:port, one per
+ *  rank, or a single entry used for all of them; NULL is 127.0.0.1.
+ *  Listens on this rank's port, connects to the lower ranks it needs
+ *  (retrying while they start up) and accepts the higher ones.
+ *  Returns -1 with a message on failure.
+ */
+int summa_init (struct summa *s, int rank, int procs, const char *hosts);
+void summa_close (struct summa *s);
+
+/* Part i of n split as evenly as possible into parts:
+ *  [*first, *last).  Every block of A, B and C is cut this way. */
+void summa_part (long n, int parts, int i, long *first, long *last);
+
+/* Wait until every rank has called it */
+int summa_barrier (struct summa *s);
+
+/* SUMMA:
+ *  C (m by n)  =  A (m by k) times B (k by n)
+ *  Each process holds the blocks at its place in the grid: rows
+ *  part(m, rows, prow) of A and C, cols part(n, cols, pcol) of B and
+ *  C, and of k, cols part(k, cols, pcol) of A and rows part(k, rows,
+ *  prow) of B.  k goes by in panels no wider than SUMMA_PANEL: the
+ *  owner of each panel of A sends it along its grid row and the owner
+ *  of the panel of B down its grid column, and every process adds
+ *  their product to its block of C with blas_dgemm on pool.  A
+ *  thread does the sending and receiving, up to SUMMA_DEPTH panels
+ *  ahead, so the next panels travel while the current one is
+ *  multiplied.  The panels and packing buffers come from ar, which
+ *  must have summa_bytes free.  st may be NULL.  Returns -1 if a
+ *  connection failed or the buffers could not be had.
+ */
+size_t summa_bytes (struct summa *s, long m, long n, long k);
+int summa_dgemm (struct summa *s, struct pool *pool, struct arena *ar,
+		 long m, long n, long k, const double *A, long lda,
+		 const double *B, long ldb, double *C, long ldc,
+		 struct summa_stats *st);
+
+/* Collect the blocks of C (m by n) on rank 0:
+ *  every rank passes its block Cb (row length ldb), and rank 0 gets
+ *  the whole matrix in C with row length ldc; C is unused elsewhere.
+ */
+int summa_gather (struct summa *s, long m, long n, const double *Cb,
+		  long ldb, double *C, long ldc);
+
+#endif
@@ -0,0 +1,169 @@
+/* NUMA placement for matrix buffers and worker threads
+ *
+ *   Michael Albert
+ *
+ *  Talks to the kernel directly (mbind and move_pages through
+ *  syscall) so nothing beyond libc is needed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "topology.h"
+#include "arena.h"
+
+#define MAXNODES 64
+#define MPOL_INTERLEAVE 3
+
+static int nodes = 0;
+static int ncpus = 0;
+static int *cpus = NULL;      /* usable CPUs, ordered by node */
+static int *cpunode = NULL;   /* node of cpus[i] */
+static int page_backing = ARENA_THP;  /* of topo_alloc */
+
+/* Parse a /sys cpulist such as "0-3,8-11" into allowed CPUs */
+static void add_cpulist (const char *list, int node, cpu_set_t *allowed)
+{
+  const char *p = list;
+
+  while (*p && *p != '\n') {
+    char *end;
+    int lo = (int) strtol(p, &end, 10), hi = lo;
+    if (end == p)
+      break;
+    if (*end == '-')
+      hi = (int) strtol(end + 1, &end, 10);
+    for (int c = lo; c <= hi; c++) {
+      if (c < CPU_SETSIZE && ncpus < CPU_SETSIZE && CPU_ISSET(c, allowed)) {
+	cpus[ncpus] = c;
+	cpunode[ncpus++] = node;
+      }
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+}
+
+/* Read the tables once, whichever thread asks first: the pool's
+ * workers all pin themselves at the same time */
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+
+static void topo_load (void)
+{
+  cpu_set_t allowed;
+  char path[64], list[4096];
+
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  cpus = (int *) malloc(sizeof(int) * CPU_SETSIZE);
+  cpunode = (int *) malloc(sizeof(int) * CPU_SETSIZE);
+  if (cpus == NULL || cpunode == NULL) {
+    nodes = 1;
+    return;
+  }
+
+  for (int n = 0; n < MAXNODES; n++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+      continue;
+    if (fgets(list, sizeof(list), f) != NULL) {
+      add_cpulist(list, n, &allowed);
+      nodes = n + 1;
+    }
+    fclose(f);
+  }
+  if (ncpus == 0) {
+    nodes = 1;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+      if (CPU_ISSET(c, &allowed)) {
+	cpus[ncpus] = c;
+	cpunode[ncpus++] = 0;
+      }
+    }
+  }
+}
+
+void topo_init (void)
+{
+  pthread_once(&topo_once, topo_load);
+}
+
+int topo_nodes (void)
+{
+  topo_init();
+  return nodes;
+}
+
+int topo_thread_node (int threadn)
+{
+  topo_init();
+  return ncpus ? cpunode[threadn % ncpus] : 0;
+}
+
+int topo_pin (int threadn)
+{
+  cpu_set_t set;
+
+  topo_init();
+  if (ncpus == 0)
+    return 0;
+  CPU_ZERO(&set);
+  CPU_SET(cpus[threadn % ncpus], &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  return cpunode[threadn % ncpus];
+}
+
+void topo_backing (int backing)
+{
+  page_backing = backing;
+}
+
+void *topo_alloc (size_t bytes, int interleave)
+{
+  topo_init();
+  void *p = arena_pages(bytes, page_backing);
+  if (p == NULL)
+    return NULL;
+  if (interleave && nodes > 1) {
+    unsigned long mask = (nodes >= 64) ? ~0UL : (1UL << nodes) - 1;
+    if (syscall(SYS_mbind, p, bytes, MPOL_INTERLEAVE, &mask,
+		(unsigned long) nodes + 1, 0) != 0)
+      perror("mbind");
+  }
+  return p;
+}
+
+void topo_free (void *p, size_t bytes)
+{
+  arena_unpages(p, bytes);
+}
+
+int topo_pages (void *p, size_t bytes, long *counts)
+{
+  long pagesize = sysconf(_SC_PAGESIZE);
+  unsigned long count = (bytes + pagesize - 1) / pagesize;
+  void **pages = (void **) malloc(sizeof(void *) * count);
+  int *status = (int *) malloc(sizeof(int) * count);
+  int err = 0;
+
+  topo_init();
+  for (unsigned long i = 0; i < count; i++)
+    pages[i] = (char *) p + i * pagesize;
+  memset(counts, 0, sizeof(long) * nodes);
+  if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) != 0) {
+    err = -1;
+  } else {
+    for (unsigned long i = 0; i < count; i++)
+      if (status[i] >= 0 && status[i] < nodes)
+	counts[status[i]]++;
+  }
+  free(pages);
+  free(status);
+  return err;
+}
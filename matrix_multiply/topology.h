@@ -0,0 +1,47 @@
+/* NUMA placement for matrix buffers and worker threads
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stddef.h>
+
+/* Read the node layout from /sys.  Machines without NUMA, or
+ * without /sys, look like one node holding every CPU we may use.
+ */
+void topo_init (void);
+
+/* Number of memory nodes */
+int topo_nodes (void);
+
+/* Pin the calling thread to CPU threadn of the node-ordered CPU
+ * list, so consecutive threads fill a node before moving to the
+ * next.  Returns the node it landed on.
+ */
+int topo_pin (int threadn);
+
+/* Node the CPU a thread with this number is pinned to belongs to */
+int topo_thread_node (int threadn);
+
+/* Page aligned, untouched memory for a matrix.  With interleave the
+ * pages are spread round robin over all nodes, otherwise each page
+ * lands on the node of the thread that first writes it.  Matrices of
+ * 2 MiB or more get huge pages as topo_backing says.
+ */
+void *topo_alloc (size_t bytes, int interleave);
+void topo_free (void *p, size_t bytes);
+
+/* Page backing of later topo_alloc calls, ARENA_SMALL, ARENA_THP
+ * (the default) or ARENA_HUGETLB from arena.h */
+void topo_backing (int backing);
+
+/* Count how many pages of [p, p+bytes) sit on each node.
+ *  counts has topo_nodes() entries; returns -1 if the kernel will
+ *  not say.
+ */
+int topo_pages (void *p, size_t bytes, long *counts);
+
+#endif
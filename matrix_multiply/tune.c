@@ -0,0 +1,92 @@
+/* Tuned configuration file
+ *
+ *   Michael Albert
+ *
+ *  pt-mm -u sweeps the blocking, micro-kernel and thread count and
+ *  saves the best here; both programs read it back at start-up, and
+ *  their command line options still override it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernel.h"
+#include "tune.h"
+
+const char *tune_path (void)
+{
+  static char path[4096];
+  const char *env = getenv("MM_TUNE");
+  const char *home = getenv("HOME");
+
+  if (env != NULL)
+    return *env ? env : NULL;
+  if (home == NULL)
+    return NULL;
+  snprintf(path, sizeof(path), "%s/.mm-tune", home);
+  return path;
+}
+
+int tune_load (const char *path, struct tune *t)
+{
+  FILE *f = fopen(path, "r");
+  char line[256], key[32], val[16];
+  int err = 0;
+
+  memset(t, 0, sizeof(*t));
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *hash = strchr(line, '#');
+    if (hash != NULL)
+      *hash = '\0';
+    int n = sscanf(line, "%31s %15s", key, val);
+    if (n <= 0)
+      continue;
+    if (n == 2 && strcmp(key, "isa") == 0)
+      snprintf(t->isa, sizeof(t->isa), "%s", val);
+    else if (n == 2 && strcmp(key, "mc") == 0)
+      t->mc = atoi(val);
+    else if (n == 2 && strcmp(key, "kc") == 0)
+      t->kc = atoi(val);
+    else if (n == 2 && strcmp(key, "nc") == 0)
+      t->nc = atoi(val);
+    else if (n == 2 && strcmp(key, "tile_n") == 0)
+      t->tile_n = atoi(val);
+    else if (n == 2 && strcmp(key, "threads") == 0)
+      t->threads = atoi(val);
+    else
+      err = -2;
+  }
+  fclose(f);
+  if (err != 0)
+    fprintf (stderr, "%s: unrecognised lines ignored\n", path);
+  return err;
+}
+
+int tune_save (const char *path, const struct tune *t)
+{
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  fprintf (f, "# matrix multiply tuning, written by pt-mm -u\n");
+  if (t->isa[0])
+    fprintf (f, "isa %s\n", t->isa);
+  fprintf (f, "mc %d\nkc %d\nnc %d\ntile_n %d\nthreads %d\n", t->mc, t->kc,
+           t->nc, t->tile_n, t->threads);
+  if (fclose(f) != 0) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+void tune_apply (const struct tune *t)
+{
+  if (t->isa[0])
+    kernel_select(t->isa);
+  kernel_blocking(t->mc, t->kc, t->nc);
+}
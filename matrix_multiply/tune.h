@@ -0,0 +1,38 @@
+/* Tuned configuration file
+ *
+ *   Michael Albert
+ *
+ */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+/* What the autotuner picks.  Zero or an empty isa means not set. */
+struct tune {
+  char isa[16];      /* micro-kernel, as for kernel_select */
+  int mc, kc, nc;    /* cache blocks, see kernel.h */
+  int tile_n;        /* columns of C per pool task in pt-mm */
+  int threads;       /* pt-mm default for -n */
+};
+
+/* File the configuration is kept in: $MM_TUNE if that is set, else
+ * .mm-tune in the home directory.  NULL when MM_TUNE is empty, which
+ * turns tuning off.
+ */
+const char *tune_path (void);
+
+/* Read path into t, leaving unset fields zero.  Lines are "key value",
+ * # starts a comment.  Returns -1 if the file can't be opened and -2
+ * if a line can't be parsed.
+ */
+int tune_load (const char *path, struct tune *t);
+
+/* Write t to path; returns -1 on failure */
+int tune_save (const char *path, const struct tune *t);
+
+/* Select the micro-kernel and cache blocks of t.  An isa this CPU
+ * does not support is skipped.
+ */
+void tune_apply (const struct tune *t);
+
+#endif